@@ -7,52 +7,82 @@
 #include "vr_sandesh.h"
 #include "vr_message.h"
 #include "vnsw_ip4_mtrie.h"
+#include "vr_btable.h"
 
 extern struct vr_nexthop *ip4_default_nh; 
 
-static struct vr_vrf_stats **mtrie_vrf_stats;
-static struct vr_vrf_stats *invalid_vrf_stats;
+/*
+ * the counters of a cpu for a run of MTRIE_STATS_CHUNK vrfs are together,
+ * and apart from those of the other cpus. a run is allocated when the
+ * first route of one of its vrfs is added, and the vrfs that have had a
+ * route are set in mtrie_stats_vrfs, which is what stats dumps go by
+ */
+#define MTRIE_STATS_CHUNK           64
+#define MTRIE_STATS_CHUNKS          (VR_MAX_VRFS / MTRIE_STATS_CHUNK)
+
+struct mtrie_cpu_stats {
+    struct vr_vrf_stats *mcs_chunks[MTRIE_STATS_CHUNKS];
+    /* for the packets of vrfs that are out of range */
+    struct vr_vrf_stats mcs_invalid;
+};
+
+static struct mtrie_cpu_stats **mtrie_cpu_stats;
+static uint64_t mtrie_stats_vrfs[MTRIE_STATS_CHUNKS];
 
 struct vr_nexthop *(*vr_inet_route_lookup)(unsigned int, struct vr_route_req *,
         struct vr_packet *);
 struct vr_vrf_stats *(*vr_inet_vrf_stats)(unsigned short, unsigned int);
+unsigned int (*vr_inet_route_gen)(unsigned int);
+struct vr_nexthop *(*vr_inet6_route_lookup)(unsigned int, struct vr_route_req *,
+        struct vr_packet *);
 
 static struct ip4_mtrie *mtrie_alloc_vrf(unsigned int);
 
 /* mtrie specific */
-#define IP4_BKT_LEVELS  4 /* 8/8/8/8 */
-struct mtrie_bkt_info ip4_bkt_info[IP4_BKT_LEVELS] = {
-    {
-        .bi_size    =   IP4BUCKET_LEVEL0_SIZE,
-        .bi_shift   =   IP4BUCKET_LEVEL0_SHIFT,
-        .bi_pfx_len =   IP4BUCKET_LEVEL0_PFX_LEN,
-        .bi_mask    =   IP4BUCKET_LEVEL0_MASK,
-        .bi_bits    =   IP4BUCKET_LEVEL0_BITS,
-    },
-    {
-        .bi_size    =   IP4BUCKET_LEVEL1_SIZE,
-        .bi_shift   =   IP4BUCKET_LEVEL1_SHIFT,
-        .bi_pfx_len =   IP4BUCKET_LEVEL1_PFX_LEN,
-        .bi_mask    =   IP4BUCKET_LEVEL1_MASK,
-        .bi_bits    =   IP4BUCKET_LEVEL1_BITS,
-    },
-    {
-        .bi_size    =   IP4BUCKET_LEVEL2_SIZE,
-        .bi_shift   =   IP4BUCKET_LEVEL2_SHIFT,
-        .bi_pfx_len =   IP4BUCKET_LEVEL2_PFX_LEN,
-        .bi_mask    =   IP4BUCKET_LEVEL2_MASK,
-        .bi_bits    =   IP4BUCKET_LEVEL2_BITS,
-    },
-    {
-        .bi_size    =   IP4BUCKET_LEVEL3_SIZE,
-        .bi_shift   =   IP4BUCKET_LEVEL3_SHIFT,
-        .bi_pfx_len =   IP4BUCKET_LEVEL3_PFX_LEN,
-        .bi_mask    =   IP4BUCKET_LEVEL3_MASK,
-        .bi_bits    =   IP4BUCKET_LEVEL3_BITS,
-    },
+static unsigned char ip4_mtrie_strides[VR_RT_LAYOUT_MAX][IP4_MTRIE_MAX_LEVELS] = {
+    [VR_RT_LAYOUT_8_8_8_8]  =   { 8, 8, 8, 8 },
+    [VR_RT_LAYOUT_16_8_8]   =   { 16, 8, 8 },
+    [VR_RT_LAYOUT_24_8]     =   { 24, 8 },
 };
 
+static struct mtrie_bkt_info
+ip4_mtrie_layouts[VR_RT_LAYOUT_MAX][IP4_MTRIE_MAX_LEVELS];
+static unsigned char ip4_mtrie_levels[VR_RT_LAYOUT_MAX];
+static struct mtrie_bkt_info ip6_mtrie_layout[IP6_MTRIE_MAX_LEVELS];
+
+/* layout of the vrfs whose first route add does not ask for one */
+unsigned int vr_mtrie_layout = VR_RT_LAYOUT_8_8_8_8;
+
 struct ip4_mtrie **vn_rtable;
+/* the tables that bulk adds are building, which replace vn_rtable's */
+static struct ip4_mtrie **vn_shadow_rtable;
+static struct ip4_mtrie **vn6_rtable;
+
+/*
+ * buckets whose entries form no more than these many runs of identical
+ * entries are kept compressed in the vrfs created from now on. 0 keeps all
+ * buckets full
+ */
+unsigned int vr_mtrie_cbucket_runs = IP4_CBUCKET_DEF_RUNS;
+
+/*
+ * the results of the /32 lookups for packets are kept in a small direct
+ * mapped cache per cpu, of these many entries (a power of 2, 0 for none).
+ * with many vrfs the buckets of the tables do not stay in the caches of a
+ * cpu, while the few destinations that a cpu forwards to at a time do
+ */
+unsigned int vr_mtrie_rcache_entries = IP4_RCACHE_DEF_ENTRIES;
+static struct ip4_rcache_entry *mtrie_rcache;
+static unsigned int mtrie_rcache_mask;
+
+/*
+ * a cached result, here or in a flow entry, is good for as long as the
+ * generation of its vrf is what it was when the lookup began. the
+ * generation is odd while the table of the vrf is being changed, and the
+ * caches are not used for the vrf then, since the nexthops that the change
+ * releases may well be freed before it is done
+ */
+static unsigned int *mtrie_vrf_gen;
 
 /*
  * given a vrf id, get the routing table corresponding to the id
@@ -66,17 +96,132 @@ vrfid_to_mtrie(unsigned int vrf_id)
     return vn_rtable[vrf_id];
 }
 
-#define PREFIX_TO_INDEX(prefix, level) \
-    ((prefix >> ip4_bkt_info[level].bi_shift) & \
-     ip4_bkt_info[level].bi_mask)
+static inline struct ip4_mtrie *
+vrfid_to_mtrie6(unsigned int vrf_id)
+{
+    if (vrf_id >= VR_MAX_VRFS || !vn6_rtable)
+        return NULL;
+
+    return vn6_rtable[vrf_id];
+}
+
+/* the generation of the table of the vrf, odd for no good one */
+static unsigned int
+mtrie_route_gen(unsigned int vrf_id)
+{
+    if (!mtrie_vrf_gen || vrf_id >= VR_MAX_VRFS)
+        return 0x1;
+
+    return *(volatile unsigned int *)&mtrie_vrf_gen[vrf_id];
+}
+
+/* the cached lookups of the vrf are not used from here... */
+static inline void
+mtrie_vrf_change_begin(unsigned int vrf_id)
+{
+    if (!mtrie_vrf_gen || vrf_id >= VR_MAX_VRFS)
+        return;
+
+    mtrie_vrf_gen[vrf_id]++;
+    __sync_synchronize();
+
+    return;
+}
+
+/* ...till here, and the ones from before, never again */
+static inline void
+mtrie_vrf_change_end(unsigned int vrf_id)
+{
+    if (!mtrie_vrf_gen || vrf_id >= VR_MAX_VRFS)
+        return;
+
+    __sync_synchronize();
+    mtrie_vrf_gen[vrf_id]++;
+
+    return;
+}
+
+/*
+ * the cached result of a lookup for a packet, if it is still good. else,
+ * the entry that the result of the lookup is to go to, and the generation
+ * it will be good for, are left in rcep and genp, with NULL in rcep for a
+ * lookup that is not to be cached. the cache of a cpu is only used by the
+ * packets processed on it, which do not preempt one another
+ */
+static inline struct vr_nexthop *
+mtrie_rcache_get(unsigned int cpu, unsigned int vrf_id,
+        struct vr_route_req *rt, struct ip4_rcache_entry **rcep,
+        unsigned int *genp)
+{
+    unsigned int gen, hash, prefix = rt->rtr_req.rtr_prefix;
+    struct ip4_rcache_entry *rce;
+
+    *rcep = NULL;
+    if (!mtrie_rcache || vrf_id >= VR_MAX_VRFS ||
+            rt->rtr_req.rtr_prefix_len != IP4_PREFIX_LEN)
+        return NULL;
+
+    gen = mtrie_route_gen(vrf_id);
+    if (gen & 0x1)
+        return NULL;
+
+    hash = (prefix ^ (vrf_id * 0x9e3779b1U)) * 0x9e3779b1U;
+    rce = &mtrie_rcache[cpu * (mtrie_rcache_mask + 1) +
+        ((hash >> 16) & mtrie_rcache_mask)];
+    if (rce->rce_nh && rce->rce_gen == gen && rce->rce_vrf == vrf_id &&
+            rce->rce_prefix == prefix) {
+        rt->rtr_req.rtr_label_flags = rce->rce_label_flags;
+        rt->rtr_req.rtr_label = rce->rce_label;
+        rt->rtr_req.rtr_prefix_len = rce->rce_prefix_len;
+        return rce->rce_nh;
+    }
+
+    /* the walk that follows has to see the table as of gen, or later */
+    __sync_synchronize();
+    *rcep = rce;
+    *genp = gen;
+
+    return NULL;
+}
+
+static inline void
+mtrie_rcache_put(struct ip4_rcache_entry *rce, unsigned int vrf_id,
+        struct vr_route_req *rt, unsigned int gen, struct vr_nexthop *nh)
+{
+    if (!rce || !nh)
+        return;
+
+    rce->rce_vrf = vrf_id;
+    rce->rce_prefix = rt->rtr_req.rtr_prefix;
+    rce->rce_gen = gen;
+    rce->rce_prefix_len = rt->rtr_req.rtr_prefix_len;
+    rce->rce_label_flags = rt->rtr_req.rtr_label_flags;
+    rce->rce_label = rt->rtr_req.rtr_label;
+    rce->rce_nh = nh;
+
+    return;
+}
+
+#define PREFIX_TO_INDEX(mtrie, prefix, level) \
+    ((prefix >> (mtrie)->mtrie_bkt_info[level].bi_shift) & \
+     (mtrie)->mtrie_bkt_info[level].bi_mask)
+/* the strides of the ip6 layout are whole bytes of the address */
+#define IP6_ADDR_TO_INDEX(addr, level) \
+    ((level) ? (addr)[(level) + 1] : (((addr)[0] << 8) | (addr)[1]))
+
 /*
  * we have to be careful about 'level' here. assumption is that level
  * will be passed sane from whomever is calling
  */
 static inline int
-rt_to_index(struct vr_route_req *rt, unsigned int level)
+rt_to_index(struct ip4_mtrie *mtrie, struct vr_route_req *rt,
+        unsigned int level)
 {
-    return PREFIX_TO_INDEX(rt->rtr_req.rtr_prefix, level);
+    if (mtrie->mtrie_family == AF_INET6)
+        return IP6_ADDR_TO_INDEX((unsigned char *)rt->rtr_req.rtr_prefix6,
+                level);
+
+    return PREFIX_TO_INDEX(mtrie, rt->rtr_req.rtr_prefix, level);
 }
 
 static inline struct ip4_bucket_entry *
@@ -144,26 +289,162 @@ entry_to_bucket(struct ip4_bucket_entry *ent)
 {
     unsigned long long_i = ent->entry_long_i;
 
-    if (PTR_IS_BUCKET(long_i))
-        return (struct ip4_bucket *)(long_i & ~0x1UL);
+    if (PTR_IS_BUCKET(long_i) && !PTR_IS_CBUCKET(long_i))
+        return PTR_TO_BUCKET(long_i);
 
     return NULL;
 }
 
+/*
+ * the entries of the bucket at 'level' that 'ptr' points to. for a
+ * compressed bucket, that is one entry per run
+ */
+static struct ip4_bucket_entry *
+bucket_entries(struct ip4_mtrie *mtrie, unsigned long ptr, unsigned int level,
+        unsigned int *count)
+{
+    struct ip4_cbucket *cbkt;
+
+    if (PTR_IS_CBUCKET(ptr)) {
+        cbkt = PTR_TO_CBUCKET(ptr);
+        *count = cbkt->cbkt_runs;
+        return cbkt->cbkt_data;
+    }
+
+    *count = mtrie->mtrie_bkt_info[level].bi_size;
+    return PTR_TO_BUCKET(ptr)->bkt_data;
+}
+
+static inline struct ip4_bucket_entry *
+bucket_index_to_entry(struct ip4_bucket_entry *ent, unsigned int index)
+{
+    unsigned long long_i = ent->entry_long_i;
+
+    if (PTR_IS_CBUCKET(long_i))
+        return ip4_cbucket_entry(PTR_TO_CBUCKET(long_i), index);
+
+    return index_to_entry(PTR_TO_BUCKET(long_i), index);
+}
+
+static inline bool
+entry_same_route(struct ip4_bucket_entry *a, struct ip4_bucket_entry *b)
+{
+    return ((a->entry_long_i == b->entry_long_i) &&
+            (a->entry_label_flags == b->entry_label_flags) &&
+            (a->entry_label == b->entry_label) &&
+            (a->entry_prefix_len == b->entry_prefix_len));
+}
+
+/*
+ * copy an entry into a bucket that is not yet in the tree. a nexthop is
+ * referenced once more, as is, even if it has since been deleted, so that
+ * the copy looks up exactly what the original does
+ */
+static void
+entry_copy(struct ip4_bucket_entry *dst, struct ip4_bucket_entry *src)
+{
+    dst->entry_long_i = src->entry_long_i;
+    if (ENTRY_IS_NEXTHOP(src) && src->entry_nh_p)
+        src->entry_nh_p->nh_users++;
+
+    dst->entry_prefix_len = src->entry_prefix_len;
+    dst->entry_label_flags = src->entry_label_flags;
+    dst->entry_label = src->entry_label;
+
+    return;
+}
+
+/*
+ * buckets are accounted to their vrf, so that the cost of a layout can be
+ * seen in the vrf stats. the first level of the wide layouts is larger
+ * than what vr_zalloc can be asked for, and comes from huge pages, or from
+ * pages, within the limit mtrie_layout_valid sets, where the host has no
+ * huge pages to give
+ */
+static void *
+mtrie_mem_alloc(struct ip4_mtrie *mtrie, unsigned int size, bool compressed)
+{
+    void *mem;
+
+    if (size <= IP4_CBUCKET_MAX_SIZE * sizeof(struct ip4_bucket_entry))
+        mem = vr_zalloc(size);
+    else if (vr_huge_page_alloc)
+        mem = vr_huge_page_alloc(size);
+    else
+        mem = vr_page_alloc(size);
+
+    if (!mem)
+        return NULL;
+
+    mtrie->mtrie_memory += size;
+    if (compressed)
+        mtrie->mtrie_cbuckets++;
+    else
+        mtrie->mtrie_buckets++;
+
+    return mem;
+}
+
+/* takes the bucket off the books of the vrf, and returns its size */
+static unsigned int
+mtrie_mem_unaccount(struct ip4_mtrie *mtrie, unsigned long ptr,
+        unsigned int level)
+{
+    unsigned int size;
+
+    if (PTR_IS_CBUCKET(ptr)) {
+        size = sizeof(struct ip4_cbucket) + sizeof(struct ip4_bucket_entry) *
+            PTR_TO_CBUCKET(ptr)->cbkt_runs;
+        mtrie->mtrie_cbuckets--;
+    } else {
+        size = sizeof(struct ip4_bucket) +
+            sizeof(struct ip4_bucket_entry) *
+            mtrie->mtrie_bkt_info[level].bi_size;
+        mtrie->mtrie_buckets--;
+    }
+
+    mtrie->mtrie_memory -= size;
+
+    return size;
+}
+
+static void
+mtrie_mem_release(void *mem, unsigned int size)
+{
+    if (size <= IP4_CBUCKET_MAX_SIZE * sizeof(struct ip4_bucket_entry))
+        vr_free(mem);
+    else if (vr_huge_page_free)
+        vr_huge_page_free(mem, size);
+    else
+        vr_page_free(mem, size);
+
+    return;
+}
+
+static void
+mtrie_mem_free(struct ip4_mtrie *mtrie, unsigned long ptr, unsigned int level)
+{
+    mtrie_mem_release(PTR_TO_BUCKET(ptr),
+            mtrie_mem_unaccount(mtrie, ptr, level));
+
+    return;
+}
+
 /*
  * alloc a mtrie bucket
  */
 static struct ip4_bucket *
-mtrie_alloc_bucket(unsigned char level, struct ip4_bucket_entry *parent)
+mtrie_alloc_bucket(struct ip4_mtrie *mtrie, unsigned char level,
+        struct ip4_bucket_entry *parent)
 {
     unsigned int                bkt_size;
     unsigned int                i;
     struct ip4_bucket          *bkt;
     struct ip4_bucket_entry    *ent;
 
-    bkt_size = ip4_bkt_info[level].bi_size;
-    bkt = vr_zalloc(sizeof(struct ip4_bucket) 
-                    + sizeof(struct ip4_bucket_entry) * bkt_size);
+    bkt_size = mtrie->mtrie_bkt_info[level].bi_size;
+    bkt = mtrie_mem_alloc(mtrie, sizeof(struct ip4_bucket) 
+                    + sizeof(struct ip4_bucket_entry) * bkt_size, false);
     if (!bkt)
         return NULL;
 
@@ -178,245 +459,508 @@ mtrie_alloc_bucket(unsigned char level, struct ip4_bucket_entry *parent)
     return bkt;
 }
 
+/*
+ * buckets that a route add or delete unlinked from the tree, when it
+ * expanded, compressed or freed them. the nexthops that they hold are
+ * released right away, as set_entry_to_nh() does, since a nexthop whose
+ * last reference goes waits for the readers before it is freed. the memory
+ * of the buckets is freed in a batch, from a deferred callback, once the
+ * readers that may still be walking them are done. the request thread
+ * hence never waits for a grace period
+ */
+#define IP4_RETIRE_MAX      32
+
+struct ip4_retire_list {
+    unsigned int rl_count;
+    void *rl_mem[IP4_RETIRE_MAX];
+    unsigned int rl_size[IP4_RETIRE_MAX];
+};
+
 static void
-add_to_tree(struct ip4_bucket_entry *ent, int level, struct vr_route_req *rt)
+mtrie_release_retired(struct ip4_retire_list *rl)
 {
     unsigned int i;
-    struct ip4_bucket              *bkt;
 
-    if (level >= IP4_BKT_LEVELS - 1)
-        /* assert here ? */
-        return;
+    for (i = 0; i < rl->rl_count; i++)
+        mtrie_mem_release(rl->rl_mem[i], rl->rl_size[i]);
+    rl->rl_count = 0;
 
-    /* assured that the first one is a bucket */
-    bkt = entry_to_bucket(ent);
-    level++;
+    return;
+}
 
-    for (i = 0; i < ip4_bkt_info[level].bi_size; i++) {
-        ent = index_to_entry(bkt, i);
-        if (!ENTRY_IS_NEXTHOP(ent))
-            add_to_tree(ent, level, rt);
-        else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
-            /* a less specific entry, which needs to be replaced */
-            set_entry_to_nh(ent, rt->rtr_nh);
-            ent->entry_prefix_len = rt->rtr_req.rtr_prefix_len;
-            ent->entry_label_flags = rt->rtr_req.rtr_label_flags;
-            ent->entry_label = rt->rtr_req.rtr_label;
-        }
-    }
+static void
+mtrie_retired_free_cb(struct vrouter *router, void *data)
+{
+    mtrie_release_retired((struct ip4_retire_list *)data);
 
     return;
 }
 
 static void
-mtrie_free_entry(struct ip4_bucket_entry *entry, unsigned int level)
+mtrie_flush_retired(struct ip4_mtrie *mtrie, struct ip4_retire_list *rl)
 {
-    unsigned int i;
-    struct ip4_bucket *bkt;
-
-    if (ENTRY_IS_NEXTHOP(entry)) {
-        vrouter_put_nexthop(entry->entry_nh_p);
-        return;
-    }
+    struct ip4_retire_list *drl;
 
-    bkt = entry_to_bucket(entry);
-    if (!bkt)
+    if (!rl->rl_count)
         return;
 
-    for (i = 0; i < ip4_bkt_info[level].bi_size; i++)
-        if (ENTRY_IS_BUCKET(&bkt->bkt_data[i])) {
-            mtrie_free_entry(&bkt->bkt_data[i], level + 1);
-        } else {
-            if (bkt->bkt_data[i].entry_nh_p) {
-                vrouter_put_nexthop(bkt->bkt_data[i].entry_nh_p);
-            }
+    if (!mtrie->mtrie_shadow) {
+        drl = vr_get_defer_data(sizeof(*drl));
+        if (drl) {
+            memcpy(drl, rl, sizeof(*rl));
+            vr_defer(vrouter_get(0), mtrie_retired_free_cb, (void *)drl);
+            rl->rl_count = 0;
+            return;
         }
 
-    entry->entry_bkt_p = NULL;
-    vr_free(bkt);
+        /* no memory to defer with. wait here instead */
+        vr_delay_op();
+    }
+
+    mtrie_release_retired(rl);
 
     return;
 }
-        
+
+/*
+ * child buckets of the bucket are not retired with it. they either belong
+ * to a copy of it, or are retired by the caller
+ */
 static void
-mtrie_reset_entry(struct ip4_bucket_entry *ent, int level,
-                struct vr_nexthop *nh)
+mtrie_retire(struct ip4_mtrie *mtrie, struct ip4_retire_list *rl,
+        unsigned long ptr, unsigned int level)
 {
-    struct ip4_bucket_entry cp_ent;
-
-    memcpy(&cp_ent, ent, sizeof(cp_ent));
+    unsigned int i, count;
+    struct ip4_bucket_entry *ents;
 
-    /* remove from the tree */
-    if (nh)
-        set_entry_to_nh(ent, nh);
+    ents = bucket_entries(mtrie, ptr, level, &count);
+    for (i = 0; i < count; i++) {
+        if (ENTRY_IS_NEXTHOP(&ents[i]) && ents[i].entry_nh_p)
+            vrouter_put_nexthop(ents[i].entry_nh_p);
+    }
 
-    /* wait for all cores to see it */
-    vr_delay_op();
+    if (rl->rl_count == IP4_RETIRE_MAX)
+        mtrie_flush_retired(mtrie, rl);
 
-    /* ...and then work with the copy */
-    mtrie_free_entry(&cp_ent, level);
+    rl->rl_mem[rl->rl_count] = PTR_TO_BUCKET(ptr);
+    rl->rl_size[rl->rl_count++] = mtrie_mem_unaccount(mtrie, ptr, level);
 
     return;
 }
-       
-/* 
- * When adding a route:
- * - descend the tree to the bucket at which the route is significant.
- * (i.e. the bucket corresponding to a prefix >= to the route prefix).
- * - if the bucket needs to be created, it is first initialized and only
- * linked to the tree when the function exits.
- * - if the bucket exists, populate any descendent bucket entries that
- * themselfs do not have more specific routes.
- * - when a bucket is created, initialize any entries with the parent that
- * covers them.
- */
-static int
-__mtrie_add(struct ip4_mtrie *mtrie, struct vr_route_req *rt)
+
+/* retire the bucket that the entry points to, and all the ones below it */
+static void
+mtrie_retire_entry(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *ent,
+        unsigned int level, struct ip4_retire_list *rl)
 {
-    int                         ret, index, level, err_level = 0;
-    unsigned int                i, fin;
-    struct ip4_bucket          *bkt;
-    struct ip4_bucket_entry    *ent, *err_ent = NULL;
-    struct vr_nexthop          *nh, *err_nh = NULL;
+    unsigned int i, count;
+    struct ip4_bucket_entry *ents;
 
-    ent = &mtrie->root;
-    nh = ent->entry_nh_p;
-    for (level = 0; level < IP4_BKT_LEVELS; level++) {
-        if (!ENTRY_IS_BUCKET(ent)) {
-            bkt = mtrie_alloc_bucket(level, ent);
-            set_entry_to_bucket(ent, bkt);
-            if (!err_ent) {
-                err_ent = ent;
-                err_nh = nh;
-                err_level = level;
-            }
-        }
+    if (ENTRY_IS_NEXTHOP(ent) || !PTR_TO_BUCKET(ent->entry_long_i))
+        return;
 
-        bkt = entry_to_bucket(ent);
-        if (!bkt) {
-            ret = -ENOMEM;
-            goto exit_ret;
-        }
+    ents = bucket_entries(mtrie, ent->entry_long_i, level, &count);
+    for (i = 0; i < count; i++)
+        mtrie_retire_entry(mtrie, &ents[i], level + 1, rl);
 
-        index = rt_to_index(rt, level);
-        ent = index_to_entry(bkt, index);
+    mtrie_retire(mtrie, rl, ent->entry_long_i, level);
 
-        if (rt->rtr_req.rtr_prefix_len > ip4_bkt_info[level].bi_pfx_len) {
-            if (ENTRY_IS_NEXTHOP(ent)) {
-                nh = ent->entry_nh_p;
-            }
+    return;
+}
 
-            continue;
+/*
+ * replace the compressed bucket at 'level' that 'ent' points to with a full
+ * one, so that single indices of it can be changed
+ */
+static int
+mtrie_expand_bucket(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *ent,
+        unsigned int level, struct ip4_retire_list *rl)
+{
+    unsigned int i;
+    unsigned long old = ent->entry_long_i;
+    struct ip4_cbucket *cbkt;
+    struct ip4_bucket *bkt;
 
-        } else {
-            /* 
-             * cover all the indices for which this route is the best
-             * prefix match
-             */
-            if ((rt->rtr_req.rtr_prefix_len >
-                        (ip4_bkt_info[level].bi_pfx_len - ip4_bkt_info[level].bi_bits)) &&
-                    (rt->rtr_req.rtr_prefix_len <= ip4_bkt_info[level].bi_pfx_len)) {
-                fin = 1 << (ip4_bkt_info[level].bi_pfx_len - rt->rtr_req.rtr_prefix_len); 
-            } else {
-                fin = ip4_bkt_info[level].bi_size;
-            }
+    if (!PTR_IS_BUCKET(old) || !PTR_IS_CBUCKET(old))
+        return 0;
 
-             fin += index;
-             if (fin > ip4_bkt_info[level].bi_size)
-                 fin = ip4_bkt_info[level].bi_size;
+    bkt = mtrie_mem_alloc(mtrie, sizeof(struct ip4_bucket) +
+            sizeof(struct ip4_bucket_entry) *
+            mtrie->mtrie_bkt_info[level].bi_size, false);
+    if (!bkt)
+        return -ENOMEM;
 
-             for (i = index; i < fin; i++) {
-                ent = index_to_entry(bkt, i);
-                if (ENTRY_IS_BUCKET(ent))
-                    add_to_tree(ent, level, rt);
-                else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
-                    /* a less specific entry, which needs to be replaced */
-                    set_entry_to_nh(ent, rt->rtr_nh);
-                    ent->entry_prefix_len = rt->rtr_req.rtr_prefix_len;
-                    ent->entry_label_flags = rt->rtr_req.rtr_label_flags;
-                    ent->entry_label = rt->rtr_req.rtr_label;
-                }
-             }
+    cbkt = PTR_TO_CBUCKET(old);
+    for (i = 0; i < mtrie->mtrie_bkt_info[level].bi_size; i++)
+        entry_copy(&bkt->bkt_data[i], ip4_cbucket_entry(cbkt, i));
 
-             break;
-        }
-    }
+    ent->entry_long_i = (unsigned long)bkt | 0x1ul;
+    mtrie_retire(mtrie, rl, old, level);
 
     return 0;
-
-exit_ret:
-    if (err_ent)
-        mtrie_reset_entry(err_ent, err_level, err_nh);
-
-    return ret;
 }
 
-
+/*
+ * replace the full bucket at 'level' that 'ent' points to with a compressed
+ * one, if its entries form few enough runs for that to be smaller. failure
+ * to allocate is not an error, since the full bucket serves just as well
+ */
 static void
-ip4_bucket_sched_for_free(struct ip4_bucket *bkt, int level)
+mtrie_compress_bucket(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *ent,
+        unsigned int level, struct ip4_retire_list *rl)
 {
-    unsigned int i;
-    struct ip4_bucket_entry *tmp_ent;
+    unsigned int i, runs, size = mtrie->mtrie_bkt_info[level].bi_size;
+    unsigned long old = ent->entry_long_i;
+    struct ip4_bucket *bkt;
+    struct ip4_cbucket *cbkt;
+    struct ip4_bucket_entry *run = NULL;
 
-    vr_delay_op();
-    for (i = 0; i < ip4_bkt_info[level].bi_size; i++) {
-        tmp_ent = &bkt->bkt_data[i];
-        if (tmp_ent->entry_nh_p) {
-            vrouter_put_nexthop(tmp_ent->entry_nh_p);
-        }
-    }
-    vr_free(bkt);
+    if (!PTR_IS_BUCKET(old) || PTR_IS_CBUCKET(old) ||
+            size > IP4_CBUCKET_MAX_SIZE)
+        return;
+
+    bkt = PTR_TO_BUCKET(old);
+    for (runs = 1, i = 1; i < size; i++) {
+        if (!entry_same_route(&bkt->bkt_data[i], &bkt->bkt_data[i - 1]))
+            if (++runs > mtrie->mtrie_cbkt_runs)
+                return;
+    }
+
+    if (sizeof(struct ip4_cbucket) + runs * sizeof(struct ip4_bucket_entry) >=
+            size * sizeof(struct ip4_bucket_entry))
+        return;
+
+    cbkt = mtrie_mem_alloc(mtrie, sizeof(struct ip4_cbucket) +
+            sizeof(struct ip4_bucket_entry) * runs, true);
+    if (!cbkt)
+        return;
+
+    for (runs = 0, i = 0; i < size; i++) {
+        if (!(i % 64))
+            cbkt->cbkt_base[i / 64] = runs;
+
+        if (run && entry_same_route(&bkt->bkt_data[i], run))
+            continue;
+
+        run = &bkt->bkt_data[i];
+        cbkt->cbkt_bitmap[i / 64] |= 1ULL << (i % 64);
+        entry_copy(&cbkt->cbkt_data[runs++], run);
+    }
+    cbkt->cbkt_runs = runs;
+
+    ent->entry_long_i = (unsigned long)cbkt | 0x3ul;
+    mtrie_retire(mtrie, rl, old, level);
+
+    return;
 }
 
+/*
+ * compress, deepest first, the buckets on the path of the route that was
+ * just added or deleted, which are the ones that the operation expanded
+ * or allocated
+ */
 static void
-free_bucket(struct ip4_bucket_entry *ent, int level, struct vr_route_req *rt)
+mtrie_compress_path(struct ip4_mtrie *mtrie, struct vr_route_req *rt,
+        struct ip4_retire_list *rl)
 {
-    struct ip4_bucket *bkt;
+    int level;
+    struct ip4_bucket_entry *ent, *path[MTRIE_MAX_LEVELS];
+
+    if (!mtrie->mtrie_cbkt_runs)
+        return;
+
+    ent = &mtrie->root;
+    for (level = 0; level < mtrie->mtrie_levels; level++) {
+        if (!ENTRY_IS_BUCKET(ent))
+            break;
+
+        path[level] = ent;
+        ent = bucket_index_to_entry(ent, rt_to_index(mtrie, rt, level));
+    }
+
+    while (--level >= 0)
+        mtrie_compress_bucket(mtrie, path[level], level, rl);
+
+    return;
+}
+
+/*
+ * a compressed bucket is walked one run at a time, which is fine here,
+ * since all the entries of a run are replaced alike
+ */
+static void
+add_to_tree(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *ent, int level,
+        struct vr_route_req *rt)
+{
+    unsigned int i, count;
+    struct ip4_bucket_entry        *ents;
+
+    if (level >= mtrie->mtrie_levels - 1)
+        /* assert here ? */
+        return;
+
+    /* assured that the first one is a bucket */
+    level++;
+    ents = bucket_entries(mtrie, ent->entry_long_i, level, &count);
+
+    for (i = 0; i < count; i++) {
+        ent = &ents[i];
+        if (!ENTRY_IS_NEXTHOP(ent))
+            add_to_tree(mtrie, ent, level, rt);
+        else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
+            /* a less specific entry, which needs to be replaced */
+            set_entry_to_nh(ent, rt->rtr_nh);
+            ent->entry_prefix_len = rt->rtr_req.rtr_prefix_len;
+            ent->entry_label_flags = rt->rtr_req.rtr_label_flags;
+            ent->entry_label = rt->rtr_req.rtr_label;
+        }
+    }
+
+    return;
+}
+
+/*
+ * release the nexthops that the entry and the buckets below it hold.
+ * readers may still be walking them, since a nexthop whose last reference
+ * goes waits for them before it is freed
+ */
+static void
+mtrie_put_nexthops(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *entry,
+        unsigned int level)
+{
+    unsigned int i, count;
+    struct ip4_bucket_entry *ents;
+
+    if (ENTRY_IS_NEXTHOP(entry)) {
+        if (entry->entry_nh_p)
+            vrouter_put_nexthop(entry->entry_nh_p);
+        return;
+    }
+
+    if (!PTR_TO_BUCKET(entry->entry_long_i))
+        return;
+
+    ents = bucket_entries(mtrie, entry->entry_long_i, level, &count);
+    for (i = 0; i < count; i++)
+        mtrie_put_nexthops(mtrie, &ents[i], level + 1);
+
+    return;
+}
+
+/*
+ * free the buckets below the entry, whose nexthops are released already.
+ * this does not sleep, and hence can be run from a deferred callback
+ */
+static void
+mtrie_free_buckets(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *entry,
+        unsigned int level)
+{
+    unsigned int i, count;
+    struct ip4_bucket_entry *ents;
+
+    if (ENTRY_IS_NEXTHOP(entry) || !PTR_TO_BUCKET(entry->entry_long_i))
+        return;
+
+    ents = bucket_entries(mtrie, entry->entry_long_i, level, &count);
+    for (i = 0; i < count; i++)
+        mtrie_free_buckets(mtrie, &ents[i], level + 1);
+
+    mtrie_mem_free(mtrie, entry->entry_long_i, level);
+    entry->entry_bkt_p = NULL;
+
+    return;
+}
+
+static void
+mtrie_free_entry(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *entry,
+        unsigned int level)
+{
+    mtrie_put_nexthops(mtrie, entry, level);
+    mtrie_free_buckets(mtrie, entry, level);
+
+    return;
+}
+        
+static void
+mtrie_reset_entry(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *ent,
+        int level, struct vr_nexthop *nh, struct ip4_retire_list *rl)
+{
+    struct ip4_bucket_entry cp_ent;
+
+    memcpy(&cp_ent, ent, sizeof(cp_ent));
+
+    /* remove from the tree */
+    if (nh)
+        set_entry_to_nh(ent, nh);
+
+    /* ...and then retire what hangs off the copy */
+    mtrie_retire_entry(mtrie, &cp_ent, level, rl);
+
+    return;
+}
+       
+/* 
+ * When adding a route:
+ * - descend the tree to the bucket at which the route is significant.
+ * (i.e. the bucket corresponding to a prefix >= to the route prefix).
+ * - if the bucket needs to be created, it is first initialized and only
+ * linked to the tree when the function exits.
+ * - if the bucket exists, populate any descendent bucket entries that
+ * themselfs do not have more specific routes.
+ * - when a bucket is created, initialize any entries with the parent that
+ * covers them.
+ * - compressed buckets on the way down are expanded, since single entries
+ * of them change. mtrie_add() compresses them again once done.
+ */
+static int
+__mtrie_add(struct ip4_mtrie *mtrie, struct vr_route_req *rt,
+        struct ip4_retire_list *rl)
+{
+    int                         ret, index, level, err_level = 0;
+    unsigned int                i, fin;
+    struct ip4_bucket          *bkt;
+    struct ip4_bucket_entry    *ent, *err_ent = NULL;
+    struct vr_nexthop          *nh, *err_nh = NULL;
+
+    ent = &mtrie->root;
+    nh = ent->entry_nh_p;
+    for (level = 0; level < mtrie->mtrie_levels; level++) {
+        if (!ENTRY_IS_BUCKET(ent)) {
+            bkt = mtrie_alloc_bucket(mtrie, level, ent);
+            set_entry_to_bucket(ent, bkt);
+            if (!err_ent) {
+                err_ent = ent;
+                err_nh = nh;
+                err_level = level;
+            }
+        } else if (mtrie_expand_bucket(mtrie, ent, level, rl)) {
+            ret = -ENOMEM;
+            goto exit_ret;
+        }
+
+        bkt = entry_to_bucket(ent);
+        if (!bkt) {
+            ret = -ENOMEM;
+            goto exit_ret;
+        }
+
+        index = rt_to_index(mtrie, rt, level);
+        ent = index_to_entry(bkt, index);
+
+        if (rt->rtr_req.rtr_prefix_len > mtrie->mtrie_bkt_info[level].bi_pfx_len) {
+            if (ENTRY_IS_NEXTHOP(ent)) {
+                nh = ent->entry_nh_p;
+            }
+
+            continue;
+
+        } else {
+            /* 
+             * cover all the indices for which this route is the best
+             * prefix match
+             */
+            if ((rt->rtr_req.rtr_prefix_len >
+                        (mtrie->mtrie_bkt_info[level].bi_pfx_len - mtrie->mtrie_bkt_info[level].bi_bits)) &&
+                    (rt->rtr_req.rtr_prefix_len <= mtrie->mtrie_bkt_info[level].bi_pfx_len)) {
+                fin = 1 << (mtrie->mtrie_bkt_info[level].bi_pfx_len - rt->rtr_req.rtr_prefix_len); 
+            } else {
+                fin = mtrie->mtrie_bkt_info[level].bi_size;
+            }
+
+             fin += index;
+             if (fin > mtrie->mtrie_bkt_info[level].bi_size)
+                 fin = mtrie->mtrie_bkt_info[level].bi_size;
+
+             for (i = index; i < fin; i++) {
+                ent = index_to_entry(bkt, i);
+                if (ENTRY_IS_BUCKET(ent))
+                    add_to_tree(mtrie, ent, level, rt);
+                else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
+                    /* a less specific entry, which needs to be replaced */
+                    set_entry_to_nh(ent, rt->rtr_nh);
+                    ent->entry_prefix_len = rt->rtr_req.rtr_prefix_len;
+                    ent->entry_label_flags = rt->rtr_req.rtr_label_flags;
+                    ent->entry_label = rt->rtr_req.rtr_label;
+                }
+             }
+
+             break;
+        }
+    }
+
+    return 0;
+
+exit_ret:
+    if (err_ent)
+        mtrie_reset_entry(mtrie, err_ent, err_level, err_nh, rl);
+
+    return ret;
+}
+
+static void
+free_bucket(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *ent, int level,
+        struct vr_route_req *rt, struct ip4_retire_list *rl)
+{
+    unsigned long ptr;
 
     if (ENTRY_IS_NEXTHOP(ent)) {
         return;
     }
 
-    bkt = entry_to_bucket(ent);
+    ptr = ent->entry_long_i;
     set_entry_to_nh(ent, rt->rtr_nh);
     ent->entry_label_flags = rt->rtr_req.rtr_label_flags;
     ent->entry_label = rt->rtr_req.rtr_label;
     
-    ip4_bucket_sched_for_free(bkt, level);
+    mtrie_retire(mtrie, rl, ptr, level);
 }
 
 static int
-__mtrie_delete(struct vr_route_req *rt, struct ip4_bucket_entry *ent,
-                unsigned char level)
+__mtrie_delete(struct ip4_mtrie *mtrie, struct vr_route_req *rt,
+        struct ip4_bucket_entry *ent, unsigned char level,
+        struct ip4_retire_list *rl)
 {
-    unsigned int        index, i, fin;
-    struct ip4_bucket    *bkt;
-    struct ip4_bucket_entry *tmp_ent;
+    unsigned int        index, i, fin, count;
+    struct ip4_bucket_entry *tmp_ent, *ents;
 
     if (ENTRY_IS_NEXTHOP(ent))
         return -ENOENT;
 
-    bkt = entry_to_bucket(ent);
-    index = rt_to_index(rt, level);
+    index = rt_to_index(mtrie, rt, level);
 
-    if (rt->rtr_req.rtr_prefix_len > ip4_bkt_info[level].bi_pfx_len) {
-        tmp_ent = index_to_entry(bkt, index);
-        __mtrie_delete(rt, tmp_ent, level + 1);
+    if (rt->rtr_req.rtr_prefix_len > mtrie->mtrie_bkt_info[level].bi_pfx_len) {
+        tmp_ent = bucket_index_to_entry(ent, index);
+        __mtrie_delete(mtrie, rt, tmp_ent, level + 1, rl);
     } else {
         if ((rt->rtr_req.rtr_prefix_len >
-                (ip4_bkt_info[level].bi_pfx_len - ip4_bkt_info[level].bi_bits)) &&
-                (rt->rtr_req.rtr_prefix_len <= ip4_bkt_info[level].bi_pfx_len)) {
-            fin = 1 << (ip4_bkt_info[level].bi_pfx_len - rt->rtr_req.rtr_prefix_len); 
+                (mtrie->mtrie_bkt_info[level].bi_pfx_len - mtrie->mtrie_bkt_info[level].bi_bits)) &&
+                (rt->rtr_req.rtr_prefix_len <= mtrie->mtrie_bkt_info[level].bi_pfx_len)) {
+            fin = 1 << (mtrie->mtrie_bkt_info[level].bi_pfx_len - rt->rtr_req.rtr_prefix_len); 
         } else {
-            fin = ip4_bkt_info[level].bi_size;
+            fin = mtrie->mtrie_bkt_info[level].bi_size;
         }
 
          fin += index;
-         if (fin > ip4_bkt_info[level].bi_size)
-             fin = ip4_bkt_info[level].bi_size;
-
-         for (i = index; i < fin; i++) {
-            tmp_ent = index_to_entry(bkt, i);
+         if (fin > mtrie->mtrie_bkt_info[level].bi_size)
+             fin = mtrie->mtrie_bkt_info[level].bi_size;
+
+         /*
+          * a compressed bucket that is covered only in part has to be
+          * expanded. if it is covered as a whole, its runs can be walked
+          */
+         if (PTR_IS_CBUCKET(ent->entry_long_i) &&
+                 (index || fin != mtrie->mtrie_bkt_info[level].bi_size) &&
+                 mtrie_expand_bucket(mtrie, ent, level, rl))
+             return -ENOMEM;
+
+         ents = bucket_entries(mtrie, ent->entry_long_i, level, &count);
+         if (!PTR_IS_CBUCKET(ent->entry_long_i)) {
+             ents += index;
+             count = fin - index;
+         }
+
+         for (i = 0; i < count; i++) {
+            tmp_ent = &ents[i];
             if (ENTRY_IS_NEXTHOP(tmp_ent) &&
                             (tmp_ent->entry_prefix_len == rt->rtr_req.rtr_prefix_len)) {
                 set_entry_to_nh(tmp_ent, rt->rtr_nh);
@@ -424,25 +968,20 @@ __mtrie_delete(struct vr_route_req *rt, struct ip4_bucket_entry *ent,
                 tmp_ent->entry_label = rt->rtr_req.rtr_label;
                 tmp_ent->entry_prefix_len = rt->rtr_req.rtr_replace_plen;
             } else 
-                __mtrie_delete(rt, tmp_ent, level + 1);
+                __mtrie_delete(mtrie, rt, tmp_ent, level + 1, rl);
         }
     }
 
     /* check if current bucket neds to be deleted */
-    for (i = 1; i < ip4_bkt_info[level].bi_size; i++) {
-        if ((bkt->bkt_data[i].entry_long_i == bkt->bkt_data[0].entry_long_i) &&
-                (bkt->bkt_data[i].entry_label_flags ==
-                	bkt->bkt_data[0].entry_label_flags) &&
-                (bkt->bkt_data[i].entry_label ==
-                	bkt->bkt_data[0].entry_label) && 
-                (bkt->bkt_data[i].entry_prefix_len == 
-			bkt->bkt_data[0].entry_prefix_len)) {
+    ents = bucket_entries(mtrie, ent->entry_long_i, level, &count);
+    for (i = 1; i < count; i++) {
+        if (entry_same_route(&ents[i], &ents[0]))
             continue;
-        } else
+        else
             return 0;
     }
 
-    free_bucket(ent, level, rt);
+    free_bucket(mtrie, ent, level, rt, rl);
     return 0;
 }
 
@@ -464,6 +1003,7 @@ mtrie_dumper_make_response(struct vr_message_dumper *dumper, vr_route_req *resp,
 {
     vr_route_req *req = (vr_route_req *)dumper->dump_req;
 
+    memset(resp, 0, sizeof(*resp));
     resp->rtr_vrf_id = req->rtr_vrf_id;
     resp->rtr_family = req->rtr_family;
     resp->rtr_prefix = prefix;
@@ -473,39 +1013,35 @@ mtrie_dumper_make_response(struct vr_message_dumper *dumper, vr_route_req *resp,
     resp->rtr_label = ent->entry_label;
     resp->rtr_nh_id = ent->entry_nh_p->nh_id;
     resp->rtr_rt_type = RT_UCAST;
-    resp->rtr_mac_size = 0;
-    resp->rtr_mac = NULL;
     resp->rtr_replace_plen = ent->entry_prefix_len;
 
     return;
 }
 
 static int
-mtrie_dump_entry(struct vr_message_dumper *dumper, struct ip4_bucket_entry *ent,
-        unsigned int byte, int level)
+mtrie_dump_entry(struct ip4_mtrie *mtrie, struct vr_message_dumper *dumper,
+        struct ip4_bucket_entry *ent, unsigned int byte, int level)
 {
 #ifdef VR_ROUTE_DEBUG
     unsigned char *addr;
 #endif
     unsigned int i = 0, prefix;
     int ret;
-    struct ip4_bucket *bkt;
     struct ip4_bucket_entry *ent_p = ent;
     vr_route_req *req, resp;
 
     req = dumper->dump_req;
     if (!dumper->dump_been_to_marker) {
-        i = PREFIX_TO_INDEX(req->rtr_marker, level);
-        bkt = entry_to_bucket(ent);
-        ent = index_to_entry(bkt, i);
+        i = PREFIX_TO_INDEX(mtrie, req->rtr_marker, level);
+        ent = bucket_index_to_entry(ent, i);
 
-        prefix = byte | (i << ip4_bkt_info[level].bi_shift);
+        prefix = byte | (i << mtrie->mtrie_bkt_info[level].bi_shift);
         if ((prefix == (unsigned int)req->rtr_marker &&
-                    ip4_bkt_info[level].bi_pfx_len == req->rtr_marker_plen))
+                    mtrie->mtrie_bkt_info[level].bi_pfx_len == req->rtr_marker_plen))
             dumper->dump_been_to_marker = 1;
 
         if (ENTRY_IS_BUCKET(ent) && !dumper->dump_been_to_marker) {
-            if (mtrie_dump_entry(dumper, ent, prefix, level + 1))
+            if (mtrie_dump_entry(mtrie, dumper, ent, prefix, level + 1))
                 return -1;
             i++;
         } else {
@@ -516,21 +1052,20 @@ mtrie_dump_entry(struct vr_message_dumper *dumper, struct ip4_bucket_entry *ent,
     }
 
     if (ENTRY_IS_BUCKET(ent_p)) {
-        bkt = entry_to_bucket(ent_p);
-        for (; i < ip4_bkt_info[level].bi_size; i++) {
-            ent = &bkt->bkt_data[i];
-            prefix = byte | (i << ip4_bkt_info[level].bi_shift);
-            if (mtrie_dump_entry(dumper, ent, prefix, level + 1) < 0)
+        for (; i < mtrie->mtrie_bkt_info[level].bi_size; i++) {
+            ent = bucket_index_to_entry(ent_p, i);
+            prefix = byte | (i << mtrie->mtrie_bkt_info[level].bi_shift);
+            if (mtrie_dump_entry(mtrie, dumper, ent, prefix, level + 1) < 0)
                 return -1;
         }
     } else if (ent_p->entry_nh_p) {
         mtrie_dumper_make_response(dumper, &resp, ent_p, byte,
-                ip4_bkt_info[level - 1].bi_pfx_len);
+                mtrie->mtrie_bkt_info[level - 1].bi_pfx_len);
 
 #ifdef VR_ROUTE_DEBUG
         addr = (unsigned char *)&byte;
         vr_printf("%u.%u.%u.%u/%u\t\t", addr[3], addr[2], addr[1], addr[0],
-                        ip4_bkt_info[level - 1].bi_pfx_len);
+                        mtrie->mtrie_bkt_info[level - 1].bi_pfx_len);
         if (ent_p->entry_label_flags) {
             vr_printf("%d\t", ent_p->entry_label);
         } else {
@@ -561,7 +1096,7 @@ mtrie_walk(struct vr_message_dumper *dumper)
 
     ent = &mtrie->root;
     if (ENTRY_IS_BUCKET(ent)) {
-        return mtrie_dump_entry(dumper, ent, 0, 0);
+        return mtrie_dump_entry(mtrie, dumper, ent, 0, 0);
     }
 
     return 0;
@@ -603,36 +1138,106 @@ generate_response:
  * concurrency.
  */
 static int
-mtrie_delete(struct vr_rtable * _unused, struct vr_route_req *rt)
+mtrie_delete_route(struct ip4_mtrie *rtable, struct vr_route_req *rt)
 {
-    int vrf_id = rt->rtr_req.rtr_vrf_id;
-    struct ip4_mtrie *rtable;
-
-    rtable = vrfid_to_mtrie(vrf_id);
-    if (!rtable)
-        return -ENOENT;
+    struct ip4_retire_list rl = { 0 };
 
     rt->rtr_nh = vrouter_get_nexthop(rt->rtr_req.rtr_rid, rt->rtr_req.rtr_nh_id);
     if (!rt->rtr_nh)
         return -ENOENT;
 
-    __mtrie_delete(rt, &rtable->root, 0);
+    __mtrie_delete(rtable, rt, &rtable->root, 0, &rl);
+    mtrie_compress_path(rtable, rt, &rl);
+    mtrie_flush_retired(rtable, &rl);
     vrouter_put_nexthop(rt->rtr_nh);
 
    return 0;
 }
 
+static int
+mtrie_delete(struct vr_rtable * _unused, struct vr_route_req *rt)
+{
+    int ret;
+    struct ip4_mtrie *rtable;
+
+    rtable = vrfid_to_mtrie(rt->rtr_req.rtr_vrf_id);
+    if (!rtable)
+        return -ENOENT;
+
+    mtrie_vrf_change_begin(rt->rtr_req.rtr_vrf_id);
+    ret = mtrie_delete_route(rtable, rt);
+    mtrie_vrf_change_end(rt->rtr_req.rtr_vrf_id);
+
+    return ret;
+}
+
 static inline struct vr_vrf_stats *
 mtrie_stats(unsigned short vrf, unsigned int cpu)
+{
+    struct vr_vrf_stats *chunk;
+
+    if (vrf >= VR_MAX_VRFS)
+        return &mtrie_cpu_stats[cpu]->mcs_invalid;
+
+    chunk = mtrie_cpu_stats[cpu]->mcs_chunks[vrf / MTRIE_STATS_CHUNK];
+    if (!chunk)
+        return NULL;
+
+    return &chunk[vrf % MTRIE_STATS_CHUNK];
+}
+
+static inline bool
+mtrie_stats_present(unsigned int vrf)
 {
     if (vrf >= VR_MAX_VRFS)
-        return &invalid_vrf_stats[cpu];
+        return false;
 
-    return &((mtrie_vrf_stats[vrf])[cpu]);
+    return mtrie_stats_vrfs[vrf / MTRIE_STATS_CHUNK] &
+        (1ULL << (vrf % MTRIE_STATS_CHUNK));
 }
 
+/*
+ * the counters of the vrf, for all the cpus. a cpu whose run could not be
+ * allocated does not count, and it is tried again with the next route add
+ */
 static int
-mtrie_stats_get(vr_vrf_stats_req *req, vr_vrf_stats_req *response)
+mtrie_stats_alloc(unsigned int vrf)
+{
+    unsigned int cpu, chunk = vrf / MTRIE_STATS_CHUNK, size;
+    struct vr_vrf_stats *stats;
+
+    if (vrf >= VR_MAX_VRFS)
+        return -EINVAL;
+
+    if (mtrie_stats_present(vrf))
+        return 0;
+
+    size = sizeof(struct vr_vrf_stats) * MTRIE_STATS_CHUNK;
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        if (mtrie_cpu_stats[cpu]->mcs_chunks[chunk])
+            continue;
+
+        stats = vr_zalloc(size);
+        if (!stats)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, vrf);
+
+        /* the counters are to be seen zeroed by whoever sees the run */
+        __sync_synchronize();
+        mtrie_cpu_stats[cpu]->mcs_chunks[chunk] = stats;
+    }
+
+    mtrie_stats_vrfs[chunk] |= (1ULL << (vrf % MTRIE_STATS_CHUNK));
+
+    return 0;
+}
+
+/*
+ * the packet counters are kept per vrf, by the nexthops, and hence are
+ * the same for both the inet and inet6 tables of a vrf
+ */
+static void
+mtrie_stats_fill(struct ip4_mtrie *mtrie, vr_vrf_stats_req *req,
+        vr_vrf_stats_req *response)
 {
     unsigned int i;
     struct vr_vrf_stats *stats;
@@ -644,6 +1249,17 @@ mtrie_stats_get(vr_vrf_stats_req *req, vr_vrf_stats_req *response)
     response->vsr_type = req->vsr_type;
     response->vsr_vrf = req->vsr_vrf;
 
+    if (mtrie) {
+        response->vsr_rt_layout = mtrie->mtrie_layout;
+        response->vsr_rt_memory = mtrie->mtrie_memory;
+        response->vsr_rt_buckets = mtrie->mtrie_buckets;
+        response->vsr_rt_cbuckets = mtrie->mtrie_cbuckets;
+    }
+
+    /* vrfs that never had a route have no counters */
+    if (req->vsr_vrf >= 0 && !mtrie_stats_present(req->vsr_vrf))
+        return;
+
     for (i = 0; i < vr_num_cpus; i++) {
         stats = mtrie_stats(req->vsr_vrf, i);
         if (stats) {
@@ -664,6 +1280,14 @@ mtrie_stats_get(vr_vrf_stats_req *req, vr_vrf_stats_req *response)
         }
     }
 
+    return;
+}
+
+static int
+mtrie_stats_get(vr_vrf_stats_req *req, vr_vrf_stats_req *response)
+{
+    mtrie_stats_fill(vrfid_to_mtrie(req->vsr_vrf), req, response);
+
     return 0;
 }
 
@@ -675,7 +1299,7 @@ mtrie_stats_empty(vr_vrf_stats_req *r)
             r->vsr_l2_mcast_composites || r->vsr_fabric_composites ||
             r->vsr_multi_proto_composites || r->vsr_udp_tunnels || 
             r->vsr_udp_mpls_tunnels || r->vsr_gre_mpls_tunnels || 
-            r->vsr_l2_encaps || r->vsr_encaps)
+            r->vsr_l2_encaps || r->vsr_encaps || r->vsr_rt_memory)
         return false;
 
     return true;
@@ -697,8 +1321,11 @@ mtrie_stats_dump(struct vr_rtable *rtable, vr_vrf_stats_req *req)
 
 
     for (i = req->vsr_marker + 1; i < rtable->algo_max_vrfs; i++) {
+        if (!mtrie_stats_present(i))
+            continue;
+
         req->vsr_vrf = i;
-        mtrie_stats_get(req, &response);
+        rtable->algo_stats_get(req, &response);
         if (mtrie_stats_empty(&response))
             continue;
         len = vr_message_dump_object(dumper, VR_VRF_STATS_OBJECT_ID,
@@ -708,7 +1335,7 @@ mtrie_stats_dump(struct vr_rtable *rtable, vr_vrf_stats_req *req)
     }
 
     req->vsr_vrf = -1;
-    mtrie_stats_get(req, &response);
+    rtable->algo_stats_get(req, &response);
     if (mtrie_stats_empty(&response))
         goto generate_response;
 
@@ -720,9 +1347,32 @@ generate_response:
 
     return 0;
 }
-/*
- * longest prefix match. go down the tree till you encounter a next-hop.
- * if no nexthop, there is something wrong with the tree which was built.
+
+static inline struct ip4_bucket_entry *
+mtrie_lookup_entry(struct ip4_mtrie *table, unsigned long ptr,
+        struct vr_route_req *rt, unsigned int level)
+{
+    unsigned int index = PREFIX_TO_INDEX(table, rt->rtr_req.rtr_prefix, level);
+
+    if (PTR_IS_CBUCKET(ptr))
+        return ip4_cbucket_entry(PTR_TO_CBUCKET(ptr), index);
+
+    return index_to_entry(PTR_TO_BUCKET(ptr), index);
+}
+
+static inline struct vr_nexthop *
+mtrie_lookup_result(struct vr_route_req *rt, struct ip4_bucket_entry *ent)
+{
+    rt->rtr_req.rtr_label_flags = ent->entry_label_flags;
+    rt->rtr_req.rtr_label = ent->entry_label;
+    rt->rtr_req.rtr_prefix_len = ent->entry_prefix_len;
+
+    return PTR_TO_NEXTHOP(ent->entry_long_i);
+}
+
+/*
+ * longest prefix match. go down the tree till you encounter a next-hop.
+ * if no nexthop, there is something wrong with the tree which was built.
  *
  * returns the nexthop of the LPM route
  */
@@ -730,10 +1380,9 @@ static struct vr_nexthop *
 mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
         struct vr_packet *pkt)
 {
-    unsigned int        level, index;
+    unsigned int        level;
     unsigned long       ptr;
     struct ip4_mtrie   *table;
-    struct ip4_bucket  *bkt;
     struct ip4_bucket_entry *ent;
 
     /* we do not support any thing other than /32 route lookup */
@@ -749,29 +1398,17 @@ mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
     if (!ptr)
         return ip4_default_nh;
 
-    if (PTR_IS_NEXTHOP(ptr)) {
-        rt->rtr_req.rtr_label_flags = ent->entry_label_flags;
-        rt->rtr_req.rtr_label = ent->entry_label;
-        rt->rtr_req.rtr_prefix_len = ent->entry_prefix_len;
-        return PTR_TO_NEXTHOP(ptr);
-    }
+    if (PTR_IS_NEXTHOP(ptr))
+        return mtrie_lookup_result(rt, ent);
 
-    bkt = PTR_TO_BUCKET(ptr);
-    if (!bkt)
+    if (!PTR_TO_BUCKET(ptr))
         return ip4_default_nh;
 
-    for (level = 0; level < IP4_BKT_LEVELS; level++) {
-        index = rt_to_index(rt, level);
-        ent = index_to_entry(bkt, index);
+    for (level = 0; level < table->mtrie_levels; level++) {
+        ent = mtrie_lookup_entry(table, ptr, rt, level);
         ptr = ent->entry_long_i;
-        if (PTR_IS_NEXTHOP(ptr)) {
-            rt->rtr_req.rtr_label_flags = ent->entry_label_flags;
-            rt->rtr_req.rtr_label = ent->entry_label;
-            rt->rtr_req.rtr_prefix_len = ent->entry_prefix_len;
-            return PTR_TO_NEXTHOP(ptr);
-        }
-
-        bkt = PTR_TO_BUCKET(ptr);
+        if (PTR_IS_NEXTHOP(ptr))
+            return mtrie_lookup_result(rt, ent);
     }
 
     /* no nexthop; assert */
@@ -780,20 +1417,36 @@ mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
     return NULL;
 }
 
+/* mtrie_lookup, through the route cache for the lookups for a packet */
+static struct vr_nexthop *
+mtrie_lookup_cached(unsigned int vrf_id, struct vr_route_req *rt,
+        struct vr_packet *pkt)
+{
+    unsigned int gen = 0;
+    struct vr_nexthop *nh;
+    struct ip4_rcache_entry *rce = NULL;
+
+    if (pkt) {
+        nh = mtrie_rcache_get(vr_get_cpu(), vrf_id, rt, &rce, &gen);
+        if (nh)
+            return nh;
+    }
+
+    nh = mtrie_lookup(vrf_id, rt, pkt);
+    mtrie_rcache_put(rce, vrf_id, rt, gen, nh);
+
+    return nh;
+}
+
 /*
  * adds a route to the corresponding vrf table. returns 0 on
  * success and non-zero otherwise
  */
 static int
-mtrie_add(struct vr_rtable * _unused, struct vr_route_req *rt)
+mtrie_add_route(struct ip4_mtrie *mtrie, struct vr_route_req *rt)
 {
-    unsigned int            vrf_id = rt->rtr_req.rtr_vrf_id;
-    struct ip4_mtrie       *mtrie = vrfid_to_mtrie(vrf_id);
     int ret;
-
-    mtrie = (mtrie ? : mtrie_alloc_vrf(vrf_id));
-    if (!mtrie)
-        return -ENOMEM;
+    struct ip4_retire_list rl = { 0 };
 
     rt->rtr_nh = vrouter_get_nexthop(rt->rtr_req.rtr_rid, rt->rtr_req.rtr_nh_id);
     if (!rt->rtr_nh)
@@ -805,11 +1458,305 @@ mtrie_add(struct vr_rtable * _unused, struct vr_route_req *rt)
         vrouter_put_nexthop(rt->rtr_nh);
         return -EINVAL;
     }
-    ret = __mtrie_add(mtrie, rt);
+    ret = __mtrie_add(mtrie, rt, &rl);
+    mtrie_compress_path(mtrie, rt, &rl);
+    mtrie_flush_retired(mtrie, &rl);
     vrouter_put_nexthop(rt->rtr_nh);
     return ret;
 }
 
+/*
+ * a layout is of use only if the host can allocate its widest bucket in
+ * one piece. pages go as far as VR_SINGLE_ALLOC_LIMIT, and beyond that
+ * only huge pages do, and hence 24/8 is there only where the host has
+ * huge pages to give
+ */
+static bool
+mtrie_layout_valid(unsigned int layout)
+{
+    unsigned int level;
+
+    if (layout == VR_RT_LAYOUT_DEFAULT || layout >= VR_RT_LAYOUT_MAX)
+        return false;
+
+    if (vr_huge_page_alloc)
+        return true;
+
+    for (level = 0; level < ip4_mtrie_levels[layout]; level++) {
+        if (sizeof(struct ip4_bucket) + sizeof(struct ip4_bucket_entry) *
+                ip4_mtrie_layouts[layout][level].bi_size >
+                VR_SINGLE_ALLOC_LIMIT)
+            return false;
+    }
+
+    return true;
+}
+
+static int
+mtrie_add(struct vr_rtable * _unused, struct vr_route_req *rt)
+{
+    int                     ret;
+    unsigned int            vrf_id = rt->rtr_req.rtr_vrf_id;
+    struct ip4_mtrie       *mtrie = vrfid_to_mtrie(vrf_id);
+    unsigned int            layout;
+
+    if (!mtrie) {
+        layout = rt->rtr_req.rtr_vrf_layout ? : vr_mtrie_layout;
+        if (!mtrie_layout_valid(layout))
+            return -EINVAL;
+
+        ret = mtrie_stats_alloc(vrf_id);
+        if (ret)
+            return ret;
+
+        mtrie = mtrie_alloc_vrf(layout);
+        if (!mtrie)
+            return -ENOMEM;
+
+        vn_rtable[vrf_id] = mtrie;
+    }
+
+    mtrie_vrf_change_begin(vrf_id);
+    ret = mtrie_add_route(mtrie, rt);
+    mtrie_vrf_change_end(vrf_id);
+
+    return ret;
+}
+
+/*
+ * compress, deepest first, all the buckets below the entry. a bulk add
+ * builds full buckets, since the routes come in no particular order, and
+ * compresses the table once, before it is published
+ */
+static void
+mtrie_compress_tree(struct ip4_mtrie *mtrie, struct ip4_bucket_entry *ent,
+        unsigned int level, struct ip4_retire_list *rl)
+{
+    unsigned int i;
+    struct ip4_bucket *bkt;
+
+    bkt = entry_to_bucket(ent);
+    if (!bkt)
+        return;
+
+    for (i = 0; i < mtrie->mtrie_bkt_info[level].bi_size; i++)
+        mtrie_compress_tree(mtrie, &bkt->bkt_data[i], level + 1, rl);
+
+    mtrie_compress_bucket(mtrie, ent, level, rl);
+
+    return;
+}
+
+struct ip4_mtrie_defer_data {
+    struct ip4_mtrie *mdd_mtrie;
+};
+
+static void
+mtrie_free_table_cb(struct vrouter *router, void *data)
+{
+    struct ip4_mtrie_defer_data *mdd = (struct ip4_mtrie_defer_data *)data;
+
+    mtrie_free_buckets(mdd->mdd_mtrie, &mdd->mdd_mtrie->root, 0);
+    vr_free(mdd->mdd_mtrie);
+
+    return;
+}
+
+/*
+ * free a table that was replaced as a whole. the nexthops go right away,
+ * and the buckets all together, once the readers that may still be walking
+ * them are done
+ */
+static void
+mtrie_free_table(struct vrouter *router, struct ip4_mtrie *mtrie)
+{
+    struct ip4_mtrie_defer_data *mdd;
+
+    mtrie_put_nexthops(mtrie, &mtrie->root, 0);
+
+    mdd = vr_get_defer_data(sizeof(*mdd));
+    if (!mdd) {
+        vr_delay_op();
+        mtrie_free_buckets(mtrie, &mtrie->root, 0);
+        vr_free(mtrie);
+        return;
+    }
+
+    mdd->mdd_mtrie = mtrie;
+    vr_defer(router, mtrie_free_table_cb, (void *)mdd);
+
+    return;
+}
+
+static void
+mtrie_bulk_abort(unsigned int vrf_id)
+{
+    struct ip4_mtrie *shadow = vn_shadow_rtable[vrf_id];
+
+    if (!shadow)
+        return;
+
+    vn_shadow_rtable[vrf_id] = NULL;
+    mtrie_free_entry(shadow, &shadow->root, 0);
+    vr_free(shadow);
+
+    return;
+}
+
+/*
+ * the shadow table has the layout that the request asks for, and else
+ * that of the table it is going to replace
+ */
+static int
+mtrie_bulk_begin(struct vr_route_req *rt)
+{
+    int ret;
+    unsigned int vrf_id = rt->rtr_req.rtr_vrf_id, layout;
+    struct ip4_mtrie *mtrie, *shadow;
+
+    layout = rt->rtr_req.rtr_vrf_layout;
+    if (!layout) {
+        mtrie = vrfid_to_mtrie(vrf_id);
+        layout = mtrie ? mtrie->mtrie_layout : vr_mtrie_layout;
+    }
+
+    if (!mtrie_layout_valid(layout))
+        return -EINVAL;
+
+    mtrie_bulk_abort(vrf_id);
+
+    ret = mtrie_stats_alloc(vrf_id);
+    if (ret)
+        return ret;
+
+    shadow = mtrie_alloc_vrf(layout);
+    if (!shadow)
+        return -ENOMEM;
+
+    shadow->mtrie_shadow = 1;
+    vn_shadow_rtable[vrf_id] = shadow;
+
+    return 0;
+}
+
+static int
+mtrie_bulk_route_add(struct ip4_mtrie *shadow, struct vr_route_req *rt,
+        unsigned int i)
+{
+    int ret;
+    struct vr_route_req route;
+    struct ip4_retire_list rl = { 0 };
+
+    route.rtr_req = rt->rtr_req;
+    route.rtr_req.rtr_prefix = rt->rtr_req.rtr_bulk_prefix[i];
+    route.rtr_req.rtr_prefix_len =
+        (unsigned char)rt->rtr_req.rtr_bulk_prefix_len[i];
+    route.rtr_req.rtr_nh_id = rt->rtr_req.rtr_bulk_nh_id[i];
+    route.rtr_req.rtr_label = rt->rtr_req.rtr_bulk_label[i];
+    route.rtr_req.rtr_label_flags = rt->rtr_req.rtr_bulk_label_flags[i];
+
+    route.rtr_nh = vrouter_get_nexthop(route.rtr_req.rtr_rid,
+            route.rtr_req.rtr_nh_id);
+    if (!route.rtr_nh)
+        return -ENOENT;
+
+    if ((!(route.rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)) &&
+                 (route.rtr_nh->nh_type == NH_TUNNEL)) {
+        vrouter_put_nexthop(route.rtr_nh);
+        return -EINVAL;
+    }
+
+    ret = __mtrie_add(shadow, &route, &rl);
+    mtrie_flush_retired(shadow, &rl);
+    vrouter_put_nexthop(route.rtr_nh);
+
+    return ret;
+}
+
+/*
+ * publish the shadow table of the vrf with a single store. the table it
+ * replaces is freed with one deferred free, and not a wait per bucket
+ */
+static int
+mtrie_bulk_commit(struct vr_route_req *rt)
+{
+    unsigned int vrf_id = rt->rtr_req.rtr_vrf_id;
+    struct ip4_mtrie *shadow, *old;
+    struct ip4_retire_list rl = { 0 };
+
+    shadow = vn_shadow_rtable[vrf_id];
+    if (!shadow)
+        return -ENOENT;
+
+    vn_shadow_rtable[vrf_id] = NULL;
+    if (shadow->mtrie_cbkt_runs) {
+        mtrie_compress_tree(shadow, &shadow->root, 0, &rl);
+        mtrie_flush_retired(shadow, &rl);
+    }
+    shadow->mtrie_shadow = 0;
+
+    mtrie_vrf_change_begin(vrf_id);
+    old = vn_rtable[vrf_id];
+    /* the table has to be seen whole by whoever sees the pointer */
+    __sync_synchronize();
+    vn_rtable[vrf_id] = shadow;
+
+    if (old)
+        mtrie_free_table(vrouter_get(rt->rtr_req.rtr_rid), old);
+    mtrie_vrf_change_end(vrf_id);
+
+    return 0;
+}
+
+/*
+ * a bulk add replaces the table of a vrf as a whole, for when the agent
+ * programs all of it at once, as it does after a restart. BEGIN starts a
+ * shadow table, the routes of each message go to it and COMMIT publishes
+ * it. the live table keeps being used for lookups, and changed by the
+ * route adds and deletes that are not bulk, in the meantime. the shadow
+ * table is dropped on ABORT, and on the first route that fails to go in,
+ * so that no table with missing routes is ever published
+ */
+static int
+mtrie_bulk_add(struct vr_rtable * _unused, struct vr_route_req *rt)
+{
+    int ret;
+    unsigned int i, vrf_id = rt->rtr_req.rtr_vrf_id;
+    unsigned int flags = rt->rtr_req.rtr_bulk_flags;
+    struct ip4_mtrie *shadow;
+
+    if (vrf_id >= VR_MAX_VRFS)
+        return -EINVAL;
+
+    if (flags & VR_RT_BULK_ABORT_FLAG) {
+        mtrie_bulk_abort(vrf_id);
+        return 0;
+    }
+
+    if (flags & VR_RT_BULK_BEGIN_FLAG) {
+        ret = mtrie_bulk_begin(rt);
+        if (ret)
+            return ret;
+    }
+
+    shadow = vn_shadow_rtable[vrf_id];
+    if (!shadow)
+        return -ENOENT;
+
+    for (i = 0; i < rt->rtr_req.rtr_bulk_prefix_size; i++) {
+        ret = mtrie_bulk_route_add(shadow, rt, i);
+        if (ret) {
+            mtrie_bulk_abort(vrf_id);
+            return ret;
+        }
+    }
+
+    if (flags & VR_RT_BULK_COMMIT_FLAG)
+        return mtrie_bulk_commit(rt);
+
+    return 0;
+}
+
 /*
  * Exact-match
  * returns the next-hop on exact match. NULL otherwise
@@ -828,19 +1775,36 @@ mtrie_get(unsigned int vrf_id, struct vr_route_req *rt)
 }
 
 static struct ip4_mtrie *
-mtrie_alloc_vrf(unsigned int vrf_id)
+mtrie_alloc(unsigned int family, struct mtrie_bkt_info *bkt_info,
+        unsigned int levels)
 {
     struct ip4_mtrie *mtrie;
 
     mtrie = vr_zalloc(sizeof(struct ip4_mtrie));
     if (mtrie) {
         mtrie->root.entry_nh_p = vrouter_get_nexthop(0, NH_DISCARD_ID);
-        vn_rtable[vrf_id] = mtrie;
+        mtrie->mtrie_bkt_info = bkt_info;
+        mtrie->mtrie_levels = levels;
+        mtrie->mtrie_family = family;
+        mtrie->mtrie_cbkt_runs = vr_mtrie_cbucket_runs;
     }
 
     return mtrie;
 }
 
+static struct ip4_mtrie *
+mtrie_alloc_vrf(unsigned int layout)
+{
+    struct ip4_mtrie *mtrie;
+
+    mtrie = mtrie_alloc(AF_INET, ip4_mtrie_layouts[layout],
+            ip4_mtrie_levels[layout]);
+    if (mtrie)
+        mtrie->mtrie_layout = layout;
+
+    return mtrie;
+}
+
 static void
 mtrie_free_vrf(struct vr_rtable *rtable, unsigned int vrf_id)
 {
@@ -852,7 +1816,7 @@ mtrie_free_vrf(struct vr_rtable *rtable, unsigned int vrf_id)
     if (!mtrie)
         return;
 
-    mtrie_free_entry(&mtrie->root, 0);
+    mtrie_free_entry(mtrie, &mtrie->root, 0);
     vrf_tables[vrf_id] = NULL;
     vr_free(mtrie);
 
@@ -862,26 +1826,77 @@ mtrie_free_vrf(struct vr_rtable *rtable, unsigned int vrf_id)
 static void
 mtrie_stats_cleanup(struct vr_rtable *rtable)
 {
-    unsigned int i;
+    unsigned int cpu, chunk;
+    struct mtrie_cpu_stats *mcs;
+
+    if (!mtrie_cpu_stats)
+        return;
 
-    for (i = 0; i < rtable->algo_max_vrfs; i++) {
-        if (mtrie_vrf_stats[i]) {
-            vr_free(mtrie_vrf_stats[i]);
-            mtrie_vrf_stats[i] = NULL;
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        mcs = mtrie_cpu_stats[cpu];
+        if (!mcs)
+            continue;
+
+        for (chunk = 0; chunk < MTRIE_STATS_CHUNKS; chunk++) {
+            if (mcs->mcs_chunks[chunk])
+                vr_free(mcs->mcs_chunks[chunk]);
         }
+
+        vr_free(mcs);
     }
 
-    vr_free(mtrie_vrf_stats);
-    rtable->vrf_stats = mtrie_vrf_stats = NULL;
+    vr_free(mtrie_cpu_stats);
+    mtrie_cpu_stats = NULL;
+    memset(mtrie_stats_vrfs, 0, sizeof(mtrie_stats_vrfs));
+
+    return;
+}
+
+static void
+mtrie_rcache_exit(void)
+{
+    if (mtrie_rcache) {
+        vr_free(mtrie_rcache);
+        mtrie_rcache = NULL;
+    }
 
-    if (invalid_vrf_stats) {
-        vr_free(invalid_vrf_stats);
-        invalid_vrf_stats = NULL;
+    if (mtrie_vrf_gen) {
+        vr_free(mtrie_vrf_gen);
+        mtrie_vrf_gen = NULL;
     }
 
     return;
 }
 
+static int
+mtrie_rcache_init(void)
+{
+    unsigned int size, entries = vr_mtrie_rcache_entries;
+
+    size = sizeof(unsigned int) * VR_MAX_VRFS;
+    mtrie_vrf_gen = vr_zalloc(size);
+    if (!mtrie_vrf_gen)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, size);
+
+    if (!entries)
+        return 0;
+
+    if ((entries & (entries - 1)) || entries > IP4_RCACHE_MAX_ENTRIES) {
+        mtrie_rcache_exit();
+        return vr_module_error(-EINVAL, __FUNCTION__, __LINE__, entries);
+    }
+
+    size = sizeof(struct ip4_rcache_entry) * entries * vr_num_cpus;
+    mtrie_rcache = vr_zalloc(size);
+    if (!mtrie_rcache) {
+        mtrie_rcache_exit();
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, size);
+    }
+    mtrie_rcache_mask = entries - 1;
+
+    return 0;
+}
+
 void
 mtrie4_algo_deinit(struct vr_rtable *rtable, struct rtable_fspec *fs)
 {
@@ -896,6 +1911,16 @@ mtrie4_algo_deinit(struct vr_rtable *rtable, struct rtable_fspec *fs)
     for (i = 0; i < fs->rtb_max_vrfs; i++)
         mtrie_free_vrf(rtable, i);
 
+    if (vn_shadow_rtable) {
+        for (i = 0; i < fs->rtb_max_vrfs; i++)
+            mtrie_bulk_abort(i);
+
+        vr_free(vn_shadow_rtable);
+        vn_shadow_rtable = NULL;
+    }
+
+    mtrie_rcache_exit();
+
     vr_free(rtable->algo_data);
     rtable->algo_data = NULL;
 
@@ -906,51 +1931,49 @@ mtrie4_algo_deinit(struct vr_rtable *rtable, struct rtable_fspec *fs)
 static int
 mtrie_stats_init(struct vr_rtable *rtable)
 {
-    int ret = 0;
-    unsigned int i;
-    unsigned int stats_memory;
-
-    stats_memory = sizeof(void *) * rtable->algo_max_vrfs;
-    mtrie_vrf_stats = vr_zalloc(stats_memory);
-    if (!mtrie_vrf_stats)
-        return vr_module_error(-ENOMEM, __FUNCTION__,
-                __LINE__, stats_memory);
-
-    for (i = 0; i < rtable->algo_max_vrfs; i++) {
-        stats_memory = sizeof(struct vr_vrf_stats) * vr_num_cpus;
-        mtrie_vrf_stats[i] = vr_zalloc(stats_memory);
-        if (!mtrie_vrf_stats[i] && (ret = -ENOMEM)) {
-            vr_module_error(ret, __FUNCTION__, __LINE__, i);
-            goto cleanup;
+    unsigned int cpu, size;
+
+    size = sizeof(struct mtrie_cpu_stats *) * vr_num_cpus;
+    mtrie_cpu_stats = vr_zalloc(size);
+    if (!mtrie_cpu_stats)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, size);
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        mtrie_cpu_stats[cpu] = vr_zalloc(sizeof(struct mtrie_cpu_stats));
+        if (!mtrie_cpu_stats[cpu]) {
+            mtrie_stats_cleanup(rtable);
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, cpu);
         }
     }
 
-    invalid_vrf_stats = vr_zalloc(sizeof(struct vr_vrf_stats) *
-                            vr_num_cpus);
-    if (!invalid_vrf_stats && (ret = -ENOMEM)) {
-        vr_module_error(ret, __FUNCTION__, __LINE__, -1);
-        goto cleanup;
-    }
-
-    rtable->vrf_stats = mtrie_vrf_stats;
-
     return 0;
+}
 
-cleanup:
-    if (!i)
-        return ret;
-
-    for (--i; i >= 0; i--) {
-        if (mtrie_vrf_stats[i]) {
-            vr_free(mtrie_vrf_stats[i]);
-            mtrie_vrf_stats[i] = NULL;
+static void
+mtrie_layouts_init(void)
+{
+    unsigned int layout, level, pfx_len;
+    struct mtrie_bkt_info *bi;
+
+    for (layout = VR_RT_LAYOUT_8_8_8_8; layout < VR_RT_LAYOUT_MAX; layout++) {
+        pfx_len = 0;
+        for (level = 0; level < IP4_MTRIE_MAX_LEVELS; level++) {
+            if (!ip4_mtrie_strides[layout][level])
+                break;
+
+            bi = &ip4_mtrie_layouts[layout][level];
+            bi->bi_bits = ip4_mtrie_strides[layout][level];
+            pfx_len += bi->bi_bits;
+            bi->bi_pfx_len = pfx_len;
+            bi->bi_shift = IP4_PREFIX_LEN - pfx_len;
+            bi->bi_size = 1 << bi->bi_bits;
+            bi->bi_mask = bi->bi_size - 1;
         }
-    }
 
-    vr_free(mtrie_vrf_stats);
-    mtrie_vrf_stats = NULL;
+        ip4_mtrie_levels[layout] = level;
+    }
 
-    return ret;
+    return;
 }
 
 int
@@ -964,28 +1987,52 @@ mtrie4_algo_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
     if (!rtable->algo_data)
         return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, table_memory);
 
+    vn_shadow_rtable = vr_zalloc(table_memory);
+    if (!vn_shadow_rtable) {
+        ret = vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, table_memory);
+        goto init_fail;
+    }
+
     rtable->algo_max_vrfs = fs->rtb_max_vrfs;
+    mtrie_layouts_init();
+    if (!mtrie_layout_valid(vr_mtrie_layout)) {
+        ret = vr_module_error(-EINVAL, __FUNCTION__, __LINE__,
+                vr_mtrie_layout);
+        goto init_fail;
+    }
     if ((ret = mtrie_stats_init(rtable))) {
         vr_module_error(ret, __FUNCTION__, __LINE__, 0);
         goto init_fail;
     }
 
+    if ((ret = mtrie_rcache_init())) {
+        mtrie_stats_cleanup(rtable);
+        goto init_fail;
+    }
+
     rtable->algo_add = mtrie_add;
     rtable->algo_del = mtrie_delete;
+    rtable->algo_bulk_add = mtrie_bulk_add;
     rtable->algo_lookup = mtrie_lookup;
     rtable->algo_get = mtrie_get;
     rtable->algo_dump = mtrie_dump;
     rtable->algo_stats_get = mtrie_stats_get;
     rtable->algo_stats_dump = mtrie_stats_dump;
 
-    vr_inet_route_lookup = mtrie_lookup;
+    vr_inet_route_lookup = mtrie_rcache ? mtrie_lookup_cached : mtrie_lookup;
     vr_inet_vrf_stats = mtrie_stats;
+    vr_inet_route_gen = mtrie_route_gen;
     /* local cache */
     vn_rtable = (struct ip4_mtrie **)rtable->algo_data;
 
     return 0;
 
 init_fail:
+    if (vn_shadow_rtable) {
+        vr_free(vn_shadow_rtable);
+        vn_shadow_rtable = NULL;
+    }
+
     if (rtable->algo_data) {
         vr_free(rtable->algo_data);
         rtable->algo_data = NULL;
@@ -993,3 +2040,286 @@ init_fail:
 
     return ret;
 }
+
+/*
+ * inet6. the tables are built, compressed and reclaimed by the same code
+ * as the inet ones, which finds the index of a level in rtr_prefix6. only
+ * lookups and dumps, which walk the address a byte at a time, are apart
+ */
+static struct ip4_mtrie *
+mtrie6_alloc_vrf(void)
+{
+    return mtrie_alloc(AF_INET6, ip6_mtrie_layout, IP6_MTRIE_MAX_LEVELS);
+}
+
+static int
+mtrie6_add(struct vr_rtable * _unused, struct vr_route_req *rt)
+{
+    int ret;
+    unsigned int vrf_id = rt->rtr_req.rtr_vrf_id;
+    struct ip4_mtrie *mtrie = vrfid_to_mtrie6(vrf_id);
+
+    if (!mtrie) {
+        ret = mtrie_stats_alloc(vrf_id);
+        if (ret)
+            return ret;
+
+        mtrie = mtrie6_alloc_vrf();
+        if (!mtrie)
+            return -ENOMEM;
+
+        vn6_rtable[vrf_id] = mtrie;
+    }
+
+    return mtrie_add_route(mtrie, rt);
+}
+
+static int
+mtrie6_delete(struct vr_rtable * _unused, struct vr_route_req *rt)
+{
+    struct ip4_mtrie *mtrie;
+
+    mtrie = vrfid_to_mtrie6(rt->rtr_req.rtr_vrf_id);
+    if (!mtrie)
+        return -ENOENT;
+
+    return mtrie_delete_route(mtrie, rt);
+}
+
+/*
+ * longest prefix match of the /128 in rtr_prefix6
+ */
+static struct vr_nexthop *
+mtrie6_lookup(unsigned int vrf_id, struct vr_route_req *rt,
+        struct vr_packet *pkt)
+{
+    unsigned int level, index;
+    unsigned long ptr;
+    unsigned char *addr = (unsigned char *)rt->rtr_req.rtr_prefix6;
+    struct ip4_mtrie *table;
+    struct ip4_bucket_entry *ent;
+
+    if (rt->rtr_req.rtr_prefix_len != IP6_PREFIX_LEN ||
+            rt->rtr_req.rtr_prefix6_size != VR_IP6_ADDRESS_LEN)
+        return ip4_default_nh;
+
+    table = vrfid_to_mtrie6(vrf_id);
+    if (!table)
+        return ip4_default_nh;
+
+    ent = &table->root;
+    ptr = ent->entry_long_i;
+    if (!ptr)
+        return ip4_default_nh;
+
+    if (PTR_IS_NEXTHOP(ptr))
+        return mtrie_lookup_result(rt, ent);
+
+    if (!PTR_TO_BUCKET(ptr))
+        return ip4_default_nh;
+
+    for (level = 0; level < table->mtrie_levels; level++) {
+        index = IP6_ADDR_TO_INDEX(addr, level);
+        if (PTR_IS_CBUCKET(ptr))
+            ent = ip4_cbucket_entry(PTR_TO_CBUCKET(ptr), index);
+        else
+            ent = index_to_entry(PTR_TO_BUCKET(ptr), index);
+
+        ptr = ent->entry_long_i;
+        if (PTR_IS_NEXTHOP(ptr))
+            return mtrie_lookup_result(rt, ent);
+    }
+
+    /* no nexthop; assert */
+    ASSERT(0);
+
+    return NULL;
+}
+
+static int
+mtrie6_get(unsigned int vrf_id, struct vr_route_req *rt)
+{
+    struct vr_nexthop *nh;
+
+    nh = mtrie6_lookup(vrf_id, rt, NULL);
+    if (nh)
+        rt->rtr_req.rtr_nh_id = nh->nh_id;
+    else
+        rt->rtr_req.rtr_nh_id = -1;
+    return 0;
+}
+
+static void
+ip6_index_to_addr(unsigned char *addr, unsigned int index, unsigned int level)
+{
+    if (level) {
+        addr[level + 1] = index;
+    } else {
+        addr[0] = index >> 8;
+        addr[1] = index & 0xff;
+    }
+
+    return;
+}
+
+/*
+ * as mtrie_dump_entry, with the prefix that the walk has come down
+ * carried in 'byte', a copy of which each level adds its index to
+ */
+static int
+mtrie6_dump_entry(struct ip4_mtrie *mtrie, struct vr_message_dumper *dumper,
+        struct ip4_bucket_entry *ent, unsigned char *byte, int level)
+{
+    unsigned int i = 0;
+    unsigned char prefix[VR_IP6_ADDRESS_LEN];
+    struct ip4_bucket_entry *ent_p = ent;
+    vr_route_req *req, resp;
+
+    req = dumper->dump_req;
+    memcpy(prefix, byte, sizeof(prefix));
+    if (!dumper->dump_been_to_marker) {
+        i = IP6_ADDR_TO_INDEX((unsigned char *)req->rtr_marker6, level);
+        ent = bucket_index_to_entry(ent, i);
+
+        ip6_index_to_addr(prefix, i, level);
+        if (!memcmp(prefix, req->rtr_marker6, VR_IP6_ADDRESS_LEN) &&
+                mtrie->mtrie_bkt_info[level].bi_pfx_len ==
+                req->rtr_marker_plen)
+            dumper->dump_been_to_marker = 1;
+
+        if (ENTRY_IS_BUCKET(ent) && !dumper->dump_been_to_marker) {
+            if (mtrie6_dump_entry(mtrie, dumper, ent, prefix, level + 1))
+                return -1;
+            i++;
+        } else {
+            if (dumper->dump_been_to_marker)
+                i++;
+            dumper->dump_been_to_marker = 1;
+        }
+    }
+
+    if (ENTRY_IS_BUCKET(ent_p)) {
+        for (; i < mtrie->mtrie_bkt_info[level].bi_size; i++) {
+            ent = bucket_index_to_entry(ent_p, i);
+            ip6_index_to_addr(prefix, i, level);
+            if (mtrie6_dump_entry(mtrie, dumper, ent, prefix, level + 1) < 0)
+                return -1;
+        }
+    } else if (ent_p->entry_nh_p) {
+        mtrie_dumper_make_response(dumper, &resp, ent_p, 0,
+                mtrie->mtrie_bkt_info[level - 1].bi_pfx_len);
+        resp.rtr_prefix6 = (int8_t *)byte;
+        resp.rtr_prefix6_size = VR_IP6_ADDRESS_LEN;
+
+        if (mtrie_dumper_route_encode(dumper, &resp) <= 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+mtrie6_dump(struct vr_rtable * __unsued, struct vr_route_req *rt)
+{
+    int ret = 0;
+    unsigned char prefix[VR_IP6_ADDRESS_LEN] = { 0 };
+    vr_route_req *req;
+    struct ip4_mtrie *mtrie;
+    struct vr_message_dumper *dumper;
+
+    dumper = vr_message_dump_init(&rt->rtr_req);
+    if (!dumper) {
+        ret = -ENOMEM;
+        goto generate_response;
+    }
+
+    req = (vr_route_req *)dumper->dump_req;
+    if (req->rtr_marker6_size != VR_IP6_ADDRESS_LEN)
+        dumper->dump_been_to_marker = 1;
+
+    mtrie = vrfid_to_mtrie6(req->rtr_vrf_id);
+    if (!mtrie) {
+        ret = -EINVAL;
+        goto generate_response;
+    }
+
+    if (ENTRY_IS_BUCKET(&mtrie->root))
+        ret = mtrie6_dump_entry(mtrie, dumper, &mtrie->root, prefix, 0);
+
+generate_response:
+    vr_message_dump_exit(dumper, ret);
+
+    return 0;
+}
+
+static int
+mtrie6_stats_get(vr_vrf_stats_req *req, vr_vrf_stats_req *response)
+{
+    mtrie_stats_fill(vrfid_to_mtrie6(req->vsr_vrf), req, response);
+
+    return 0;
+}
+
+static void
+mtrie6_layout_init(void)
+{
+    unsigned int level, pfx_len = 0;
+    struct mtrie_bkt_info *bi;
+
+    for (level = 0; level < IP6_MTRIE_MAX_LEVELS; level++) {
+        bi = &ip6_mtrie_layout[level];
+        bi->bi_bits = level ? 8 : 16;
+        pfx_len += bi->bi_bits;
+        bi->bi_pfx_len = pfx_len;
+        bi->bi_size = 1 << bi->bi_bits;
+        bi->bi_mask = bi->bi_size - 1;
+    }
+
+    return;
+}
+
+void
+mtrie6_algo_deinit(struct vr_rtable *rtable, struct rtable_fspec *fs)
+{
+    unsigned int i;
+
+    if (!vn6_rtable)
+        return;
+
+    vr_inet6_route_lookup = NULL;
+    vn6_rtable = NULL;
+    for (i = 0; i < fs->rtb_max_vrfs; i++)
+        mtrie_free_vrf(rtable, i);
+
+    vr_free(rtable->algo_data);
+    rtable->algo_data = NULL;
+
+    return;
+}
+
+int
+mtrie6_algo_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
+{
+    unsigned int table_memory;
+
+    table_memory = sizeof(void *) * fs->rtb_max_vrfs;
+    rtable->algo_data = vr_zalloc(table_memory);
+    if (!rtable->algo_data)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, table_memory);
+
+    rtable->algo_max_vrfs = fs->rtb_max_vrfs;
+    mtrie6_layout_init();
+
+    rtable->algo_add = mtrie6_add;
+    rtable->algo_del = mtrie6_delete;
+    rtable->algo_lookup = mtrie6_lookup;
+    rtable->algo_get = mtrie6_get;
+    rtable->algo_dump = mtrie6_dump;
+    rtable->algo_stats_get = mtrie6_stats_get;
+    rtable->algo_stats_dump = mtrie_stats_dump;
+
+    vr_inet6_route_lookup = mtrie6_lookup;
+    vn6_rtable = (struct ip4_mtrie **)rtable->algo_data;
+
+    return 0;
+}
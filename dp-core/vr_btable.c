@@ -72,64 +72,72 @@ vr_btable_free(struct vr_btable *table)
         return;
 
     for (i = 0; i < VR_MAX_BTABLE_ENTRIES; i++) {
-        if (table->vb_mem[i])
-            vr_page_free(table->vb_mem[i], table->vb_table_info[i].vb_mem_size);
+        if (!table->vb_mem[i])
+            continue;
+
+        if (table->vb_flags & VR_BTABLE_FLAG_HUGE)
+            vr_huge_page_free(table->vb_mem[i],
+                    table->vb_table_info[i].vb_mem_size);
+        else
+            vr_page_free(table->vb_mem[i],
+                    table->vb_table_info[i].vb_mem_size);
     }
 
     vr_free(table);
     return;
 }
 
-struct vr_btable *
-vr_btable_alloc(unsigned int num_entries, unsigned int entry_size)
+/*
+ * carves the table in partitions of (1 << shift) bytes, and a last one
+ * for what remains
+ */
+static struct vr_btable *
+__vr_btable_alloc(unsigned int num_entries, unsigned int entry_size,
+        unsigned int shift, unsigned short flags)
 {
-    unsigned int i = 0, num_parts, remainder;
+    unsigned int i = 0, num_parts, remainder, part_size;
     uint64_t total_mem;
     struct vr_btable *table;
     unsigned int offset = 0;
 
-    total_mem = num_entries * entry_size;
-    /* need more testing. that's all */
-    if (total_mem > VR_KNOWN_BIG_MEM_LIMIT)
-        return NULL;
-
-    table = vr_zalloc(sizeof(*table));
-    if (!table)
-        return NULL;
-
-    num_parts = total_mem / VR_SINGLE_ALLOC_LIMIT;
-    remainder = total_mem % VR_SINGLE_ALLOC_LIMIT;
+    part_size = 1U << shift;
+    total_mem = (uint64_t)num_entries * entry_size;
+    num_parts = total_mem >> shift;
+    remainder = total_mem & (part_size - 1);
     if (num_parts + !!remainder > VR_MAX_BTABLE_ENTRIES)
         return NULL;
 
     if (num_parts) {
         /*
-         * the entry size has to be a factor of VR_SINGLE_ALLOC limit.
+         * the entry size has to be a factor of the partition size.
          * otherwise, we might access memory beyond the allocated chunk
          * while accessing the last entry
          */
-        if (VR_SINGLE_ALLOC_LIMIT % entry_size)
+        if (part_size % entry_size)
             return NULL;
     }
 
-    if (num_parts) {
-        for (i = 0; i < num_parts; i++) {
-            table->vb_mem[i] = vr_page_alloc(VR_SINGLE_ALLOC_LIMIT);
-            if (!table->vb_mem[i])
-                goto exit_alloc;
-            table->vb_table_info[i].vb_mem_size = VR_SINGLE_ALLOC_LIMIT;
-            table->vb_table_info[i].vb_offset = offset;
-            offset += table->vb_table_info[i].vb_mem_size;
-        }
-        table->vb_partitions = num_parts;
-    }
+    table = vr_zalloc(sizeof(*table));
+    if (!table)
+        return NULL;
 
-    if (remainder) {
-        table->vb_mem[i] = vr_page_alloc(remainder);
+    table->vb_shift = shift;
+    table->vb_flags = flags;
+
+    for (i = 0; i < num_parts + !!remainder; i++) {
+        if (i == num_parts)
+            part_size = remainder;
+
+        if (flags & VR_BTABLE_FLAG_HUGE)
+            table->vb_mem[i] = vr_huge_page_alloc(part_size);
+        else
+            table->vb_mem[i] = vr_page_alloc(part_size);
         if (!table->vb_mem[i])
             goto exit_alloc;
-        table->vb_table_info[i].vb_mem_size = remainder;
+
+        table->vb_table_info[i].vb_mem_size = part_size;
         table->vb_table_info[i].vb_offset = offset;
+        offset += part_size;
         table->vb_partitions++;
     }
 
@@ -142,3 +150,51 @@ exit_alloc:
     vr_btable_free(table);
     return NULL;
 }
+
+struct vr_btable *
+vr_btable_alloc(unsigned int num_entries, unsigned int entry_size)
+{
+    uint64_t total_mem;
+
+    total_mem = (uint64_t)num_entries * entry_size;
+    /* need more testing. that's all */
+    if (total_mem > VR_KNOWN_BIG_MEM_LIMIT)
+        return NULL;
+
+    return __vr_btable_alloc(num_entries, entry_size,
+            VR_SINGLE_ALLOC_SHIFT, 0);
+}
+
+/*
+ * a table backed by huge pages, for tables that are looked up per packet.
+ * the partitions are as big as the host can back with huge pages - the
+ * table is tried in one piece first, and then in halves of that till the
+ * partitions are a 2M page. if the host can not back even that, or has no
+ * huge pages to give, the table is allocated as any other.
+ */
+struct vr_btable *
+vr_btable_alloc_huge(unsigned int num_entries, unsigned int entry_size)
+{
+    unsigned int shift = VR_HUGE_PAGE_SHIFT;
+    uint64_t total_mem;
+    struct vr_btable *table;
+
+    total_mem = (uint64_t)num_entries * entry_size;
+    if (total_mem > VR_KNOWN_BIG_MEM_LIMIT)
+        return NULL;
+
+    if (!vr_huge_page_alloc)
+        return vr_btable_alloc(num_entries, entry_size);
+
+    while ((shift < VR_HUGE_ALLOC_SHIFT) && ((1ULL << shift) < total_mem))
+        shift++;
+
+    for (; shift >= VR_HUGE_PAGE_SHIFT; shift--) {
+        table = __vr_btable_alloc(num_entries, entry_size, shift,
+                VR_BTABLE_FLAG_HUGE);
+        if (table)
+            return table;
+    }
+
+    return vr_btable_alloc(num_entries, entry_size);
+}
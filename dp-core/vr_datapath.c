@@ -228,8 +228,19 @@ vr_l3_input(unsigned short vrf, struct vr_packet *pkt,
             }
          }
          return vr_flow_inet_input(router, vrf, pkt, eth_proto, fmd);
-    } else if (eth_proto == VR_ETH_PROTO_ARP)
+    } else if (eth_proto == VR_ETH_PROTO_ARP) {
         return vr_arp_input(router, vrf, pkt);
+    } else if (eth_proto == VR_ETH_PROTO_IP6 && router->vr_flow6_table &&
+            (vif->vif_flags & VIF_FLAG_POLICY_ENABLED) &&
+            (vif->vif_flags & VIF_FLAG_L2_ENABLED)) {
+        /* inet6 is bridged, after the flow says so */
+        if (!pkt_push(pkt, pull_len)) {
+            vif_drop_pkt(vif, pkt, 1);
+            return 0;
+        }
+
+        return vr_flow_inet6_input(router, vrf, pkt, eth_proto, fmd);
+    }
 
     /* rest of the stuff is for slow path and we should be ok doing this */
     if (well_known_mac(dmac))
@@ -9,6 +9,7 @@
 #include "vr_mcast.h"
 #include "vr_btable.h"
 #include "vr_fragment.h"
+#include "vr_bridge.h"
 
 #define VR_NUM_FLOW_TABLES          1
 #define VR_DEF_FLOW_ENTRIES         (512 * 1024)
@@ -20,15 +21,58 @@
 #define VR_OFLOW_TABLE_SIZE         (vr_oflow_entries *\
         sizeof(struct vr_flow_entry))
 
+#define VR_DEF_FLOW6_ENTRIES        (64 * 1024)
+#define VR_DEF_OFLOW6_ENTRIES       (4 * 1024)
+
 #define VR_FLOW_ENTRIES_PER_BUCKET  4U
 
-#define VR_MAX_FLOW_QUEUE_ENTRIES   3U
+/*
+ * every slot of a flow bucket has a 16 bit tag (derived from the upper
+ * bits of the hash) in the tag table. all the tags of a bucket are packed
+ * in one 64 bit word, eight buckets to a cache line, so that a lookup can
+ * compare the tag against all the slots at once and touch a flow entry
+ * only when the tag matches. a tag of zero means that the slot is empty.
+ */
+#define VR_FLOW_TAG_BITS            16
+#define VR_FLOW_TAG_MASK            0xFFFFULL
+#define VR_FLOW_TAG_LANE_LSB        0x0001000100010001ULL
+#define VR_FLOW_TAG_LANE_LOW_BITS   0x7FFF7FFF7FFF7FFFULL
+
+/*
+ * packets that arrive while a flow is in hold are parked in a ring of
+ * vr_flow_queue_entries slots, that is allocated when the first packet
+ * is held and released, after a grace period, once the ring is flushed.
+ * a slot is claimed by incrementing vfq_entries, and hence an enqueue
+ * neither walks a list nor allocates memory. the flusher closes the ring
+ * by setting vfq_entries to VR_FLOW_QUEUE_CLOSED, and any enqueue that
+ * comes after that will not find a free slot. an enqueuer that claimed a
+ * slot, but had not put its packet in it when the flusher got there, finds
+ * the slot taken by VR_FLOW_QUEUE_SLOT_TAKEN and acts on the packet itself
+ */
+#define VR_DEF_FLOW_QUEUE_ENTRIES   3U
+#define VR_MAX_FLOW_QUEUE_ENTRIES   64U
+#define VR_FLOW_QUEUE_CLOSED        0x80000000U
+#define VR_FLOW_QUEUE_SLOT_TAKEN    ((struct vr_packet *)0x1UL)
+#define VR_FLOW_QUEUE_SIZE          (sizeof(struct vr_flow_queue) + \
+        vr_flow_queue_entries * sizeof(struct vr_packet_node))
+
+struct vr_flow_queue {
+    unsigned int vfq_entries;
+    struct vr_packet_node vfq_pnodes[0];
+};
+
+
+#define VR_FLOW_MAX_BATCH           1024U
 
 #define VR_MAX_FLOW_TABLE_HOLD_COUNT \
                                     4096
 
 unsigned int vr_flow_entries = VR_DEF_FLOW_ENTRIES;
 unsigned int vr_oflow_entries = VR_DEF_OFLOW_ENTRIES;
+unsigned int vr_flow_queue_entries = VR_DEF_FLOW_QUEUE_ENTRIES;
+/* 0 leaves inet6 packets out of flow processing */
+unsigned int vr_flow6_entries = VR_DEF_FLOW6_ENTRIES;
+unsigned int vr_oflow6_entries = VR_DEF_OFLOW6_ENTRIES;
 
 #ifdef __KERNEL__
 extern unsigned short vr_flow_major;
@@ -38,9 +82,21 @@ extern int vr_ip_input(struct vrouter *, unsigned short,
         struct vr_packet *, struct vr_forwarding_md *);
 extern void vr_ip_update_csum(struct vr_packet *, unsigned int,
         unsigned int);
-
-static void vr_flush_entry(struct vrouter *, struct vr_flow_entry *,
-        struct vr_flow_md *, struct vr_forwarding_md *);
+extern void vr_ip6_update_csum(struct vr_packet *, struct vr_ip6 *,
+        unsigned int, unsigned int);
+extern struct vr_nexthop *(*vr_inet_route_lookup)(unsigned int,
+        struct vr_route_req *, struct vr_packet *);
+extern unsigned int (*vr_inet_route_gen)(unsigned int);
+
+static void vr_flush_entry(struct vrouter *, struct vr_flow_table *,
+        struct vr_flow_entry *, struct vr_flow_md *,
+        struct vr_forwarding_md *);
+static void vr_flow_queue_flush(struct vrouter *, struct vr_flow_table *,
+        struct vr_flow_entry *, unsigned int, struct vr_flow_queue *,
+        struct vr_forwarding_md *);
+static void vr_flow_aged_log_reset(struct vrouter *, unsigned short);
+static int vr_flow_aged_get(struct vrouter *, vr_flow_req *);
+static void vr_flow_aged_put(vr_flow_req *);
 
 static void
 vr_flow_reset_mirror(struct vrouter *router, struct vr_flow_entry *fe, 
@@ -72,20 +128,215 @@ vr_init_flow_entry(struct vr_flow_entry *fe)
 }
 
 
+static inline uint16_t
+vr_flow_hash_tag(unsigned int hash)
+{
+    uint16_t tag = hash >> VR_FLOW_TAG_BITS;
+
+    /* zero is reserved for an empty slot */
+    return tag ? tag : 1;
+}
+
+static inline bool
+vr_flow_table_inet6(struct vr_flow_table *ft)
+{
+    return ft->vft_family == AF_INET6;
+}
+
+static inline struct vr_flow6_entry *
+vr_flow6_entry(struct vr_flow_entry *fe)
+{
+    return (struct vr_flow6_entry *)fe;
+}
+
+/*
+ * the hash is over a length that is constant for either family, so that
+ * hashing an inet key costs no more for there being inet6 keys
+ */
+static inline unsigned int
+vr_flow_key_hash(struct vr_flow_table *ft, struct vr_flow_key *key,
+        unsigned int seed)
+{
+    if (vr_flow_table_inet6(ft))
+        return vr_hash(key, sizeof(struct vr_flow6_key), seed);
+
+    return vr_hash(key, sizeof(*key), seed);
+}
+
+static inline bool
+vr_flow_key_match(struct vr_flow_table *ft, struct vr_flow_entry *fe,
+        struct vr_flow_key *key)
+{
+    struct vr_flow6_key *key6;
+
+    if (memcmp(&fe->fe_key, key, sizeof(*key)))
+        return false;
+
+    if (!vr_flow_table_inet6(ft))
+        return true;
+
+    /* the source and the destination, in one go */
+    key6 = (struct vr_flow6_key *)key;
+    return !memcmp(vr_flow6_entry(fe)->fe6_src_ip, key6->key6_src_ip,
+            2 * VR_IP6_ADDRESS_LEN);
+}
+
+static void
+vr_flow_key_get(struct vr_flow_table *ft, struct vr_flow_entry *fe,
+        struct vr_flow6_key *key)
+{
+    memcpy(&key->key6_key, &fe->fe_key, sizeof(fe->fe_key));
+    if (vr_flow_table_inet6(ft))
+        memcpy(key->key6_src_ip, vr_flow6_entry(fe)->fe6_src_ip,
+                2 * VR_IP6_ADDRESS_LEN);
+
+    return;
+}
+
+static void
+vr_flow_key_set(struct vr_flow_table *ft, struct vr_flow_entry *fe,
+        struct vr_flow_key *key)
+{
+    memcpy(&fe->fe_key, key, sizeof(*key));
+    if (vr_flow_table_inet6(ft))
+        memcpy(vr_flow6_entry(fe)->fe6_src_ip,
+                ((struct vr_flow6_key *)key)->key6_src_ip,
+                2 * VR_IP6_ADDRESS_LEN);
+
+    return;
+}
+
 static void
-vr_reset_flow_entry(struct vrouter *router, struct vr_flow_entry *fe,
-        unsigned int index)
+vr_flow_key_reset(struct vr_flow_table *ft, struct vr_flow_entry *fe)
 {
-    memset(&fe->fe_stats, 0, sizeof(fe->fe_stats));
-    memset(&fe->fe_hold_list, 0, sizeof(fe->fe_hold_list));;
     memset(&fe->fe_key, 0, sizeof(fe->fe_key));
+    if (vr_flow_table_inet6(ft))
+        memset(vr_flow6_entry(fe)->fe6_src_ip, 0, 2 * VR_IP6_ADDRESS_LEN);
+
+    return;
+}
+
+/* bucket of the regular flow table */
+static inline unsigned int
+vr_flow_bucket(struct vr_flow_table *ft, unsigned int hash)
+{
+    return vr_geometry_reduce(&ft->vft_buckets, hash);
+}
+
+static inline uint64_t *
+vr_flow_bucket_tags_get(struct vr_flow_table *ft, unsigned int bucket)
+{
+    return (uint64_t *)vr_btable_get(ft->vft_tags, bucket);
+}
+
+static void
+vr_flow_tag_set(struct vr_flow_table *ft, unsigned int index, uint16_t tag)
+{
+    unsigned int shift;
+    uint64_t old_tags, new_tags, *tags;
+
+    if (index >= ft->vft_entries + ft->vft_oentries)
+        return;
+
+    tags = vr_flow_bucket_tags_get(ft, index / VR_FLOW_ENTRIES_PER_BUCKET);
+    if (!tags)
+        return;
+
+    shift = (index % VR_FLOW_ENTRIES_PER_BUCKET) * VR_FLOW_TAG_BITS;
+    /* other cpus can be setting tags of other slots in the same bucket */
+    do {
+        old_tags = *tags;
+        new_tags = (old_tags & ~(VR_FLOW_TAG_MASK << shift)) |
+            ((uint64_t)tag << shift);
+    } while (!__sync_bool_compare_and_swap(tags, old_tags, new_tags));
+
+    return;
+}
+
+/*
+ * returns a word with the most significant bit of a lane set for every
+ * lane of 'tags' that is equal to 'tag'. all four lanes are compared in
+ * one go (SWAR), without any carry crossing from one lane to the next
+ */
+static inline uint64_t
+vr_flow_tag_match(uint64_t tags, uint16_t tag)
+{
+    uint64_t x = tags ^ (VR_FLOW_TAG_LANE_LSB * tag);
+
+    return ~(((x & VR_FLOW_TAG_LANE_LOW_BITS) + VR_FLOW_TAG_LANE_LOW_BITS) |
+            x | VR_FLOW_TAG_LANE_LOW_BITS);
+}
+
+/*
+ * the route kept in an entry is changed with fe_fwd_gen held at
+ * VR_FLOW_FWD_GEN_BUSY. the datapath does not wait for it, and leaves the
+ * route alone if it cannot have it right away
+ */
+static inline bool
+vr_flow_fwd_lock(struct vr_flow_entry *fe, uint32_t *old)
+{
+    *old = *(volatile uint32_t *)&fe->fe_fwd_gen;
+    if (*old == VR_FLOW_FWD_GEN_BUSY)
+        return false;
+
+    return __sync_bool_compare_and_swap(&fe->fe_fwd_gen, *old,
+            VR_FLOW_FWD_GEN_BUSY);
+}
+
+/* forget the route kept in the entry, for a change to the flow */
+static void
+vr_flow_fwd_invalidate(struct vr_flow_entry *fe)
+{
+    uint32_t old;
+
+    while (!vr_flow_fwd_lock(fe, &old))
+        ;
+
+    fe->fe_fwd_nh_index = NH_DISCARD_ID;
+    __sync_synchronize();
+    fe->fe_fwd_gen = VR_FLOW_FWD_GEN_NONE;
+
+    return;
+}
+
+/* for a copy of an entry, that no one else sees yet */
+static inline void
+vr_flow_fwd_reset(struct vr_flow_entry *fe)
+{
+    fe->fe_fwd_nh_index = NH_DISCARD_ID;
+    fe->fe_fwd_gen = VR_FLOW_FWD_GEN_NONE;
+
+    return;
+}
+
+static void
+vr_reset_flow_entry(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, unsigned int index)
+{
+    struct vr_flow_queue *vfq;
+
+    /*
+     * no ring is installed once the entry is out of hold, and the one that
+     * is there already goes with the packets in it
+     */
+    fe->fe_action = VR_FLOW_ACTION_DROP;
+    __sync_synchronize();
+    vfq = (struct vr_flow_queue *)__sync_lock_test_and_set(
+            &fe->fe_hold_list.node_p, NULL);
+    if (vfq)
+        vr_flow_queue_flush(router, ft, fe, index, vfq, NULL);
+
+    vr_flow_tag_set(ft, index, 0);
+
+    memset(&fe->fe_stats, 0, sizeof(fe->fe_stats));
+    vr_flow_key_reset(ft, fe);
 
     vr_flow_reset_mirror(router, fe, index);
     fe->fe_ecmp_nh_index = -1;
     fe->fe_src_nh_index = NH_DISCARD_ID;
     fe->fe_rflow = -1;
-    fe->fe_action = VR_FLOW_ACTION_DROP;
     fe->fe_flags = 0;
+    vr_flow_fwd_invalidate(fe);
 
     return;
 }
@@ -98,70 +349,89 @@ vr_set_flow_active(struct vr_flow_entry *fe)
             fe->fe_flags & ~VR_FLOW_FLAG_ACTIVE, VR_FLOW_FLAG_ACTIVE);
 }
 
-static inline struct vr_flow_entry *
-vr_flow_table_entry_get(struct vrouter *router, unsigned int i)
-{
-    return (struct vr_flow_entry *)vr_btable_get(router->vr_flow_table, i);
-}
-
-static inline struct vr_flow_entry *
-vr_oflow_table_entry_get(struct vrouter *router, unsigned int i)
+unsigned int
+vr_flow_table_size(struct vrouter *router)
 {
-    return (struct vr_flow_entry *)vr_btable_get(router->vr_oflow_table, i);
+    return vr_btable_size(router->vr_flow_table->vft_table);
 }
 
 unsigned int
-vr_flow_table_size(struct vrouter *router)
+vr_oflow_table_size(struct vrouter *router)
 {
-    return vr_btable_size(router->vr_flow_table);
+    return vr_btable_size(router->vr_flow_table->vft_otable);
 }
 
+/* the inet6 flow table and its overflow table, together */
 unsigned int
-vr_oflow_table_size(struct vrouter *router)
+vr_flow6_table_size(struct vrouter *router)
 {
-    return vr_btable_size(router->vr_oflow_table);
+    struct vr_flow_table *ft = router->vr_flow6_table;
+
+    if (!ft)
+        return 0;
+
+    return vr_btable_size(ft->vft_table) + vr_btable_size(ft->vft_otable);
 }
 
 /*
  * this is used by the mmap code. mmap sees the whole flow table
- * (including the overflow table) as one large table. so, given
- * an offset into that large memory, we should return the correct
+ * (including the overflow table) as one large table, followed by the
+ * inet6 flow table (including its overflow table), if there is one. so,
+ * given an offset into that large memory, we should return the correct
  * virtual address
  */
 void *
 vr_flow_get_va(struct vrouter *router, uint64_t offset)
 {
-    struct vr_btable *table = router->vr_flow_table;
-    unsigned int size = vr_flow_table_size(router);
+    struct vr_flow_table *ft = router->vr_flow_table;
+    struct vr_btable *table = ft->vft_table;
+    unsigned int size = vr_btable_size(table);
 
-    if (offset >= vr_flow_table_size(router)) {
-        table = router->vr_oflow_table;
+    if (offset >= size) {
+        table = ft->vft_otable;
         offset -= size;
+        size = vr_btable_size(table);
+        if ((offset >= size) && router->vr_flow6_table) {
+            ft = router->vr_flow6_table;
+            table = ft->vft_table;
+            offset -= size;
+            size = vr_btable_size(table);
+            if (offset >= size) {
+                table = ft->vft_otable;
+                offset -= size;
+            }
+        }
     }
 
     return vr_btable_get_address(table, offset);
 }
 
 static struct vr_flow_entry *
-vr_get_flow_entry(struct vrouter *router, int index)
+vr_flow_table_entry(struct vr_flow_table *ft, int index)
 {
     struct vr_btable *table;
 
     if (index < 0)
         return NULL;
 
-    if ((unsigned int)index < vr_flow_entries)
-        table = router->vr_flow_table;
+    if ((unsigned int)index < ft->vft_entries)
+        table = ft->vft_table;
     else {
-        table = router->vr_oflow_table;
-        index -= vr_flow_entries;
-        if ((unsigned int)index >= vr_oflow_entries)
+        table = ft->vft_otable;
+        index -= ft->vft_entries;
+        if ((unsigned int)index >= ft->vft_oentries)
             return NULL;
     }
 
     return (struct vr_flow_entry *)vr_btable_get(table, index);
 }
 
+static struct vr_flow_entry *
+vr_get_flow_entry(struct vrouter *router, int index)
+{
+    return vr_flow_table_entry(router->vr_flow_table, index);
+}
+
 static inline void
 vr_get_flow_key(struct vr_flow_key *key, unsigned short vrf, struct vr_ip *ip,
         unsigned short sport, unsigned short dport)
@@ -206,162 +476,568 @@ vr_get_flow_key(struct vr_flow_key *key, unsigned short vrf, struct vr_ip *ip,
     return;
 }
 
+/*
+ * the overflow table is also organized as buckets, and a key can be in
+ * one of two buckets of the overflow table (chosen by two different
+ * hashes). a lookup that misses the regular flow table hence looks at two
+ * more buckets at the most, and not the whole of the overflow table
+ */
+static inline void
+vr_flow_oflow_buckets(struct vr_flow_table *ft, struct vr_flow_key *key,
+        unsigned int hash, unsigned int *buckets)
+{
+    unsigned int first_bucket;
+    struct vr_geometry *geo = &ft->vft_obuckets;
+
+    first_bucket = vr_geometry_size(&ft->vft_buckets);
+
+    buckets[0] = vr_geometry_reduce(geo, hash);
+    buckets[1] = vr_geometry_reduce(geo, vr_flow_key_hash(ft, key, hash));
+    if (buckets[1] == buckets[0])
+        buckets[1] = vr_geometry_next(geo, buckets[0]);
+
+    buckets[0] += first_bucket;
+    buckets[1] += first_bucket;
+
+    return;
+}
+
 static struct vr_flow_entry *
-vr_find_free_entry(struct vrouter *router, struct vr_flow_key *key,
+vr_flow_bucket_get_free(struct vr_flow_table *ft, unsigned int bucket,
         unsigned int *fe_index)
 {
-    unsigned int i, index, hash;
-    struct vr_flow_entry *tmp_fe, *fe = NULL;
+    unsigned int i, index;
+    struct vr_flow_entry *fe;
 
-    *fe_index = 0;
+    index = bucket * VR_FLOW_ENTRIES_PER_BUCKET;
+    for (i = 0; i < VR_FLOW_ENTRIES_PER_BUCKET; i++, index++) {
+        fe = vr_flow_table_entry(ft, index);
+        if (fe && !(fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
+            if (vr_set_flow_active(fe)) {
+                vr_init_flow_entry(fe);
+                *fe_index = index;
+                return fe;
+            }
+        }
+    }
 
-    hash = vr_hash(key, sizeof(*key), 0);
+    return NULL;
+}
 
-    index = (hash % vr_flow_entries) & ~(VR_FLOW_ENTRIES_PER_BUCKET - 1);
-    for (i = 0; i < VR_FLOW_ENTRIES_PER_BUCKET; i++) {
-        tmp_fe = vr_flow_table_entry_get(router, index);
-        if (tmp_fe && !(tmp_fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
-            if (vr_set_flow_active(tmp_fe)) {
-                vr_init_flow_entry(tmp_fe);
-                fe = tmp_fe;
-                break;
-            }
+/*
+ * entries that have packets queued, or that have state tied to their
+ * index (mirror meta data), stay where they are
+ */
+static inline bool
+vr_flow_can_relocate(struct vr_flow_entry *fe)
+{
+    if (!(fe->fe_flags & VR_FLOW_FLAG_ACTIVE))
+        return false;
+
+    if (fe->fe_flags & (VR_FLOW_FLAG_MIRROR | VR_FLOW_FLAG_RELOCATE))
+        return false;
+
+    if (fe->fe_action == VR_FLOW_ACTION_HOLD || fe->fe_hold_list.node_p)
+        return false;
+
+    return true;
+}
+
+static void
+vr_flow_move_entry(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, unsigned int index,
+        struct vr_flow_entry *nfe, unsigned int nindex, uint16_t tag)
+{
+    struct vr_flow_entry *rfe;
+    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+
+    memcpy(nfe, fe, ft->vft_entry_size);
+    nfe->fe_flags &= ~VR_FLOW_FLAG_RELOCATE;
+    vr_flow_fwd_reset(nfe);
+    vr_flow_tag_set(ft, nindex, tag);
+
+    /* the reverse flow should now point to the new location */
+    if (nfe->fe_rflow >= 0) {
+        rfe = vr_flow_table_entry(ft, nfe->fe_rflow);
+        if (rfe && rfe->fe_rflow == (int)index)
+            rfe->fe_rflow = nindex;
+    }
+
+    vr_flow_tag_set(ft, index, 0);
+    memset(&fe->fe_stats, 0, sizeof(fe->fe_stats));
+    vr_flow_key_reset(ft, fe);
+    fe->fe_rflow = -1;
+    fe->fe_action = VR_FLOW_ACTION_DROP;
+    fe->fe_flags = 0;
+
+    (void)__sync_add_and_fetch(&infop->vfti_oflow_relocations, 1);
+
+    return;
+}
+
+/*
+ * make space in an overflow bucket by moving one of its entries to the
+ * other bucket the entry can live in. only one level of displacement is
+ * attempted, so that the cost of an insert stays bounded.
+ */
+static bool
+vr_flow_oflow_make_space(struct vrouter *router, struct vr_flow_table *ft,
+        unsigned int bucket)
+{
+    unsigned int i, index, nindex, hash, alt_bucket;
+    unsigned int buckets[2];
+    unsigned short flags;
+    struct vr_flow6_key key;
+    struct vr_flow_entry *fe, *nfe;
+
+    index = bucket * VR_FLOW_ENTRIES_PER_BUCKET;
+    for (i = 0; i < VR_FLOW_ENTRIES_PER_BUCKET; i++, index++) {
+        fe = vr_flow_table_entry(ft, index);
+        if (!fe || !vr_flow_can_relocate(fe))
+            continue;
+
+        flags = fe->fe_flags;
+        vr_flow_key_get(ft, fe, &key);
+        hash = vr_flow_key_hash(ft, &key.key6_key, 0);
+        vr_flow_oflow_buckets(ft, &key.key6_key, hash, buckets);
+        alt_bucket = (buckets[0] == bucket) ? buckets[1] : buckets[0];
+        if (alt_bucket == bucket)
+            continue;
+
+        /* so that no other cpu moves the same entry */
+        if (!__sync_bool_compare_and_swap(&fe->fe_flags, flags,
+                    flags | VR_FLOW_FLAG_RELOCATE))
+            continue;
+
+        nfe = vr_flow_bucket_get_free(ft, alt_bucket, &nindex);
+        if (!nfe) {
+            (void)__sync_and_and_fetch(&fe->fe_flags,
+                    ~VR_FLOW_FLAG_RELOCATE);
+            continue;
         }
-        index++;
+
+        vr_flow_move_entry(router, ft, fe, index, nfe, nindex,
+                vr_flow_hash_tag(hash));
+        return true;
     }
-        
+
+    return false;
+}
+
+/*
+ * claims a free slot for the key. the slot is active, but is found by
+ * lookups only once its tag is set
+ */
+static struct vr_flow_entry *
+vr_flow_table_get_free(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_key *key, unsigned int hash, unsigned int *fe_index)
+{
+    unsigned int i;
+    unsigned int buckets[2];
+    struct vr_flow_entry *fe;
+
+    fe = vr_flow_bucket_get_free(ft, vr_flow_bucket(ft, hash), fe_index);
     if (!fe) {
-        index = hash % vr_oflow_entries;
-        for (i = 0; i < vr_oflow_entries; i++) {
-            tmp_fe = vr_oflow_table_entry_get(router, index);
-            if (tmp_fe && !(tmp_fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
-                if (vr_set_flow_active(tmp_fe)) {
-                    vr_init_flow_entry(tmp_fe);
-                    fe = tmp_fe;
-                    break;
-                }
-            }
-            index = (index + 1) % vr_oflow_entries;
-        }
+        vr_flow_oflow_buckets(ft, key, hash, buckets);
+        for (i = 0; i < 2 && !fe; i++)
+            fe = vr_flow_bucket_get_free(ft, buckets[i], fe_index);
 
-        if (fe)
-            *fe_index += vr_flow_entries;
+        for (i = 0; i < 2 && !fe; i++) {
+            if (vr_flow_oflow_make_space(router, ft, buckets[i]))
+                fe = vr_flow_bucket_get_free(ft, buckets[i], fe_index);
+        }
     }
 
+    return fe;
+}
+
+static struct vr_flow_entry *
+vr_find_free_entry(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_key *key, unsigned int *fe_index)
+{
+    unsigned int hash;
+    struct vr_flow_entry *fe;
+
+    *fe_index = 0;
+
+    hash = vr_flow_key_hash(ft, key, 0);
+    fe = vr_flow_table_get_free(router, ft, key, hash, fe_index);
     if (fe) {
-        *fe_index += index;
-        memcpy(&fe->fe_key, key, sizeof(*key));
+        vr_flow_key_set(ft, fe, key);
+        fe->fe_last_seen = router->vr_flow_table_info->vfti_aging_time;
+        vr_flow_tag_set(ft, *fe_index, vr_flow_hash_tag(hash));
     }
 
     return fe;
 }
 
+/*
+ * only the slots whose tag matches the tag of the key are compared against
+ * the key, and hence a miss costs just the cache line of the tags. entries
+ * that are being moved (and, in a table that is being migrated from,
+ * entries that have been moved) match too.
+ */
 static inline struct vr_flow_entry *
-vr_flow_table_lookup(struct vr_flow_key *key, struct vr_btable *table,
-                unsigned int table_size, unsigned int bucket_size,
-                unsigned int hash, unsigned int *fe_index)
+vr_flow_bucket_lookup(struct vr_flow_table *ft, struct vr_flow_key *key,
+        unsigned int bucket, uint16_t tag, unsigned int *fe_index)
 {
-    unsigned int i;
+    unsigned int index;
+    uint64_t *tags, match;
     struct vr_flow_entry *flow_e;
 
-    hash %= table_size;
-
-    if (!bucket_size) {
-        bucket_size = table_size;
-    } else {
-        hash &= ~(bucket_size - 1);
-    }
+    tags = vr_flow_bucket_tags_get(ft, bucket);
+    if (!tags)
+        return NULL;
 
-    for (i = 0; i < bucket_size; i++) {
-        flow_e = (struct vr_flow_entry *)vr_btable_get(table,
-                (hash + i) % table_size);
-        if (flow_e && flow_e->fe_flags & VR_FLOW_FLAG_ACTIVE) {
-            if (!memcmp(&flow_e->fe_key, key, sizeof(*key))) {
-                *fe_index = (hash + i) % table_size;
+    match = vr_flow_tag_match(*tags, tag);
+    while (match) {
+        index = bucket * VR_FLOW_ENTRIES_PER_BUCKET +
+            (__builtin_ctzll(match) / VR_FLOW_TAG_BITS);
+        flow_e = vr_flow_table_entry(ft, index);
+        if (flow_e && (flow_e->fe_flags &
+                    (VR_FLOW_FLAG_ACTIVE | VR_FLOW_FLAG_RELOCATE))) {
+            if (vr_flow_key_match(ft, flow_e, key)) {
+                *fe_index = index;
                 return flow_e;
             }
         }
+        match &= match - 1;
     }
 
     return NULL;
 }
 
-
-struct vr_flow_entry *
-vr_find_flow(struct vrouter *router, struct vr_flow_key *key,
-        unsigned int *fe_index)
+static struct vr_flow_entry *
+vr_flow_table_lookup(struct vr_flow_table *ft, struct vr_flow_key *key,
+        unsigned int hash, unsigned int *fe_index)
 {
-    unsigned int hash;
+    unsigned int i;
+    unsigned int buckets[2];
+    uint16_t tag;
     struct vr_flow_entry *flow_e;
 
-    hash = vr_hash(key, sizeof(*key), 0);
+    tag = vr_flow_hash_tag(hash);
 
     /* first look in the regular flow table */
-    flow_e = vr_flow_table_lookup(key, router->vr_flow_table, vr_flow_entries,
-                    VR_FLOW_ENTRIES_PER_BUCKET, hash, fe_index);
+    flow_e = vr_flow_bucket_lookup(ft, key, vr_flow_bucket(ft, hash), tag,
+            fe_index);
     /* if not in the regular flow table, lookup in the overflow flow table */
     if (!flow_e) {
-        flow_e = vr_flow_table_lookup(key, router->vr_oflow_table, vr_oflow_entries,
-                        0, hash, fe_index);
-        *fe_index += vr_flow_entries;
+        vr_flow_oflow_buckets(ft, key, hash, buckets);
+        for (i = 0; i < 2 && !flow_e; i++)
+            flow_e = vr_flow_bucket_lookup(ft, key, buckets[i], tag,
+                    fe_index);
     }
 
     return flow_e;
 }
 
+/*
+ * resizing the flow table. a resize publishes a new table, and entries
+ * are then migrated from the old table to the new one. from the time the
+ * new table is published, everything - inserts, the indices handed out
+ * to agent and to the rest of the datapath, and mmap - is in the new
+ * table. a lookup that misses the new table looks in the old table, and
+ * migrates the entry that it finds there, so that the index it returns
+ * is still an index in the new table. the rest of the old table is
+ * migrated from a work item.
+ *
+ * an entry is claimed for migration by setting VR_FLOW_FLAG_RELOCATE, and
+ * once migrated, is left with only that flag set, its key (so that
+ * lookups still find it), and its new index in the map of the migration.
+ * the reverse flow of an entry is migrated along with it, so that
+ * fe_rflow of an entry in the new table is an index in the new table.
+ */
+#define VR_FLOW_MIGRATE_ENTRIES     4096
+#define VR_FLOW_INDEX_IN_TRANSIT    ((unsigned int)-1)
+
+struct vr_flow_migration {
+    struct vr_flow_table *vfm_table;
+    /* new index of every migrated entry, by its old index */
+    struct vr_btable *vfm_map;
+    unsigned int vfm_next;
+};
+
+static inline unsigned short
+vr_flow_flags(struct vr_flow_entry *fe)
+{
+    return *(volatile unsigned short *)&fe->fe_flags;
+}
+
 static inline bool
-vr_flow_queue_is_empty(struct vrouter *router, struct vr_flow_entry *fe)
+vr_flow_migrated(struct vr_flow_entry *ofe)
 {
-    if (fe->fe_hold_list.node_p)
-        return false;
-    return true;
+    return vr_flow_flags(ofe) == VR_FLOW_FLAG_RELOCATE;
 }
 
+static inline unsigned int *
+vr_flow_migrate_map(struct vr_flow_migration *vfm, unsigned int oindex)
+{
+    return (unsigned int *)vr_btable_get(vfm->vfm_map, oindex);
+}
 
-static int
-vr_enqueue_flow(struct vr_flow_entry *fe, struct vr_packet *pkt,
-        unsigned short proto, struct vr_forwarding_md *fmd)
+static bool
+vr_flow_migrate_claim(struct vr_flow_entry *ofe)
 {
-    unsigned int i = 0;
-    unsigned short drop_reason = 0;
-    struct vr_list_node **head = &fe->fe_hold_list.node_p;
-    struct vr_packet_node *pnode;
+    unsigned short flags = vr_flow_flags(ofe);
 
-    while (*head && ++i) {
-        head = &(*head)->node_n;
-    }
+    if ((flags & (VR_FLOW_FLAG_ACTIVE | VR_FLOW_FLAG_RELOCATE)) !=
+            VR_FLOW_FLAG_ACTIVE)
+        return false;
 
-    if (i >= VR_MAX_FLOW_QUEUE_ENTRIES) {
-        drop_reason = VP_DROP_FLOW_QUEUE_LIMIT_EXCEEDED;
-        goto drop;
-    }
+    return __sync_bool_compare_and_swap(&ofe->fe_flags, flags,
+            flags | VR_FLOW_FLAG_RELOCATE);
+}
 
-    pnode = (struct vr_packet_node *)vr_zalloc(sizeof(struct vr_packet_node));
-    if (!pnode) {
-        drop_reason = VP_DROP_FLOW_NO_MEMORY;
-        goto drop;
-    }
+/* copies a claimed entry to a free slot of the new table */
+static struct vr_flow_entry *
+vr_flow_migrate_copy(struct vrouter *router, struct vr_flow_entry *ofe,
+        unsigned int *nindex)
+{
+    struct vr_flow_key key;
+    struct vr_flow_entry *nfe;
 
-    pnode->pl_packet = pkt;
-    pnode->pl_proto = proto;
-    if (fmd)
-        pnode->pl_outer_src_ip = fmd->fmd_outer_src_ip;
-    *head = &pnode->pl_node;
+    memcpy(&key, &ofe->fe_key, sizeof(key));
+    nfe = vr_flow_table_get_free(router, router->vr_flow_table, &key,
+            vr_hash(&key, sizeof(key), 0), nindex);
+    if (!nfe) {
+        (void)__sync_and_and_fetch(&ofe->fe_flags, ~VR_FLOW_FLAG_RELOCATE);
+        return NULL;
+    }
 
-    return 0;
+    memcpy(nfe, ofe, sizeof(*nfe));
+    nfe->fe_flags &= ~VR_FLOW_FLAG_RELOCATE;
+    nfe->fe_rflow = -1;
+    vr_flow_fwd_reset(nfe);
+    /* packets that were held meanwhile go along with the entry */
+    nfe->fe_hold_list.node_p =
+        __sync_lock_test_and_set(&ofe->fe_hold_list.node_p, NULL);
 
-drop:
-    vr_pfree(pkt, drop_reason);
-    return 0;
+    return nfe;
 }
 
-static int
-vr_flow_forward(unsigned short vrf, struct vr_packet *pkt,
-        unsigned short proto, struct vr_forwarding_md *fmd)
+/* makes the new entry visible, and marks the old one as migrated */
+static void
+vr_flow_migrate_commit(struct vrouter *router,
+        struct vr_flow_migration *vfm, struct vr_flow_entry *ofe,
+        unsigned int oindex, unsigned int nindex)
+{
+    unsigned int *map;
+
+    vr_flow_tag_set(router->vr_flow_table, nindex,
+            vr_flow_hash_tag(vr_hash(&ofe->fe_key, sizeof(ofe->fe_key), 0)));
+
+    map = vr_flow_migrate_map(vfm, oindex);
+    if (map)
+        *map = nindex;
+    __sync_synchronize();
+    ofe->fe_flags = VR_FLOW_FLAG_RELOCATE;
+
+    return;
+}
+
+/*
+ * points the new entry of 'ofe' to the new entry of its reverse flow, and
+ * the other way around if the reverse flow points back to 'ofe'. both the
+ * entries of a pair try this once they are migrated, and hence whichever
+ * finishes last links the pair
+ */
+static void
+vr_flow_migrate_link(struct vrouter *router, struct vr_flow_migration *vfm,
+        struct vr_flow_entry *ofe, unsigned int oindex)
+{
+    unsigned int *map, *rmap;
+    struct vr_flow_entry *orfe, *nfe, *nrfe;
+
+    if (ofe->fe_rflow < 0)
+        return;
+
+    orfe = vr_flow_table_entry(vfm->vfm_table, ofe->fe_rflow);
+    if (!orfe || !vr_flow_migrated(orfe))
+        return;
+
+    map = vr_flow_migrate_map(vfm, oindex);
+    rmap = vr_flow_migrate_map(vfm, ofe->fe_rflow);
+    if (!map || !rmap)
+        return;
+
+    nfe = vr_get_flow_entry(router, *map);
+    nrfe = vr_get_flow_entry(router, *rmap);
+    if (!nfe || !nrfe)
+        return;
+
+    nfe->fe_rflow = *rmap;
+    if (orfe->fe_rflow == (int)oindex)
+        nrfe->fe_rflow = *map;
+
+    return;
+}
+
+/*
+ * migrates 'ofe', and its reverse flow, to the new table. returns -ENOSPC
+ * if the new table has no room for the entry, and 0 otherwise (including
+ * when some other cpu is migrating the entry)
+ */
+static int
+vr_flow_migrate_entry(struct vrouter *router, struct vr_flow_migration *vfm,
+        struct vr_flow_entry *ofe, unsigned int oindex)
+{
+    unsigned int nindex, nrindex, rindex;
+    struct vr_flow_entry *nfe, *orfe = NULL;
+
+    if (!vr_flow_migrate_claim(ofe))
+        return 0;
+
+    nfe = vr_flow_migrate_copy(router, ofe, &nindex);
+    if (!nfe)
+        return -ENOSPC;
+
+    if (ofe->fe_rflow >= 0) {
+        rindex = ofe->fe_rflow;
+        orfe = vr_flow_table_entry(vfm->vfm_table, rindex);
+        if (orfe && vr_flow_migrate_claim(orfe)) {
+            if (vr_flow_migrate_copy(router, orfe, &nrindex))
+                vr_flow_migrate_commit(router, vfm, orfe, rindex, nrindex);
+            else
+                orfe = NULL;
+        } else {
+            orfe = NULL;
+        }
+    }
+
+    vr_flow_migrate_commit(router, vfm, ofe, oindex, nindex);
+    vr_flow_migrate_link(router, vfm, ofe, oindex);
+    if (orfe)
+        vr_flow_migrate_link(router, vfm, orfe, rindex);
+
+    return 0;
+}
+
+/*
+ * lookup in the table that is being migrated from. an entry that is found
+ * there is migrated, and its entry in the new table returned. if the entry
+ * cannot be migrated right away, the index is set to
+ * VR_FLOW_INDEX_IN_TRANSIT, so that the packet is not taken as the first
+ * packet of a new flow
+ */
+static struct vr_flow_entry *
+vr_flow_migrate_lookup(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int hash, unsigned int *fe_index)
+{
+    unsigned int oindex, *map;
+    unsigned short flags;
+    struct vr_flow_entry *ofe, *fe;
+    struct vr_flow_migration *vfm = router->vr_flow_migration;
+
+    if (!vfm)
+        return NULL;
+
+    ofe = vr_flow_table_lookup(vfm->vfm_table, key, hash, &oindex);
+    if (!ofe)
+        return NULL;
+
+    if (!vr_flow_migrated(ofe)) {
+        flags = vr_flow_flags(ofe);
+        if (!(flags & VR_FLOW_FLAG_ACTIVE))
+            return NULL;
+
+        /*
+         * some other cpu is migrating the entry, or there is no room for
+         * it in the new table
+         */
+        if ((flags & VR_FLOW_FLAG_RELOCATE) ||
+                vr_flow_migrate_entry(router, vfm, ofe, oindex) ||
+                !vr_flow_migrated(ofe)) {
+            *fe_index = VR_FLOW_INDEX_IN_TRANSIT;
+            return NULL;
+        }
+    }
+
+    __sync_synchronize();
+    map = vr_flow_migrate_map(vfm, oindex);
+    if (!map)
+        return NULL;
+
+    /* the flow could have been deleted from the new table since */
+    fe = vr_get_flow_entry(router, *map);
+    if (!fe || !(fe->fe_flags & VR_FLOW_FLAG_ACTIVE) ||
+            memcmp(&fe->fe_key, key, sizeof(*key)))
+        return NULL;
+
+    *fe_index = *map;
+    return fe;
+}
+
+/* only the inet table is ever resized, and hence migrated from */
+static struct vr_flow_entry *
+__vr_find_flow(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_key *key, unsigned int hash, unsigned int *fe_index)
+{
+    struct vr_flow_entry *flow_e;
+
+    *fe_index = 0;
+    flow_e = vr_flow_table_lookup(ft, key, hash, fe_index);
+    if (!flow_e && router->vr_flow_migration &&
+            (ft == router->vr_flow_table))
+        flow_e = vr_flow_migrate_lookup(router, key, hash, fe_index);
+
+    return flow_e;
+}
+
+static struct vr_flow_entry *
+vr_flow_table_find(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_key *key, unsigned int *fe_index)
+{
+    return __vr_find_flow(router, ft, key, vr_flow_key_hash(ft, key, 0),
+            fe_index);
+}
+
+struct vr_flow_entry *
+vr_find_flow(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int *fe_index)
+{
+    return vr_flow_table_find(router, router->vr_flow_table, key, fe_index);
+}
+
+/* the table that the flows of 'family' are in */
+static struct vr_flow_table *
+vr_flow_family_table(struct vrouter *router, unsigned short family)
+{
+    switch (family) {
+    case AF_INET:
+        return router->vr_flow_table;
+
+    case AF_INET6:
+        return router->vr_flow6_table;
+
+    default:
+        return NULL;
+    }
+}
+
+/* the entry at 'index' of the table of the flows of 'family' */
+struct vr_flow_entry *
+vr_flow_get_entry(struct vrouter *router, unsigned short family, int index)
+{
+    struct vr_flow_table *ft = vr_flow_family_table(router, family);
+
+    if (!ft)
+        return NULL;
+
+    return vr_flow_table_entry(ft, index);
+}
+
+static int
+vr_flow_forward(unsigned short vrf, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
 {
     struct vr_interface *vif = pkt->vp_if;
     struct vrouter *router = vif->vif_router;
 
+    /* see vr_flow_inet6_input */
+    if (proto == VR_ETH_PROTO_IP6)
+        return vr_bridge_input(router, vrf, pkt, fmd);
+
     if (proto != VR_ETH_PROTO_IP) {
         vr_pfree(pkt, VP_DROP_FLOW_INVALID_PROTOCOL);
         return 0;
@@ -374,23 +1050,188 @@ vr_flow_forward(unsigned short vrf, struct vr_packet *pkt,
     return vr_ip_input(router, vrf, pkt, fmd);
 }
 
+/* the vrf that the packets of the flow are forwarded in */
+static inline unsigned short
+vr_flow_fwd_vrf(struct vr_flow_entry *fe)
+{
+    if (fe->fe_flags & VR_FLOW_FLAG_VRFT)
+        return fe->fe_dvrf;
+
+    return fe->fe_key.key_vrf_id;
+}
+
+/*
+ * keep the route that the packet of the flow was forwarded with, unless
+ * the flow has changed since the packet saw it
+ */
+static void
+vr_flow_fwd_set(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned short vrf, struct vr_ip *ip, unsigned int gen,
+        struct vr_nexthop *nh, uint32_t label)
+{
+    uint32_t old;
+
+    if ((gen & 0x1) || !nh || nh->nh_id == NH_DISCARD_ID ||
+            __vrouter_get_nexthop(router, nh->nh_id) != nh)
+        return;
+
+    if (!vr_flow_fwd_lock(fe, &old))
+        return;
+
+    if (fe->fe_action != VR_FLOW_ACTION_FORWARD ||
+            vr_flow_fwd_vrf(fe) != vrf ||
+            fe->fe_key.key_dest_ip != ip->ip_daddr) {
+        fe->fe_fwd_gen = old;
+        return;
+    }
+
+    fe->fe_fwd_nh_index = nh->nh_id;
+    fe->fe_fwd_label = label;
+    __sync_synchronize();
+    fe->fe_fwd_gen = gen;
+
+    return;
+}
+
+/*
+ * vr_flow_forward for the packets of a forwarded inet flow, which are sent
+ * to the nexthop kept in the entry while the fib of the vrf is as it was
+ * when the route was looked up, and skip the route lookup
+ */
+static int
+vr_flow_forward_inet(struct vrouter *router, unsigned short vrf,
+        struct vr_flow_entry *fe, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
+{
+    unsigned int gen;
+    uint32_t fwd_gen, label = 0;
+    struct vr_ip *ip;
+    struct vr_nexthop *nh = NULL;
+    struct vr_route_req rt;
+
+    if (proto != VR_ETH_PROTO_IP || pkt->vp_nh ||
+            (pkt->vp_flags & VP_FLAG_MULTICAST))
+        return vr_flow_forward(vrf, pkt, proto, fmd);
+
+    pkt_set_data(pkt, pkt->vp_network_h);
+    ip = (struct vr_ip *)pkt_data(pkt);
+    if (ip->ip_version != 4 || ip->ip_hl < 5)
+        return vr_ip_input(router, vrf, pkt, fmd);
+
+    gen = vr_inet_route_gen(vrf);
+    fwd_gen = *(volatile uint32_t *)&fe->fe_fwd_gen;
+    if (fwd_gen == gen && !(gen & 0x1) &&
+            fe->fe_fwd_nh_index != NH_DISCARD_ID) {
+        nh = __vrouter_get_nexthop(router, fe->fe_fwd_nh_index);
+        label = fe->fe_fwd_label;
+        /* ...as they were at fwd_gen */
+        __sync_synchronize();
+        if (*(volatile uint32_t *)&fe->fe_fwd_gen != fwd_gen)
+            nh = NULL;
+    }
+
+    if (!nh) {
+        /* the lookup has to see the fib as of gen, or a later one */
+        __sync_synchronize();
+
+        rt.rtr_req.rtr_vrf_id = vrf;
+        rt.rtr_req.rtr_prefix = ntohl(ip->ip_daddr);
+        rt.rtr_req.rtr_prefix_len = 32;
+        rt.rtr_req.rtr_nh_id = 0;
+        nh = vr_inet_route_lookup(vrf, &rt, pkt);
+
+        label = 0;
+        if (rt.rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)
+            label = rt.rtr_req.rtr_label | VR_FLOW_FWD_LABEL_VALID;
+        vr_flow_fwd_set(router, fe, vrf, ip, gen, nh, label);
+    }
+
+    pkt->vp_type = VP_TYPE_IP;
+    if (label & VR_FLOW_FWD_LABEL_VALID)
+        fmd->fmd_label = label & ~VR_FLOW_FWD_LABEL_VALID;
+
+    return nh_output(vrf, pkt, nh, fmd);
+}
+
+static void
+vr_flow6_nat_address(unsigned char *addr, unsigned char *new_addr,
+        unsigned int *inc)
+{
+    unsigned int i, word, new_word;
+
+    /* the addresses in a packet need not be aligned */
+    for (i = 0; i < VR_IP6_ADDRESS_LEN; i += sizeof(word)) {
+        memcpy(&word, addr + i, sizeof(word));
+        memcpy(&new_word, new_addr + i, sizeof(new_word));
+        vr_incremental_diff(word, new_word, inc);
+    }
+    memcpy(addr, new_addr, VR_IP6_ADDRESS_LEN);
+
+    return;
+}
+
+/* as the inet nat below, with the addresses of the reverse flow's entry */
+static int
+vr_flow6_nat(unsigned short vrf, struct vr_flow_entry *fe,
+        struct vr_flow_entry *rfe, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
+{
+    unsigned int ip_inc, inc = 0;
+    unsigned short *t_sport, *t_dport;
+    struct vr_ip6 *ip6;
+
+    ip6 = (struct vr_ip6 *)pkt_network_header(pkt);
+
+    if (fe->fe_flags & VR_FLOW_FLAG_SNAT)
+        vr_flow6_nat_address(ip6->ip6_src, vr_flow6_entry(rfe)->fe6_dest_ip,
+                &inc);
+
+    if (fe->fe_flags & VR_FLOW_FLAG_DNAT)
+        vr_flow6_nat_address(ip6->ip6_dst, vr_flow6_entry(rfe)->fe6_src_ip,
+                &inc);
+
+    ip_inc = inc;
+
+    if (ip6->ip6_nxt == VR_IP_PROTO_TCP || ip6->ip6_nxt == VR_IP_PROTO_UDP) {
+        t_sport = (unsigned short *)(ip6 + 1);
+        t_dport = t_sport + 1;
+
+        if (fe->fe_flags & VR_FLOW_FLAG_SPAT) {
+            vr_incremental_diff(*t_sport, rfe->fe_key.key_dst_port, &inc);
+            *t_sport = rfe->fe_key.key_dst_port;
+        }
+
+        if (fe->fe_flags & VR_FLOW_FLAG_DPAT) {
+            vr_incremental_diff(*t_dport, rfe->fe_key.key_src_port, &inc);
+            *t_dport = rfe->fe_key.key_src_port;
+        }
+    }
+
+    vr_ip6_update_csum(pkt, ip6, ip_inc, inc);
+
+    return vr_flow_forward(vrf, pkt, proto, fmd);
+}
+
 static int
-vr_flow_nat(unsigned short vrf, struct vr_flow_entry *fe, struct vr_packet *pkt,
+vr_flow_nat(unsigned short vrf, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, struct vr_packet *pkt,
         unsigned short proto, struct vr_forwarding_md *fmd)
 {
     unsigned int ip_inc, inc = 0; 
     unsigned short *t_sport, *t_dport;
-    struct vrouter *router = pkt->vp_if->vif_router;
     struct vr_flow_entry *rfe;
     struct vr_ip *ip;
 
     if (fe->fe_rflow < 0)
         goto drop;
 
-    rfe = vr_get_flow_entry(router, fe->fe_rflow);
+    rfe = vr_flow_table_entry(ft, fe->fe_rflow);
     if (!rfe)
         goto drop;
 
+    if (vr_flow_table_inet6(ft))
+        return vr_flow6_nat(vrf, fe, rfe, pkt, proto, fmd);
+
     ip = (struct vr_ip *)pkt_data(pkt);
 
     if (fe->fe_flags & VR_FLOW_FLAG_SNAT) {
@@ -432,15 +1273,16 @@ drop:
 }
 
 static void
-vr_flow_set_forwarding_md(struct vrouter *router, struct vr_flow_entry *fe,
-        unsigned int index, struct vr_forwarding_md *md)
+vr_flow_set_forwarding_md(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, unsigned int index,
+        struct vr_forwarding_md *md)
 {
     struct vr_flow_entry *rfe;
 
     md->fmd_flow_index = index;
     md->fmd_ecmp_nh_index = fe->fe_ecmp_nh_index;
     if (fe->fe_flags & VR_RFLOW_VALID) {
-        rfe = vr_get_flow_entry(router, fe->fe_rflow);
+        rfe = vr_flow_table_entry(ft, fe->fe_rflow);
         if (rfe)
             md->fmd_ecmp_src_nh_index = rfe->fe_ecmp_nh_index;
     }
@@ -449,8 +1291,8 @@ vr_flow_set_forwarding_md(struct vrouter *router, struct vr_flow_entry *fe,
 }
 
 static int
-vr_flow_action(struct vrouter *router, struct vr_flow_entry *fe, 
-        unsigned int index, struct vr_packet *pkt,
+vr_flow_action(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, unsigned int index, struct vr_packet *pkt,
         unsigned short proto, struct vr_forwarding_md *fmd)
 {
     int ret = 0, valid_src;
@@ -458,11 +1300,9 @@ vr_flow_action(struct vrouter *router, struct vr_flow_entry *fe,
     struct vr_forwarding_md mirror_fmd;
     struct vr_nexthop *src_nh;
 
-    vrf = fe->fe_key.key_vrf_id;
-    if (fe->fe_flags & VR_FLOW_FLAG_VRFT)
-        vrf = fe->fe_dvrf;
+    vrf = vr_flow_fwd_vrf(fe);
 
-    vr_flow_set_forwarding_md(router, fe, index, fmd);
+    vr_flow_set_forwarding_md(router, ft, fe, index, fmd);
     src_nh = __vrouter_get_nexthop(router, fe->fe_src_nh_index);
     if (!src_nh) {
         vr_pfree(pkt, VP_DROP_INVALID_NH);
@@ -507,11 +1347,14 @@ vr_flow_action(struct vrouter *router, struct vr_flow_entry *fe,
         break;
 
     case VR_FLOW_ACTION_FORWARD:
-        ret = vr_flow_forward(vrf, pkt, proto, fmd);
+        if (ft->vft_family == AF_INET)
+            ret = vr_flow_forward_inet(router, vrf, fe, pkt, proto, fmd);
+        else
+            ret = vr_flow_forward(vrf, pkt, proto, fmd);
         break;
 
     case VR_FLOW_ACTION_NAT:
-        ret = vr_flow_nat(vrf, fe, pkt, proto, fmd);
+        ret = vr_flow_nat(vrf, ft, fe, pkt, proto, fmd);
         break;
 
     default:
@@ -550,11 +1393,90 @@ vr_trap_flow(struct vrouter *router, struct vr_flow_entry *fe,
     return vr_trap(npkt, fe->fe_key.key_vrf_id, trap_reason, &index);
 }
 
+static inline struct vr_flow_queue *
+vr_flow_queue(struct vr_flow_entry *fe)
+{
+    return (struct vr_flow_queue *)fe->fe_hold_list.node_p;
+}
+
+static void
+vr_flow_queue_free(struct vrouter *router, void *data)
+{
+    /* the ring is defer data, and is released once we return */
+    return;
+}
+
+static int
+vr_enqueue_flow(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, unsigned int index, struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    unsigned int slot;
+    unsigned short drop_reason;
+    struct vr_flow_queue *vfq, *nvfq;
+    struct vr_packet_node *pnode;
+
+    vfq = vr_flow_queue(fe);
+    if (!vfq) {
+        nvfq = vr_get_defer_data(VR_FLOW_QUEUE_SIZE);
+        if (!nvfq) {
+            drop_reason = VP_DROP_FLOW_NO_MEMORY;
+            goto drop;
+        }
+        memset(nvfq, 0, VR_FLOW_QUEUE_SIZE);
+
+        vfq = (struct vr_flow_queue *)__sync_val_compare_and_swap(
+                &fe->fe_hold_list.node_p, NULL, (struct vr_list_node *)nvfq);
+        if (!vfq) {
+            /*
+             * the flow may have left hold, and its ring been flushed, after
+             * we looked at the action, in which case no one flushes ours.
+             * take it back, along with what others queued in it meanwhile
+             */
+            __sync_synchronize();
+            if (fe->fe_action != VR_FLOW_ACTION_HOLD) {
+                if (__sync_bool_compare_and_swap(&fe->fe_hold_list.node_p,
+                            (struct vr_list_node *)nvfq, NULL))
+                    vr_flow_queue_flush(router, ft, fe, index, nvfq, fmd);
+                return vr_flow_action(router, ft, fe, index, pkt, proto, fmd);
+            }
+
+            /* first packet of the flow. agent needs to know about it */
+            vfq = nvfq;
+            vr_trap_flow(router, fe, pkt, index);
+        } else {
+            vr_put_defer_data(nvfq);
+        }
+    }
+
+    slot = __sync_fetch_and_add(&vfq->vfq_entries, 1);
+    if (slot >= vr_flow_queue_entries) {
+        drop_reason = VP_DROP_FLOW_QUEUE_LIMIT_EXCEEDED;
+        goto drop;
+    }
+
+    pnode = &vfq->vfq_pnodes[slot];
+    pnode->pl_proto = proto;
+    if (fmd)
+        pnode->pl_outer_src_ip = fmd->fmd_outer_src_ip;
+    /* the flusher considers the slot filled once the packet is visible */
+    if (__sync_val_compare_and_swap(&pnode->pl_packet, NULL, pkt))
+        /* the ring was flushed without us, and hence the flow is set */
+        return vr_flow_action(router, ft, fe, index, pkt, proto, fmd);
+
+    return 0;
+
+drop:
+    vr_pfree(pkt, drop_reason);
+    return 0;
+}
+
 static int
-vr_do_flow_action(struct vrouter *router, struct vr_flow_entry *fe,
-        unsigned int index, struct vr_packet *pkt,
+vr_do_flow_action(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, unsigned int index, struct vr_packet *pkt,
         unsigned short proto, struct vr_forwarding_md *fmd)
 {
+    uint16_t now;
     uint32_t new_stats;
 
     new_stats = __sync_add_and_fetch(&fe->fe_stats.flow_bytes, pkt_len(pkt));
@@ -565,31 +1487,29 @@ vr_do_flow_action(struct vrouter *router, struct vr_flow_entry *fe,
     if (!new_stats) 
         fe->fe_stats.flow_packets_oflow++;
 
-    if (fe->fe_action == VR_FLOW_ACTION_HOLD) {
-        if (vr_flow_queue_is_empty(router, fe)) {
-            vr_trap_flow(router, fe, pkt, index);
-            return vr_enqueue_flow(fe, pkt, proto, fmd);
-        } else {
-            vr_pfree(pkt, VP_DROP_FLOW_UNUSABLE);
-            return 0;
-        }
-    }
+    now = router->vr_flow_table_info->vfti_aging_time;
+    if (fe->fe_last_seen != now)
+        fe->fe_last_seen = now;
+
+    if (fe->fe_action == VR_FLOW_ACTION_HOLD)
+        return vr_enqueue_flow(router, ft, fe, index, pkt, proto, fmd);
 
-    return vr_flow_action(router, fe, index, pkt, proto, fmd);
+    return vr_flow_action(router, ft, fe, index, pkt, proto, fmd);
 }
 
 static unsigned int
 vr_flow_table_hold_count(struct vrouter *router)
 {
     unsigned int i, num_cpus;
-    uint64_t hcount = 0, act_count;
+    uint64_t hcount = 0, act_count = 0;
     struct vr_flow_table_info *infop = router->vr_flow_table_info;
 
     num_cpus = vr_num_cpus;
-    for (i = 0; i < num_cpus; i++)
-        hcount += infop->vfti_hold_count[i];
+    for (i = 0; i < num_cpus; i++) {
+        hcount += infop->vfti_cpu_info[i].vfci_hold_count;
+        act_count += infop->vfti_cpu_info[i].vfci_action_count;
+    }
 
-    act_count = infop->vfti_action_count;
     if (hcount >= act_count)
         return hcount - act_count;
 
@@ -600,48 +1520,37 @@ static void
 vr_flow_entry_set_hold(struct vrouter *router, struct vr_flow_entry *flow_e)
 {
     unsigned int cpu;
-    uint64_t act_count;
     struct vr_flow_table_info *infop = router->vr_flow_table_info;
 
     cpu = vr_get_cpu();
     flow_e->fe_action = VR_FLOW_ACTION_HOLD;
-
-    if (infop->vfti_hold_count[cpu] + 1 < infop->vfti_hold_count[cpu]) {
-        act_count = infop->vfti_action_count;
-        if (act_count > infop->vfti_hold_count[cpu]) {
-           (void)__sync_sub_and_fetch(&infop->vfti_action_count,
-                    infop->vfti_hold_count[cpu]);
-            infop->vfti_hold_count[cpu] = 0;
-        } else {
-            infop->vfti_hold_count[cpu] -= act_count;
-            (void)__sync_sub_and_fetch(&infop->vfti_action_count,
-                    act_count);
-        }
-    }
-
-    infop->vfti_hold_count[cpu]++;
+    infop->vfti_cpu_info[cpu].vfci_hold_count++;
 
     return;
 }
 
+/*
+ * act on the result of a flow lookup. a miss creates an entry in hold
+ * state, which traps the packet to the agent
+ */
 static int
-vr_flow_lookup(struct vrouter *router, struct vr_flow_key *key,
-        struct vr_packet *pkt, unsigned short proto,
+vr_flow_lookup_result(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_key *key, struct vr_flow_entry *flow_e,
+        unsigned int fe_index, struct vr_packet *pkt, unsigned short proto,
         struct vr_forwarding_md *fmd)
 {
-    unsigned int fe_index;
-    struct vr_flow_entry *flow_e;
-
-    pkt->vp_flags |= VP_FLAG_FLOW_SET;
-
-    flow_e = vr_find_flow(router, key, &fe_index);
     if (!flow_e) {
+        if (fe_index == VR_FLOW_INDEX_IN_TRANSIT) {
+            vr_pfree(pkt, VP_DROP_FLOW_UNUSABLE);
+            return 0;
+        }
+
         if (vr_flow_table_hold_count(router) > VR_MAX_FLOW_TABLE_HOLD_COUNT) {
             vr_pfree(pkt, VP_DROP_FLOW_UNUSABLE);
             return 0;
         }
 
-        flow_e = vr_find_free_entry(router, key, &fe_index);
+        flow_e = vr_find_free_entry(router, ft, key, &fe_index);
         if (!flow_e) {
             vr_pfree(pkt, VP_DROP_FLOW_TABLE_FULL);
             return 0;
@@ -649,12 +1558,31 @@ vr_flow_lookup(struct vrouter *router, struct vr_flow_key *key,
 
         /* mark as hold */
         vr_flow_entry_set_hold(router, flow_e);
-        vr_do_flow_action(router, flow_e, fe_index, pkt, proto, fmd);
+        vr_do_flow_action(router, ft, flow_e, fe_index, pkt, proto, fmd);
         return 0;
     } 
     
 
-    return vr_do_flow_action(router, flow_e, fe_index, pkt, proto, fmd);
+    return vr_do_flow_action(router, ft, flow_e, fe_index, pkt, proto, fmd);
+}
+
+static int
+vr_flow_lookup(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_key *key, struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    unsigned int fe_index, hash;
+    struct vr_flow_entry *flow_e;
+
+    pkt->vp_flags |= VP_FLAG_FLOW_SET;
+
+    /* the hash is of the 5-tuple and the vrf, and is of use further on */
+    hash = vr_flow_key_hash(ft, key, 0);
+    fmd->fmd_flow_hash = hash;
+
+    flow_e = __vr_find_flow(router, ft, key, hash, &fe_index);
+    return vr_flow_lookup_result(router, ft, key, flow_e, fe_index, pkt,
+            proto, fmd);
 }
 
 /*
@@ -774,7 +1702,8 @@ vr_flow_inet_input(struct vrouter *router, unsigned short vrf,
             return vr_trap(pkt, vrf, trap_res, NULL);
         }
 
-        return vr_flow_lookup(router, key_p, pkt, proto, fmd);
+        return vr_flow_lookup(router, router->vr_flow_table, key_p, pkt,
+                proto, fmd);
     }
 
     /* 
@@ -784,60 +1713,262 @@ vr_flow_inet_input(struct vrouter *router, unsigned short vrf,
     return vr_flow_forward(vrf, pkt, proto, fmd);
 }
 
-static void
-vr_flush_entry(struct vrouter *router, struct vr_flow_entry *fe,
-        struct vr_flow_md *flmd, struct vr_forwarding_md *fmd)
+/*
+ * the ports are of the header that follows the fixed header. packets with
+ * extension headers, fragments included, are keyed on the first of the
+ * extension headers and no ports, and hence all the packets of such a
+ * flow are in the same flow
+ */
+static inline void
+vr_get_flow6_key(struct vr_flow6_key *key, unsigned short vrf,
+        struct vr_ip6 *ip6)
 {
-    struct vr_list_node *head;
-    struct vr_packet_node *pnode;
+    unsigned short *t_hdr;
+    struct vr_icmp *icmph;
+    struct vr_flow_key *key4 = &key->key6_key;
 
-    head = fe->fe_hold_list.node_p;
-    fe->fe_hold_list.node_p = NULL;
+    /* copy both source and destinations */
+    memcpy(key->key6_src_ip, ip6->ip6_src, 2 * VR_IP6_ADDRESS_LEN);
+    key4->key_src_ip = key4->key_dest_ip = 0;
+    key4->key_proto = ip6->ip6_nxt;
+    key4->key_zero = 0;
+    key4->key_vrf_id = vrf;
 
-    while (head) {
-        pnode = (struct vr_packet_node *)head;
-        if (fmd)
-            fmd->fmd_outer_src_ip = pnode->pl_outer_src_ip;
+    t_hdr = (unsigned short *)(ip6 + 1);
 
-        vr_flow_action(router, fe, flmd->flmd_index, pnode->pl_packet,
-                pnode->pl_proto, fmd);
+    switch (ip6->ip6_nxt) {
+    case VR_IP_PROTO_TCP:
+    case VR_IP_PROTO_UDP:
+        key4->key_src_port = *t_hdr;
+        key4->key_dst_port = *(t_hdr + 1);
+        break;
+
+    case VR_IP_PROTO_ICMP6:
+        icmph = (struct vr_icmp *)t_hdr;
+        if (icmph->icmp_type == VR_ICMP6_TYPE_ECHO ||
+                icmph->icmp_type == VR_ICMP6_TYPE_ECHO_REPLY) {
+            key4->key_src_port = icmph->icmp_eid;
+            key4->key_dst_port = VR_ICMP6_TYPE_ECHO_REPLY;
+        } else {
+            key4->key_src_port = 0;
+            key4->key_dst_port = icmph->icmp_type;
+        }
+
+        break;
 
-        head = pnode->pl_node.node_n;
-        vr_free(pnode);
+    default:
+        key4->key_src_port = key4->key_dst_port = 0;
+        break;
     }
 
     return;
 }
 
+/* as vr_flow_parse, for inet6 */
+static unsigned int
+vr_flow6_parse(struct vrouter *router, struct vr_flow6_key *key,
+        struct vr_packet *pkt, unsigned int *trap_res)
+{
+    unsigned int proto_port;
+    unsigned int res = VR_FLOW_BYPASS;
+    struct vr_flow_key *key4 = &key->key6_key;
+
+    if (pkt->vp_flags & VP_FLAG_FLOW_SET)
+        return res;
+
+    if (pkt->vp_if->vif_flags & VIF_FLAG_POLICY_ENABLED ||
+            pkt->vp_flags & VP_FLAG_FLOW_GET)
+        res = VR_FLOW_LOOKUP;
+
+    /* no flow lookup for multicast */
+    if (key->key6_dest_ip[0] == 0xff) {
+        pkt->vp_flags |= VP_FLAG_FLOW_SET;
+        return VR_FLOW_BYPASS;
+    }
+
+    /* ...nor for neighbour discovery, without which nothing works */
+    if (key4->key_proto == VR_IP_PROTO_ICMP6 &&
+            key4->key_dst_port >= VR_ICMP6_TYPE_ROUTER_SOL &&
+            key4->key_dst_port <= VR_ICMP6_TYPE_REDIRECT) {
+        pkt->vp_flags |= VP_FLAG_FLOW_SET;
+        return VR_FLOW_BYPASS;
+    }
+
+    proto_port = (key4->key_proto << VR_FLOW_PROTO_SHIFT) |
+        key4->key_dst_port;
+    if (proto_port == VR_UDP_DHCP6_SPORT ||
+            proto_port == VR_UDP_DHCP6_CPORT) {
+        pkt->vp_flags |= VP_FLAG_FLOW_SET;
+        if (trap_res)
+            *trap_res = AGENT_TRAP_L3_PROTOCOLS;
+        return VR_FLOW_TRAP;
+    }
+
+    return res;
+}
+
+/*
+ * inet6 packets are bridged, and the packets of a policy enabled
+ * interface come here on their way to the bridge, with the data at the
+ * ethernet header and the network header set. they are subject to the
+ * same actions as inet packets, from the inet6 flow table, and
+ * forwarding one is handing it to the bridge
+ */
+unsigned int
+vr_flow_inet6_input(struct vrouter *router, unsigned short vrf,
+        struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    unsigned int flow_parse_res, trap_res = 0;
+    struct vr_flow6_key key;
+    struct vr_ip6 *ip6;
+
+    /* the key has the ports, which are right after the fixed header */
+    if (pkt_head_len(pkt) < (pkt->vp_network_h - pkt->vp_data) +
+            sizeof(*ip6) + 2 * sizeof(unsigned short)) {
+        vr_pfree(pkt, VP_DROP_INVALID_PACKET);
+        return 0;
+    }
+
+    ip6 = (struct vr_ip6 *)pkt_network_header(pkt);
+    vr_get_flow6_key(&key, vrf, ip6);
+
+    flow_parse_res = vr_flow6_parse(router, &key, pkt, &trap_res);
+    if (flow_parse_res == VR_FLOW_BYPASS || !router->vr_flow6_table) {
+        return vr_flow_forward(vrf, pkt, proto, fmd);
+    } else if (flow_parse_res == VR_FLOW_TRAP) {
+        return vr_trap(pkt, vrf, trap_res, NULL);
+    }
+
+    return vr_flow_lookup(router, router->vr_flow6_table, &key.key6_key,
+            pkt, proto, fmd);
+}
+
+/*
+ * sends the packets of a ring that was taken off its entry as the entry
+ * says, or drops them if there is no fmd to send them with, and releases
+ * the ring
+ */
 static void
-vr_flow_flush(void *arg)
+vr_flow_queue_flush(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, unsigned int index,
+        struct vr_flow_queue *vfq, struct vr_forwarding_md *fmd)
+{
+    unsigned int i, entries;
+    struct vr_packet_node *pnode;
+    struct vr_packet *pkt;
+
+    entries = __sync_lock_test_and_set(&vfq->vfq_entries,
+            VR_FLOW_QUEUE_CLOSED);
+    if (entries > vr_flow_queue_entries)
+        entries = vr_flow_queue_entries;
+
+    for (i = 0; i < entries; i++) {
+        pnode = &vfq->vfq_pnodes[i];
+        /*
+         * the slot is claimed, but the packet may not have landed yet. if
+         * so, it is for the enqueuer to act on it, rather than for us to
+         * wait for it
+         */
+        pkt = __sync_lock_test_and_set(&pnode->pl_packet,
+                VR_FLOW_QUEUE_SLOT_TAKEN);
+        if (!pkt)
+            continue;
+        __sync_synchronize();
+
+        if (!fmd) {
+            vr_pfree(pkt, VP_DROP_FLOW_ACTION_DROP);
+            continue;
+        }
+
+        fmd->fmd_outer_src_ip = pnode->pl_outer_src_ip;
+        vr_flow_action(router, ft, fe, index, pkt, pnode->pl_proto, fmd);
+    }
+
+    /* enqueuers that raced with us could still be looking at the ring */
+    vr_defer(router, vr_flow_queue_free, vfq);
+
+    return;
+}
+
+static void
+vr_flush_entry(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_entry *fe, struct vr_flow_md *flmd,
+        struct vr_forwarding_md *fmd)
+{
+    struct vr_flow_queue *vfq;
+
+    vfq = (struct vr_flow_queue *)__sync_lock_test_and_set(
+            &fe->fe_hold_list.node_p, NULL);
+    if (!vfq)
+        return;
+
+    vr_flow_queue_flush(router, ft, fe, flmd->flmd_index, vfq, fmd);
+
+    return;
+}
+
+static void
+__vr_flow_flush(struct vr_flow_md *flmd)
 {
     struct vrouter *router;
+    struct vr_flow_table *ft;
     struct vr_flow_entry *fe;
     struct vr_forwarding_md fmd;
-    struct vr_flow_md *flmd = 
-                (struct vr_flow_md *)arg;
 
     router = flmd->flmd_router;
     if (!router)
         return;
 
-    fe = vr_get_flow_entry(router, flmd->flmd_index);
+    ft = vr_flow_family_table(router, flmd->flmd_family);
+    if (!ft)
+        return;
+
+    fe = vr_flow_table_entry(ft, flmd->flmd_index);
     if (!fe)
         return;
 
+    /* the entry could have been moved in the overflow table meanwhile */
+    if (!vr_flow_key_match(ft, fe, &flmd->flmd_key.key6_key)) {
+        fe = vr_flow_table_find(router, ft, &flmd->flmd_key.key6_key,
+                &flmd->flmd_index);
+        if (!fe)
+            return;
+    }
+
     vr_init_forwarding_md(&fmd);
-    vr_flow_set_forwarding_md(router, fe, flmd->flmd_index, &fmd);
+    vr_flow_set_forwarding_md(router, ft, fe, flmd->flmd_index, &fmd);
+    fmd.fmd_flow_hash = vr_flow_key_hash(ft, &flmd->flmd_key.key6_key, 0);
 
-    vr_flush_entry(router, fe, flmd, &fmd);
+    vr_flush_entry(router, ft, fe, flmd, &fmd);
 
     if (!(flmd->flmd_flags & VR_FLOW_FLAG_ACTIVE)) {
-        vr_reset_flow_entry(router, fe, flmd->flmd_index);
+        vr_reset_flow_entry(router, ft, fe, flmd->flmd_index);
     } 
 
     return;
 }
 
+static void
+vr_flow_flush(void *arg)
+{
+    __vr_flow_flush((struct vr_flow_md *)arg);
+    return;
+}
+
+static void
+vr_flow_batch_flush(void *arg)
+{
+    unsigned int i;
+    struct vr_flow_batch_md *fbmd = (struct vr_flow_batch_md *)arg;
+
+    for (i = 0; i < fbmd->fbmd_count; i++)
+        __vr_flow_flush(&fbmd->fbmd_md[i]);
+
+    vr_free(fbmd);
+    return;
+}
+
 static void
 vr_flow_set_mirror(struct vrouter *router, vr_flow_req *req,
         struct vr_flow_entry *fe)
@@ -895,34 +2026,152 @@ vr_flow_set_mirror(struct vrouter *router, vr_flow_req *req,
 }
 
 static struct vr_flow_entry *
-vr_add_flow(unsigned int rid, struct vr_flow_key *key,
-        unsigned int *fe_index)
+vr_add_flow(unsigned int rid, struct vr_flow_table *ft,
+        struct vr_flow_key *key, unsigned int *fe_index)
 {
     struct vr_flow_entry *flow_e;
     struct vrouter *router = vrouter_get(rid);
 
-    flow_e = vr_find_flow(router, key, fe_index);
+    flow_e = vr_flow_table_find(router, ft, key, fe_index);
     if (!flow_e)
-        flow_e = vr_find_free_entry(router, key, fe_index);
+        flow_e = vr_find_free_entry(router, ft, key, fe_index);
 
     return flow_e;
 }
 
+/* requests that do not say which family they are of are of inet flows */
+static struct vr_flow_table *
+vr_flow_req_table(struct vrouter *router, vr_flow_req *req)
+{
+    if (!req->fr_family)
+        return router->vr_flow_table;
+
+    if (req->fr_family == AF_INET6 &&
+            (req->fr_flow_sip6_size != VR_IP6_ADDRESS_LEN ||
+             req->fr_flow_dip6_size != VR_IP6_ADDRESS_LEN))
+        return NULL;
+
+    return vr_flow_family_table(router, req->fr_family);
+}
+
+static void
+vr_flow_req_key(struct vr_flow_table *ft, vr_flow_req *req,
+        struct vr_flow6_key *key6)
+{
+    struct vr_flow_key *key = &key6->key6_key;
+
+    key->key_src_port = req->fr_flow_sport;
+    key->key_dst_port = req->fr_flow_dport;
+    key->key_src_ip = req->fr_flow_sip;
+    key->key_dest_ip = req->fr_flow_dip;
+    key->key_vrf_id = req->fr_flow_vrf;
+    key->key_proto = req->fr_flow_proto;
+    key->key_zero = 0;
+
+    if (vr_flow_table_inet6(ft)) {
+        key->key_src_ip = key->key_dest_ip = 0;
+        memcpy(key6->key6_src_ip, req->fr_flow_sip6, VR_IP6_ADDRESS_LEN);
+        memcpy(key6->key6_dest_ip, req->fr_flow_dip6, VR_IP6_ADDRESS_LEN);
+    }
+
+    return;
+}
+
+/*
+ * the entry that the request refers to. if the entry was moved in the
+ * overflow table, or migrated to a resized table, since the agent learnt
+ * its index, find it by the key, and let the agent know of the new index
+ * in the response
+ */
+static struct vr_flow_entry *
+vr_flow_req_get_entry(struct vrouter *router, struct vr_flow_table *ft,
+        vr_flow_req *req)
+{
+    unsigned int fe_index;
+    struct vr_flow6_key key;
+    struct vr_flow_entry *fe, *moved_fe;
+
+    fe = vr_flow_table_entry(ft, req->fr_index);
+    if (!fe)
+        return fe;
+
+    vr_flow_req_key(ft, req, &key);
+    if (vr_flow_key_match(ft, fe, &key.key6_key))
+        return fe;
+
+    moved_fe = vr_flow_table_find(router, ft, &key.key6_key, &fe_index);
+    if (moved_fe) {
+        req->fr_index = fe_index;
+        return moved_fe;
+    }
+
+    return fe;
+}
+
+/*
+ * the entry of the request, claimed against being moved by the datapath
+ * (by setting VR_FLOW_FLAG_RELOCATE, as a move does) for as long as agent
+ * sets it. an entry that is being moved is claimed at its new index, once
+ * the move is complete. if the key of the request is not in the table,
+ * the entry at the index of the request is returned unclaimed, for the
+ * request to be validated against
+ */
 static struct vr_flow_entry *
-vr_add_flow_req(vr_flow_req *req, unsigned int *fe_index)
+vr_flow_req_claim_entry(struct vrouter *router, struct vr_flow_table *ft,
+        vr_flow_req *req, bool *claimed)
 {
-    struct vr_flow_key key;
+    unsigned short flags;
+    struct vr_flow6_key key;
     struct vr_flow_entry *fe;
 
-    key.key_src_port = req->fr_flow_sport;
-    key.key_dst_port = req->fr_flow_dport;
-    key.key_src_ip = req->fr_flow_sip;
-    key.key_dest_ip = req->fr_flow_dip;
-    key.key_vrf_id = req->fr_flow_vrf;
-    key.key_proto = req->fr_flow_proto;
-    key.key_zero = 0;
+    *claimed = false;
+    vr_flow_req_key(ft, req, &key);
 
-    fe = vr_add_flow(req->fr_rid, &key, fe_index);
+    while (true) {
+        fe = vr_flow_req_get_entry(router, ft, req);
+        if (!fe || !vr_flow_key_match(ft, fe, &key.key6_key))
+            return fe;
+
+        flags = fe->fe_flags;
+        if ((flags & (VR_FLOW_FLAG_ACTIVE | VR_FLOW_FLAG_RELOCATE)) !=
+                VR_FLOW_FLAG_ACTIVE)
+            continue;
+
+        if (!__sync_bool_compare_and_swap(&fe->fe_flags, flags,
+                    flags | VR_FLOW_FLAG_RELOCATE))
+            continue;
+
+        /* the slot could have been freed and taken by another flow */
+        if (vr_flow_key_match(ft, fe, &key.key6_key)) {
+            *claimed = true;
+            return fe;
+        }
+
+        (void)__sync_and_and_fetch(&fe->fe_flags, ~VR_FLOW_FLAG_RELOCATE);
+    }
+
+    return NULL;
+}
+
+static inline void
+vr_flow_req_release_entry(struct vr_flow_entry *fe, bool claimed)
+{
+    if (claimed)
+        (void)__sync_and_and_fetch(&fe->fe_flags, ~VR_FLOW_FLAG_RELOCATE);
+
+    return;
+}
+
+static struct vr_flow_entry *
+vr_add_flow_req(struct vr_flow_table *ft, vr_flow_req *req,
+        unsigned int *fe_index)
+{
+    struct vr_flow6_key key;
+    struct vr_flow_entry *fe;
+
+    vr_flow_req_key(ft, req, &key);
+
+    fe = vr_add_flow(req->fr_rid, ft, &key.key6_key, fe_index);
     if (fe)
         req->fr_index = *fe_index;
 
@@ -934,20 +2183,16 @@ vr_add_flow_req(vr_flow_req *req, unsigned int *fe_index)
  * agent), in which case we should be checking only the request
  */
 static int
-vr_flow_req_is_invalid(struct vrouter *router, vr_flow_req *req,
-        struct vr_flow_entry *fe)
+vr_flow_req_is_invalid(struct vrouter *router, struct vr_flow_table *ft,
+        vr_flow_req *req, struct vr_flow_entry *fe)
 {
+    struct vr_flow6_key key;
     struct vr_flow_entry *rfe;
 
     if (fe) {
-        if ((unsigned int)req->fr_flow_sip != fe->fe_key.key_src_ip ||
-                (unsigned int)req->fr_flow_dip != fe->fe_key.key_dest_ip ||
-                (unsigned short)req->fr_flow_sport != fe->fe_key.key_src_port ||
-                (unsigned short)req->fr_flow_dport != fe->fe_key.key_dst_port||
-                (unsigned short)req->fr_flow_vrf != fe->fe_key.key_vrf_id ||
-                (unsigned char)req->fr_flow_proto != fe->fe_key.key_proto) {
+        vr_flow_req_key(ft, req, &key);
+        if (!vr_flow_key_match(ft, fe, &key.key6_key))
             return -EBADF;
-        }
     }
 
     if (req->fr_flags & VR_FLOW_FLAG_VRFT) {
@@ -956,13 +2201,17 @@ vr_flow_req_is_invalid(struct vrouter *router, vr_flow_req *req,
     }
 
     if (req->fr_flags & VR_FLOW_FLAG_MIRROR) {
+        /* the mirror meta data is by the index of an inet flow */
+        if (vr_flow_table_inet6(ft))
+            return -EINVAL;
+
         if (((unsigned int)req->fr_mir_id >= router->vr_max_mirror_indices) &&
                 (unsigned int)req->fr_sec_mir_id >= router->vr_max_mirror_indices)
             return -EINVAL;
     }
 
     if (req->fr_flags & VR_RFLOW_VALID) {
-        rfe = vr_get_flow_entry(router, req->fr_rindex);
+        rfe = vr_flow_table_entry(ft, req->fr_rindex);
         if (!rfe)
             return -EINVAL;
     }
@@ -978,58 +2227,79 @@ vr_flow_req_is_invalid(struct vrouter *router, vr_flow_req *req,
     return 0;
 }
 
+/*
+ * the transition of a flow that is part of a batch is recorded in the
+ * batch's 'flmd', and is flushed along with the rest of the batch
+ */
 static int
-vr_flow_schedule_transition(struct vrouter *router, vr_flow_req *req,
-        struct vr_flow_entry *fe)
+vr_flow_schedule_transition(struct vrouter *router, struct vr_flow_table *ft,
+        vr_flow_req *req, struct vr_flow_entry *fe, struct vr_flow_md *flmd)
 {
-    struct vr_flow_md *flmd = NULL;
+    bool batched = (flmd != NULL);
 
-    flmd = (struct vr_flow_md *)vr_malloc(sizeof(*flmd));
-    if (!flmd)
-        return -ENOMEM;
+    if (!flmd) {
+        flmd = (struct vr_flow_md *)vr_malloc(sizeof(*flmd));
+        if (!flmd)
+            return -ENOMEM;
+    }
 
     flmd->flmd_router = router;
     flmd->flmd_index = req->fr_index;
     flmd->flmd_action = req->fr_action;
     flmd->flmd_flags = req->fr_flags;
+    flmd->flmd_family = ft->vft_family;
+    memset(&flmd->flmd_key, 0, sizeof(flmd->flmd_key));
+    vr_flow_key_get(ft, fe, &flmd->flmd_key);
+
+    if (!batched)
+        vr_schedule_work(vr_get_cpu(), vr_flow_flush, (void *)flmd);
 
-    vr_schedule_work(vr_get_cpu(), vr_flow_flush, (void *)flmd);
     return 0;
 }
 
 static int
-vr_flow_delete(struct vrouter *router, vr_flow_req *req,
-        struct vr_flow_entry *fe)
+vr_flow_delete(struct vrouter *router, struct vr_flow_table *ft,
+        vr_flow_req *req, struct vr_flow_entry *fe, struct vr_flow_md *flmd)
 {
     fe->fe_action = VR_FLOW_ACTION_DROP;
     vr_flow_reset_mirror(router, fe, req->fr_index);
 
-    return vr_flow_schedule_transition(router, req, fe);
+    return vr_flow_schedule_transition(router, ft, req, fe, flmd);
 }
 
 
 /* command from agent */
 static int
-vr_flow_set(struct vrouter *router, vr_flow_req *req)
+vr_flow_set(struct vrouter *router, vr_flow_req *req, struct vr_flow_md *flmd)
 {
     int ret;
+    bool claimed;
     unsigned int fe_index;
     struct vr_flow_entry *fe = NULL;
+    struct vr_flow_table *ft;
     struct vr_flow_table_info *infop = router->vr_flow_table_info;
 
     router = vrouter_get(req->fr_rid);
     if (!router)
         return -EINVAL;
 
-    fe = vr_get_flow_entry(router, req->fr_index);
+    ft = vr_flow_req_table(router, req);
+    if (!ft)
+        return -EINVAL;
+
+    fe = vr_flow_req_claim_entry(router, ft, req, &claimed);
 
-    if ((ret = vr_flow_req_is_invalid(router, req, fe)))
+    if ((ret = vr_flow_req_is_invalid(router, ft, req, fe))) {
+        vr_flow_req_release_entry(fe, claimed);
         return ret;
+    }
 
     if (fe && (fe->fe_action == VR_FLOW_ACTION_HOLD) &&
             ((req->fr_action != fe->fe_action) ||
              !(req->fr_flags & VR_FLOW_FLAG_ACTIVE)))
-        __sync_fetch_and_add(&infop->vfti_action_count, 1);
+        /* uncontended, but the agent can run on more than one thread */
+        __sync_fetch_and_add(
+                &infop->vfti_cpu_info[vr_get_cpu()].vfci_action_count, 1);
     /* 
      * for delete, absence of the requested flow entry is caustic. so
      * handle that case first
@@ -1037,7 +2307,9 @@ vr_flow_set(struct vrouter *router, vr_flow_req *req)
     if (!(req->fr_flags & VR_FLOW_FLAG_ACTIVE)) {
         if (!fe)
             return -EINVAL;
-        return vr_flow_delete(router, req, fe);
+        ret = vr_flow_delete(router, ft, req, fe, flmd);
+        vr_flow_req_release_entry(fe, claimed);
+        return ret;
     }
 
 
@@ -1046,8 +2318,11 @@ vr_flow_set(struct vrouter *router, vr_flow_req *req)
      * new flow entry with the key specified in the request
      */
     if (!fe) {
-        fe = vr_add_flow_req(req, &fe_index);
-        if (!fe)
+        if (!vr_add_flow_req(ft, req, &fe_index))
+            return -ENOSPC;
+
+        fe = vr_flow_req_claim_entry(router, ft, req, &claimed);
+        if (!claimed)
             return -ENOSPC;
     }
 
@@ -1066,10 +2341,367 @@ vr_flow_set(struct vrouter *router, vr_flow_req *req)
     fe->fe_ecmp_nh_index = req->fr_ecmp_nh_index;
     fe->fe_src_nh_index = req->fr_src_nh_index;
     fe->fe_action = req->fr_action;
-    fe->fe_flags = req->fr_flags; 
+    vr_flow_fwd_invalidate(fe);
+    /* which also releases the claim on the entry */
+    __sync_synchronize();
+    fe->fe_flags = req->fr_flags & ~VR_FLOW_FLAG_RELOCATE;
+
 
+    return vr_flow_schedule_transition(router, ft, req, fe, flmd);
+}
 
-    return vr_flow_schedule_transition(router, req, fe);
+static void
+vr_flow_batch_req_get(vr_flow_req *req, unsigned int i, vr_flow_req *freq)
+{
+    memset(freq, 0, sizeof(*freq));
+
+    freq->fr_op = FLOW_OP_FLOW_SET;
+    freq->fr_rid = req->fr_rid;
+    freq->fr_ftable_gen = req->fr_ftable_gen;
+    freq->fr_index = req->fr_batch_index[i];
+    freq->fr_action = req->fr_batch_action[i];
+    freq->fr_flags = req->fr_batch_flags[i];
+    freq->fr_rindex = req->fr_batch_rindex[i];
+    freq->fr_flow_sip = req->fr_batch_sip[i];
+    freq->fr_flow_dip = req->fr_batch_dip[i];
+    freq->fr_flow_sport = req->fr_batch_sport[i];
+    freq->fr_flow_dport = req->fr_batch_dport[i];
+    freq->fr_flow_proto = req->fr_batch_proto[i];
+    freq->fr_flow_vrf = req->fr_batch_vrf[i];
+    freq->fr_flow_dvrf = req->fr_batch_dvrf[i];
+    freq->fr_ecmp_nh_index = req->fr_batch_ecmp_nh_index[i];
+    freq->fr_src_nh_index = req->fr_batch_src_nh_index[i];
+
+    return;
+}
+
+/*
+ * a batch carries flow set requests in parallel lists, an element per
+ * flow, and is applied in one pass. the transitions of all the flows are
+ * flushed from one work item, and the response carries a status per flow
+ * in fr_batch_status: the index of the flow on success, and the error
+ * otherwise. flows that need mirroring have to be set individually.
+ */
+static int
+vr_flow_batch_set(struct vrouter *router, vr_flow_req *req)
+{
+    int ret;
+    unsigned int i, count, flushes = 0;
+    vr_flow_req freq;
+    struct vr_flow_batch_md *fbmd;
+
+    count = req->fr_batch_index_size;
+    if (!count || count > VR_FLOW_MAX_BATCH)
+        return -EINVAL;
+
+    if (req->fr_batch_action_size != count ||
+            req->fr_batch_flags_size != count ||
+            req->fr_batch_rindex_size != count ||
+            req->fr_batch_sip_size != count ||
+            req->fr_batch_dip_size != count ||
+            req->fr_batch_sport_size != count ||
+            req->fr_batch_dport_size != count ||
+            req->fr_batch_proto_size != count ||
+            req->fr_batch_vrf_size != count ||
+            req->fr_batch_dvrf_size != count ||
+            req->fr_batch_ecmp_nh_index_size != count ||
+            req->fr_batch_src_nh_index_size != count)
+        return -EINVAL;
+
+    req->fr_batch_status = vr_zalloc(count * sizeof(*req->fr_batch_status));
+    if (!req->fr_batch_status)
+        return -ENOMEM;
+    req->fr_batch_status_size = count;
+
+    fbmd = vr_malloc(sizeof(*fbmd) + count * sizeof(struct vr_flow_md));
+    if (!fbmd)
+        return -ENOMEM;
+
+    for (i = 0; i < count; i++) {
+        vr_flow_batch_req_get(req, i, &freq);
+        if (freq.fr_flags & VR_FLOW_FLAG_MIRROR) {
+            req->fr_batch_status[i] = -EINVAL;
+            continue;
+        }
+
+        ret = vr_flow_set(router, &freq, &fbmd->fbmd_md[flushes]);
+        if (ret) {
+            req->fr_batch_status[i] = ret;
+            continue;
+        }
+
+        req->fr_batch_status[i] = freq.fr_index;
+        flushes++;
+    }
+
+    if (!flushes) {
+        vr_free(fbmd);
+        return 0;
+    }
+
+    fbmd->fbmd_count = flushes;
+    vr_schedule_work(vr_get_cpu(), vr_flow_batch_flush, (void *)fbmd);
+
+    return 0;
+}
+
+static void
+vr_flow_table_free(struct vr_flow_table *ft)
+{
+    if (!ft)
+        return;
+
+    if (ft->vft_table)
+        vr_btable_free(ft->vft_table);
+    if (ft->vft_otable)
+        vr_btable_free(ft->vft_otable);
+    if (ft->vft_tags)
+        vr_btable_free(ft->vft_tags);
+    vr_free(ft);
+
+    return;
+}
+
+static struct vr_flow_table *
+vr_flow_table_alloc(unsigned short family, unsigned int entries,
+        unsigned int oentries)
+{
+    struct vr_flow_table *ft;
+
+    ft = vr_zalloc(sizeof(*ft));
+    if (!ft)
+        return NULL;
+
+    ft->vft_family = family;
+    if (family == AF_INET6)
+        ft->vft_entry_size = sizeof(struct vr_flow6_entry);
+    else
+        ft->vft_entry_size = sizeof(struct vr_flow_entry);
+
+    ft->vft_entries = entries;
+    ft->vft_oentries = oentries;
+    vr_geometry_init(&ft->vft_buckets, entries / VR_FLOW_ENTRIES_PER_BUCKET);
+    vr_geometry_init(&ft->vft_obuckets, oentries / VR_FLOW_ENTRIES_PER_BUCKET);
+
+    ft->vft_table = vr_btable_alloc_huge(entries, ft->vft_entry_size);
+    if (!ft->vft_table)
+        goto fail;
+
+    ft->vft_otable = vr_btable_alloc_huge(oentries, ft->vft_entry_size);
+    if (!ft->vft_otable)
+        goto fail;
+
+    ft->vft_tags = vr_btable_alloc_huge((entries + oentries) /
+            VR_FLOW_ENTRIES_PER_BUCKET, sizeof(uint64_t));
+    if (!ft->vft_tags)
+        goto fail;
+
+    return ft;
+
+fail:
+    vr_flow_table_free(ft);
+    return NULL;
+}
+
+/*
+ * frees the table that was migrated from. packets that are still held
+ * there - in entries that could not be migrated - are dropped
+ */
+static void
+vr_flow_migration_destroy(struct vrouter *router,
+        struct vr_flow_migration *vfm)
+{
+    unsigned int i, end;
+    struct vr_flow_entry *ofe;
+    struct vr_forwarding_md fmd;
+    struct vr_flow_md flmd;
+
+    vr_init_forwarding_md(&fmd);
+    flmd.flmd_action = VR_FLOW_ACTION_DROP;
+
+    end = vfm->vfm_table->vft_entries + vfm->vfm_table->vft_oentries;
+    for (i = 0; i < end; i++) {
+        ofe = vr_flow_table_entry(vfm->vfm_table, i);
+        if (ofe && ofe->fe_hold_list.node_p) {
+            flmd.flmd_index = i;
+            flmd.flmd_flags = ofe->fe_flags;
+            ofe->fe_action = VR_FLOW_ACTION_DROP;
+            vr_flush_entry(router, vfm->vfm_table, ofe, &flmd, &fmd);
+        }
+    }
+
+    vr_flow_table_free(vfm->vfm_table);
+    if (vfm->vfm_map)
+        vr_btable_free(vfm->vfm_map);
+    vr_free(vfm);
+
+    return;
+}
+
+static void
+vr_flow_migrate_work(void *arg)
+{
+    unsigned int i, end;
+    struct vr_flow_entry *ofe;
+    struct vrouter *router = (struct vrouter *)arg;
+    struct vr_flow_migration *vfm = router->vr_flow_migration;
+
+    if (!vfm)
+        return;
+
+    end = vfm->vfm_table->vft_entries + vfm->vfm_table->vft_oentries;
+    for (i = 0; i < VR_FLOW_MIGRATE_ENTRIES && vfm->vfm_next < end;
+            i++, vfm->vfm_next++) {
+        ofe = vr_flow_table_entry(vfm->vfm_table, vfm->vfm_next);
+        if (ofe)
+            (void)vr_flow_migrate_entry(router, vfm, ofe, vfm->vfm_next);
+    }
+
+    if (vfm->vfm_next < end) {
+        vr_schedule_work(vr_get_cpu(), vr_flow_migrate_work, arg);
+        return;
+    }
+
+    router->vr_flow_migration = NULL;
+    /* wait for the lookups that could still be in the old table */
+    vr_delay_op();
+    vr_flow_migration_destroy(router, vfm);
+
+    return;
+}
+
+/*
+ * grows the flow table to 'entries' and 'oentries'. the new table is in
+ * use once this returns, and the flows are migrated to it in the
+ * background. the generation of the table changes, and hence agent has to
+ * map the table again, and refer to the flows by their new indices.
+ */
+static int
+vr_flow_table_resize(struct vrouter *router, unsigned int entries,
+        unsigned int oentries)
+{
+    unsigned int i, end;
+    struct vr_flow_entry *ofe;
+    struct vr_flow_table *ft, *oft = router->vr_flow_table;
+    struct vr_flow_migration *vfm;
+
+    if (router->vr_flow_migration)
+        return -EBUSY;
+
+    if ((entries < oft->vft_entries) || (oentries < oft->vft_oentries) ||
+            (entries % VR_FLOW_ENTRIES_PER_BUCKET) ||
+            (oentries % VR_FLOW_ENTRIES_PER_BUCKET))
+        return -EINVAL;
+
+    if ((entries == oft->vft_entries) && (oentries == oft->vft_oentries))
+        return 0;
+
+    vfm = vr_zalloc(sizeof(*vfm));
+    if (!vfm)
+        return -ENOMEM;
+
+    end = oft->vft_entries + oft->vft_oentries;
+    vfm->vfm_table = oft;
+    vfm->vfm_map = vr_btable_alloc(end, sizeof(unsigned int));
+    if (!vfm->vfm_map) {
+        vr_free(vfm);
+        return -ENOMEM;
+    }
+
+    ft = vr_flow_table_alloc(AF_INET, entries, oentries);
+    if (!ft) {
+        vr_btable_free(vfm->vfm_map);
+        vr_free(vfm);
+        return -ENOMEM;
+    }
+
+    /* mirror meta data is kept by flow index, and can not follow the flow */
+    for (i = 0; i < end; i++) {
+        ofe = vr_flow_table_entry(oft, i);
+        if (ofe && (ofe->fe_flags & VR_FLOW_FLAG_MIRROR))
+            vr_flow_reset_mirror(router, ofe, i);
+    }
+
+    router->vr_flow_migration = vfm;
+    __sync_synchronize();
+    router->vr_flow_table = ft;
+    router->vr_flow_table_gen++;
+    vr_flow_entries = entries;
+    vr_oflow_entries = oentries;
+    vr_flow_aged_log_reset(router, AF_INET);
+
+    /*
+     * the pages of the old table that agent has mapped are taken away
+     * before the table can be freed, and agent maps the new one
+     */
+    if (vr_flow_table_unmap)
+        vr_flow_table_unmap(router);
+
+    /* inserts that were in the old table are complete after this */
+    vr_delay_op();
+    vr_schedule_work(vr_get_cpu(), vr_flow_migrate_work, (void *)router);
+
+    return 0;
+}
+
+static void
+vr_flow_batch_put(vr_flow_req *req)
+{
+    vr_free(req->fr_batch_index);
+    vr_free(req->fr_batch_action);
+    vr_free(req->fr_batch_flags);
+    vr_free(req->fr_batch_rindex);
+    vr_free(req->fr_batch_sip);
+    vr_free(req->fr_batch_dip);
+    vr_free(req->fr_batch_sport);
+    vr_free(req->fr_batch_dport);
+    vr_free(req->fr_batch_proto);
+    vr_free(req->fr_batch_vrf);
+    vr_free(req->fr_batch_dvrf);
+    vr_free(req->fr_batch_ecmp_nh_index);
+    vr_free(req->fr_batch_src_nh_index);
+
+    req->fr_batch_index = NULL;
+    req->fr_batch_action = NULL;
+    req->fr_batch_flags = NULL;
+    req->fr_batch_rindex = NULL;
+    req->fr_batch_sip = req->fr_batch_dip = NULL;
+    req->fr_batch_sport = req->fr_batch_dport = NULL;
+    req->fr_batch_proto = NULL;
+    req->fr_batch_vrf = req->fr_batch_dvrf = NULL;
+    req->fr_batch_ecmp_nh_index = NULL;
+    req->fr_batch_src_nh_index = NULL;
+
+    req->fr_batch_index_size = req->fr_batch_action_size =
+        req->fr_batch_flags_size = req->fr_batch_rindex_size =
+        req->fr_batch_sip_size = req->fr_batch_dip_size =
+        req->fr_batch_sport_size = req->fr_batch_dport_size =
+        req->fr_batch_proto_size = req->fr_batch_vrf_size =
+        req->fr_batch_dvrf_size = req->fr_batch_ecmp_nh_index_size =
+        req->fr_batch_src_nh_index_size = 0;
+
+    return;
+}
+
+/*
+ * room that the lists of the request need in the response: the status of
+ * each flow of a batch, whose own lists are dropped before the response,
+ * or the lists of the aged flows
+ */
+unsigned int
+vr_flow_req_get_size(void *s_req)
+{
+    vr_flow_req *req = (vr_flow_req *)s_req;
+
+    return req->fr_batch_index_size * sizeof(*req->fr_batch_index) +
+        req->fr_batch_sip_size * sizeof(*req->fr_batch_sip) +
+        req->fr_batch_dip_size * sizeof(*req->fr_batch_dip) +
+        req->fr_batch_sport_size * sizeof(*req->fr_batch_sport) +
+        req->fr_batch_dport_size * sizeof(*req->fr_batch_dport) +
+        req->fr_batch_proto_size * sizeof(*req->fr_batch_proto) +
+        req->fr_batch_vrf_size * sizeof(*req->fr_batch_vrf) +
+        req->fr_batch_status_size * sizeof(*req->fr_batch_status) +
+        req->fr_flow_sip6_size + req->fr_flow_dip6_size;
 }
 
 /*
@@ -1084,16 +2716,57 @@ vr_flow_req_process(void *s_req)
 
     router = vrouter_get(req->fr_rid);
     switch (req->fr_op) {
+    case FLOW_OP_FLOW_TABLE_RESIZE:
+        ret = vr_flow_table_resize(router, req->fr_ftable_entries,
+                req->fr_oftable_entries);
+        if (ret)
+            break;
+        /* fall through */
+
     case FLOW_OP_FLOW_TABLE_GET:
+        req->fr_ftable_gen = router->vr_flow_table_gen;
+        req->fr_ftable_entries = vr_flow_entries;
+        req->fr_oftable_entries = vr_oflow_entries;
         req->fr_ftable_size = vr_flow_table_size(router) +
             vr_oflow_table_size(router);
+        req->fr_oflow_relocations =
+            router->vr_flow_table_info->vfti_oflow_relocations;
+        req->fr_aged_flows = router->vr_flow_table_info->vfti_aged_flows;
+        req->fr_aged_log_full =
+            router->vr_flow_table_info->vfti_aged_log_full;
+        /* the inet6 table is mapped from where fr_ftable_size ends */
+        if (router->vr_flow6_table) {
+            req->fr_ftable6_entries = router->vr_flow6_table->vft_entries;
+            req->fr_oftable6_entries = router->vr_flow6_table->vft_oentries;
+        }
 #ifdef __KERNEL__
         req->fr_ftable_dev = vr_flow_major;
 #endif
         break;
 
     case FLOW_OP_FLOW_SET:
-        ret = vr_flow_set(router, req);
+        /* the indices in the request are of a table that is no more */
+        if ((unsigned int)req->fr_ftable_gen != router->vr_flow_table_gen) {
+            ret = -ESTALE;
+            break;
+        }
+
+        ret = vr_flow_set(router, req, NULL);
+        break;
+
+    case FLOW_OP_FLOW_BATCH_SET:
+        if ((unsigned int)req->fr_ftable_gen != router->vr_flow_table_gen) {
+            ret = -ESTALE;
+            break;
+        }
+
+        ret = vr_flow_batch_set(router, req);
+        /* agent has the lists already, and needs only the status back */
+        vr_flow_batch_put(req);
+        break;
+
+    case FLOW_OP_FLOW_AGED_GET:
+        ret = vr_flow_aged_get(router, req);
         break;
 
     default:
@@ -1101,6 +2774,16 @@ vr_flow_req_process(void *s_req)
     }
 
     vr_message_response(VR_FLOW_OBJECT_ID, req, ret);
+
+    if (req->fr_batch_status) {
+        vr_free(req->fr_batch_status);
+        req->fr_batch_status = NULL;
+        req->fr_batch_status_size = 0;
+    }
+
+    if (req->fr_op == FLOW_OP_FLOW_AGED_GET)
+        vr_flow_aged_put(req);
+
     return;
 }
 
@@ -1136,7 +2819,8 @@ vr_flow_table_info_init(struct vrouter *router)
     if (router->vr_flow_table_info)
         return 0;
 
-    size = sizeof(struct vr_flow_table_info) + sizeof(uint32_t) * vr_num_cpus;
+    size = sizeof(struct vr_flow_table_info) +
+        sizeof(struct vr_flow_cpu_info) * vr_num_cpus;
     infop = (struct vr_flow_table_info *)vr_zalloc(size);
     if (!infop)
         return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, size);
@@ -1147,17 +2831,453 @@ vr_flow_table_info_init(struct vrouter *router)
     return 0;
 }
 
+/*
+ * datapath flow aging. a packet that hits a flow stamps the entry with the
+ * time kept by the scanner, and the scanner visits a slice of the table
+ * every tick, sized such that the whole table is covered in half the idle
+ * timeout. flows that have been idle for the timeout are evicted, with
+ * the number of evictions accounted once per tick. a flow is evicted
+ * only if its reverse flow is idle too, and then the two go together.
+ *
+ * the index and the key of every evicted flow are logged, per table, for
+ * agent to collect in batches with FLOW_AGED_GET and to forget the flows
+ * by. a flow is evicted only if the log has room for it, and hence agent
+ * learns of every eviction, and aging stalls for as long as agent does not
+ * collect.
+ */
+#define VR_FLOW_AGING_SCAN_MSECS    100
+#define VR_FLOW_AGING_MIN_SCAN      64
+/* the stamps are 16 bit seconds, and hence the timeout has to be below */
+#define VR_FLOW_MAX_IDLE_TIMEOUT    0x7FFF
+
+#define VR_FLOW_AGED_LOG_ENTRIES    512U
+
+/* in seconds. 0 leaves aging to agent */
+unsigned int vr_flow_idle_timeout;
+
+struct vr_flow_aged {
+    unsigned int fa_index;
+    /* only key6_key, for an inet flow */
+    struct vr_flow6_key fa_key;
+};
+
+/*
+ * written only by the scanner, at fal_tail. readers take what is between
+ * fal_head and fal_tail, and move fal_head past it if no other reader has
+ * done so meanwhile
+ */
+struct vr_flow_aged_log {
+    unsigned int fal_head;
+    unsigned int fal_tail;
+    struct vr_flow_aged fal_flows[VR_FLOW_AGED_LOG_ENTRIES];
+};
+
+struct vr_flow_aging_params {
+    struct vrouter *fap_router;
+    /* ticks in which the whole table is to be visited */
+    unsigned int fap_ticks;
+    unsigned int fap_next_entry;
+    /* of the inet6 table */
+    unsigned int fap_next_entry6;
+    struct vr_flow_aged_log fap_log;
+    struct vr_flow_aged_log fap_log6;
+};
+
+static struct vr_flow_aged_log *
+vr_flow_aged_log(struct vrouter *router, unsigned short family)
+{
+    struct vr_flow_aging_params *fap;
+
+    if (!router->vr_flow_aging_scanner)
+        return NULL;
+
+    fap = (struct vr_flow_aging_params *)
+        router->vr_flow_aging_scanner->vt_vr_arg;
+    if (family == AF_INET6)
+        return &fap->fap_log6;
+
+    return &fap->fap_log;
+}
+
+static inline unsigned int
+vr_flow_aged_log_room(struct vr_flow_aged_log *log)
+{
+    return VR_FLOW_AGED_LOG_ENTRIES -
+        (log->fal_tail - *(volatile unsigned int *)&log->fal_head);
+}
+
+static void
+vr_flow_aged_log_add(struct vr_flow_table *ft, struct vr_flow_aged_log *log,
+        struct vr_flow_entry *fe, unsigned int index)
+{
+    struct vr_flow_aged *fa;
+
+    fa = &log->fal_flows[log->fal_tail % VR_FLOW_AGED_LOG_ENTRIES];
+    fa->fa_index = index;
+    memset(&fa->fa_key, 0, sizeof(fa->fa_key));
+    vr_flow_key_get(ft, fe, &fa->fa_key);
+
+    /* readers take the entry once the tail is past it */
+    __sync_synchronize();
+    log->fal_tail++;
+
+    return;
+}
+
+/*
+ * the indices in the log are of a table that has been replaced, and the
+ * flows that agent has not collected are to be learnt by it from the new
+ * table, as are all the others
+ */
+static void
+vr_flow_aged_log_reset(struct vrouter *router, unsigned short family)
+{
+    unsigned int head;
+    struct vr_flow_aged_log *log;
+
+    log = vr_flow_aged_log(router, family);
+    if (!log)
+        return;
+
+    do {
+        head = log->fal_head;
+    } while (!__sync_bool_compare_and_swap(&log->fal_head, head,
+                *(volatile unsigned int *)&log->fal_tail));
+
+    return;
+}
+
+/*
+ * the flows that the scanner evicted from the table of fr_family, oldest
+ * first, in the fr_batch_ lists of the response: the index, and the key,
+ * with the addresses of an inet6 flow in fr_flow_sip6 and fr_flow_dip6, 16
+ * bytes a flow. the flows are taken off the log
+ */
+static int
+vr_flow_aged_get(struct vrouter *router, vr_flow_req *req)
+{
+    unsigned int i, head, count, len;
+    struct vr_flow_aged *fa;
+    struct vr_flow_aged_log *log;
+
+    log = vr_flow_aged_log(router, req->fr_family);
+    if (!log)
+        return 0;
+
+    len = VR_FLOW_AGED_LOG_ENTRIES;
+    req->fr_batch_index = vr_zalloc(len * sizeof(*req->fr_batch_index));
+    req->fr_batch_sip = vr_zalloc(len * sizeof(*req->fr_batch_sip));
+    req->fr_batch_dip = vr_zalloc(len * sizeof(*req->fr_batch_dip));
+    req->fr_batch_sport = vr_zalloc(len * sizeof(*req->fr_batch_sport));
+    req->fr_batch_dport = vr_zalloc(len * sizeof(*req->fr_batch_dport));
+    req->fr_batch_proto = vr_zalloc(len * sizeof(*req->fr_batch_proto));
+    req->fr_batch_vrf = vr_zalloc(len * sizeof(*req->fr_batch_vrf));
+    if (!req->fr_batch_index || !req->fr_batch_sip || !req->fr_batch_dip ||
+            !req->fr_batch_sport || !req->fr_batch_dport ||
+            !req->fr_batch_proto || !req->fr_batch_vrf)
+        return -ENOMEM;
+
+    if (req->fr_family == AF_INET6) {
+        len *= VR_IP6_ADDRESS_LEN;
+        req->fr_flow_sip6 = vr_zalloc(len);
+        req->fr_flow_dip6 = vr_zalloc(len);
+        if (!req->fr_flow_sip6 || !req->fr_flow_dip6)
+            return -ENOMEM;
+    }
+
+    do {
+        head = log->fal_head;
+        count = *(volatile unsigned int *)&log->fal_tail - head;
+        /* head may have moved already, in which case we go around again */
+        if (count > VR_FLOW_AGED_LOG_ENTRIES)
+            count = VR_FLOW_AGED_LOG_ENTRIES;
+        __sync_synchronize();
+
+        for (i = 0; i < count; i++) {
+            fa = &log->fal_flows[(head + i) % VR_FLOW_AGED_LOG_ENTRIES];
+            req->fr_batch_index[i] = fa->fa_index;
+            req->fr_batch_sip[i] = fa->fa_key.key6_key.key_src_ip;
+            req->fr_batch_dip[i] = fa->fa_key.key6_key.key_dest_ip;
+            req->fr_batch_sport[i] = fa->fa_key.key6_key.key_src_port;
+            req->fr_batch_dport[i] = fa->fa_key.key6_key.key_dst_port;
+            req->fr_batch_proto[i] = fa->fa_key.key6_key.key_proto;
+            req->fr_batch_vrf[i] = fa->fa_key.key6_key.key_vrf_id;
+            if (req->fr_family == AF_INET6) {
+                memcpy(&req->fr_flow_sip6[i * VR_IP6_ADDRESS_LEN],
+                        fa->fa_key.key6_src_ip, VR_IP6_ADDRESS_LEN);
+                memcpy(&req->fr_flow_dip6[i * VR_IP6_ADDRESS_LEN],
+                        fa->fa_key.key6_dest_ip, VR_IP6_ADDRESS_LEN);
+            }
+        }
+
+        /* the scanner does not reuse the entries until the head moves */
+        __sync_synchronize();
+    } while (!__sync_bool_compare_and_swap(&log->fal_head, head,
+                head + count));
+
+    req->fr_batch_index_size = req->fr_batch_sip_size =
+        req->fr_batch_dip_size = req->fr_batch_sport_size =
+        req->fr_batch_dport_size = req->fr_batch_proto_size =
+        req->fr_batch_vrf_size = count;
+    if (req->fr_family == AF_INET6)
+        req->fr_flow_sip6_size = req->fr_flow_dip6_size =
+            count * VR_IP6_ADDRESS_LEN;
+    req->fr_ftable_gen = router->vr_flow_table_gen;
+
+    return 0;
+}
+
+static void
+vr_flow_aged_put(vr_flow_req *req)
+{
+    vr_free(req->fr_batch_index);
+    vr_free(req->fr_batch_sip);
+    vr_free(req->fr_batch_dip);
+    vr_free(req->fr_batch_sport);
+    vr_free(req->fr_batch_dport);
+    vr_free(req->fr_batch_proto);
+    vr_free(req->fr_batch_vrf);
+    vr_free(req->fr_flow_sip6);
+    vr_free(req->fr_flow_dip6);
+
+    req->fr_batch_index = NULL;
+    req->fr_batch_sip = req->fr_batch_dip = NULL;
+    req->fr_batch_sport = req->fr_batch_dport = NULL;
+    req->fr_batch_proto = NULL;
+    req->fr_batch_vrf = NULL;
+    req->fr_flow_sip6 = req->fr_flow_dip6 = NULL;
+
+    req->fr_batch_index_size = req->fr_batch_sip_size =
+        req->fr_batch_dip_size = req->fr_batch_sport_size =
+        req->fr_batch_dport_size = req->fr_batch_proto_size =
+        req->fr_batch_vrf_size = 0;
+    req->fr_flow_sip6_size = req->fr_flow_dip6_size = 0;
+
+    return;
+}
+
+static inline bool
+vr_flow_is_idle(struct vr_flow_entry *fe, uint16_t now)
+{
+    if ((fe->fe_flags & (VR_FLOW_FLAG_ACTIVE | VR_FLOW_FLAG_RELOCATE)) !=
+            VR_FLOW_FLAG_ACTIVE)
+        return false;
+
+    if (fe->fe_action == VR_FLOW_ACTION_HOLD || fe->fe_hold_list.node_p)
+        return false;
+
+    return (uint16_t)(now - fe->fe_last_seen) >= vr_flow_idle_timeout;
+}
+
+/*
+ * keeps agent, the mover and the migration off an idle entry while it is
+ * logged and reset. the entry stays active, so that the datapath does not
+ * take the slot for a new flow midway, and the reset ends the claim
+ */
+static bool
+vr_flow_age_claim(struct vr_flow_entry *fe, uint16_t now)
+{
+    unsigned short flags = vr_flow_flags(fe);
+
+    if (!vr_flow_is_idle(fe, now))
+        return false;
+
+    if (!__sync_bool_compare_and_swap(&fe->fe_flags, flags,
+                flags | VR_FLOW_FLAG_RELOCATE))
+        return false;
+
+    /* a packet or a hold could have come in before the claim */
+    if (fe->fe_action == VR_FLOW_ACTION_HOLD || fe->fe_hold_list.node_p ||
+            (uint16_t)(now - fe->fe_last_seen) < vr_flow_idle_timeout) {
+        (void)__sync_and_and_fetch(&fe->fe_flags, ~VR_FLOW_FLAG_RELOCATE);
+        return false;
+    }
+
+    return true;
+}
+
+static unsigned int
+vr_flow_age_entry(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_aged_log *log, struct vr_flow_entry *fe,
+        unsigned int index, uint16_t now)
+{
+    unsigned int rindex;
+    struct vr_flow_entry *rfe = NULL;
+
+    if (!vr_flow_is_idle(fe, now))
+        return 0;
+
+    /*
+     * the flow and its reverse go together, and are logged together. the
+     * flows that agent is too slow to collect stay where they are, and are
+     * counted, so that it can be seen
+     */
+    if (vr_flow_aged_log_room(log) < 2) {
+        (void)__sync_add_and_fetch(
+                &router->vr_flow_table_info->vfti_aged_log_full, 1);
+        return 0;
+    }
+
+    if (!vr_flow_age_claim(fe, now))
+        return 0;
+
+    if (fe->fe_flags & VR_RFLOW_VALID) {
+        rindex = fe->fe_rflow;
+        rfe = vr_flow_table_entry(ft, rindex);
+        if (rfe) {
+            if ((rfe == fe) || (rfe->fe_rflow != (int)index)) {
+                rfe = NULL;
+            } else if (!vr_flow_age_claim(rfe, now)) {
+                (void)__sync_and_and_fetch(&fe->fe_flags,
+                        ~VR_FLOW_FLAG_RELOCATE);
+                return 0;
+            }
+        }
+    }
+
+    vr_flow_aged_log_add(ft, log, fe, index);
+    vr_reset_flow_entry(router, ft, fe, index);
+    if (!rfe)
+        return 1;
+
+    vr_flow_aged_log_add(ft, log, rfe, rindex);
+    vr_reset_flow_entry(router, ft, rfe, rindex);
+    return 2;
+}
+
+/* visits the slice of 'ft' that starts at 'next', and moves 'next' past it */
+static unsigned int
+vr_flow_age_table(struct vrouter *router, struct vr_flow_table *ft,
+        struct vr_flow_aged_log *log, unsigned int ticks, unsigned int *next,
+        uint16_t now)
+{
+    unsigned int i, index, aged = 0;
+    unsigned int num_entries, entries_per_scan;
+    struct vr_flow_entry *fe;
+
+    /* the table can be resized, and hence the slice is sized every tick */
+    num_entries = ft->vft_entries + ft->vft_oentries;
+    entries_per_scan = (num_entries + ticks - 1) / ticks;
+    if (entries_per_scan < VR_FLOW_AGING_MIN_SCAN)
+        entries_per_scan = VR_FLOW_AGING_MIN_SCAN;
+
+    index = *next;
+    for (i = 0; i < entries_per_scan; i++, index++) {
+        if (index >= num_entries)
+            index = 0;
+
+        fe = vr_flow_table_entry(ft, index);
+        if (fe)
+            aged += vr_flow_age_entry(router, ft, log, fe, index, now);
+    }
+    *next = index;
+
+    return aged;
+}
+
+static void
+vr_flow_aging_scanner(void *arg)
+{
+    unsigned int sec, nsec, aged;
+    uint16_t now;
+    struct vr_flow_aging_params *fap = (struct vr_flow_aging_params *)arg;
+    struct vrouter *router = fap->fap_router;
+    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+
+    vr_get_mono_time(&sec, &nsec);
+    now = (uint16_t)sec;
+    infop->vfti_aging_time = now;
+
+    aged = vr_flow_age_table(router, router->vr_flow_table, &fap->fap_log,
+            fap->fap_ticks, &fap->fap_next_entry, now);
+    if (router->vr_flow6_table)
+        aged += vr_flow_age_table(router, router->vr_flow6_table,
+                &fap->fap_log6, fap->fap_ticks, &fap->fap_next_entry6, now);
+
+    if (aged)
+        (void)__sync_add_and_fetch(&infop->vfti_aged_flows, aged);
+
+    return;
+}
+
+static void
+vr_flow_aging_exit(struct vrouter *router)
+{
+    if (router->vr_flow_aging_scanner) {
+        vr_delete_timer(router->vr_flow_aging_scanner);
+        vr_free(router->vr_flow_aging_scanner->vt_vr_arg);
+        vr_free(router->vr_flow_aging_scanner);
+        router->vr_flow_aging_scanner = NULL;
+    }
+
+    return;
+}
+
+static int
+vr_flow_aging_init(struct vrouter *router)
+{
+    unsigned int sec, nsec, ticks;
+    struct vr_timer *vtimer;
+    struct vr_flow_aging_params *fap;
+
+    if (!vr_flow_idle_timeout || router->vr_flow_aging_scanner)
+        return 0;
+
+    if (vr_flow_idle_timeout > VR_FLOW_MAX_IDLE_TIMEOUT)
+        return vr_module_error(-EINVAL, __FUNCTION__, __LINE__,
+                vr_flow_idle_timeout);
+
+    vr_get_mono_time(&sec, &nsec);
+    router->vr_flow_table_info->vfti_aging_time = (uint16_t)sec;
+
+    fap = vr_zalloc(sizeof(*fap));
+    if (!fap)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                sizeof(*fap));
+
+    ticks = (vr_flow_idle_timeout * 1000 / 2) / VR_FLOW_AGING_SCAN_MSECS;
+    if (!ticks)
+        ticks = 1;
+
+    fap->fap_router = router;
+    fap->fap_ticks = ticks;
+
+    vtimer = vr_malloc(sizeof(*vtimer));
+    if (!vtimer) {
+        vr_free(fap);
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                sizeof(*vtimer));
+    }
+
+    vtimer->vt_timer = vr_flow_aging_scanner;
+    vtimer->vt_vr_arg = fap;
+    vtimer->vt_msecs = VR_FLOW_AGING_SCAN_MSECS;
+
+    if (vr_create_timer(vtimer)) {
+        vr_free(vtimer);
+        vr_free(fap);
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                vr_flow_idle_timeout);
+    }
+
+    router->vr_flow_aging_scanner = vtimer;
+
+    return 0;
+}
+
 static void
 vr_flow_table_destroy(struct vrouter *router)
 {
+    vr_flow_aging_exit(router);
+
     if (router->vr_flow_table) {
-        vr_btable_free(router->vr_flow_table);
+        vr_flow_table_free(router->vr_flow_table);
         router->vr_flow_table = NULL;
     }
 
-    if (router->vr_oflow_table) {
-        vr_btable_free(router->vr_oflow_table);
-        router->vr_oflow_table = NULL;
+    if (router->vr_flow6_table) {
+        vr_flow_table_free(router->vr_flow6_table);
+        router->vr_flow6_table = NULL;
     }
 
     vr_flow_table_info_destroy(router);
@@ -1166,38 +3286,49 @@ vr_flow_table_destroy(struct vrouter *router)
 }
 
 static void
-vr_flow_table_reset(struct vrouter *router)
+vr_flow_table_flush_all(struct vrouter *router, struct vr_flow_table *ft)
 {
-    unsigned int start, end, i;
+    unsigned int end, i;
     struct vr_flow_entry *fe;
     struct vr_forwarding_md fmd;
     struct vr_flow_md flmd;
 
-    start = end = 0;
-    if (router->vr_flow_table)
-        end = vr_btable_entries(router->vr_flow_table);
-
-    if (router->vr_oflow_table) {
-        if (!end)
-            start = vr_flow_entries;
-        end += vr_btable_entries(router->vr_oflow_table);
-    }
-
-    if (end) {
-        vr_init_forwarding_md(&fmd);
-        flmd.flmd_action = VR_FLOW_ACTION_DROP;
-        for (i = start; i < end; i++) {
-            fe = vr_get_flow_entry(router, i);
-            if (fe) {
-                flmd.flmd_index = i;
-                flmd.flmd_flags = fe->fe_flags;
-                fe->fe_action = VR_FLOW_ACTION_DROP;
-                vr_flush_entry(router, fe, &flmd, &fmd);
-                vr_reset_flow_entry(router, fe, i);
-            }
+    if (!ft)
+        return;
+
+    end = ft->vft_entries + ft->vft_oentries;
+
+    vr_init_forwarding_md(&fmd);
+    flmd.flmd_action = VR_FLOW_ACTION_DROP;
+    for (i = 0; i < end; i++) {
+        fe = vr_flow_table_entry(ft, i);
+        if (fe) {
+            flmd.flmd_index = i;
+            flmd.flmd_flags = fe->fe_flags;
+            fe->fe_action = VR_FLOW_ACTION_DROP;
+            vr_flush_entry(router, ft, fe, &flmd, &fmd);
+            vr_reset_flow_entry(router, ft, fe, i);
         }
     }
 
+    return;
+}
+
+static void
+vr_flow_table_reset(struct vrouter *router)
+{
+    struct vr_flow_migration *vfm = router->vr_flow_migration;
+
+    /* a migration that is in progress is abandoned */
+    if (vfm) {
+        router->vr_flow_migration = NULL;
+        vr_delay_op();
+        vr_flow_migration_destroy(router, vfm);
+    }
+
+    vr_flow_table_flush_all(router, router->vr_flow_table);
+    vr_flow_table_flush_all(router, router->vr_flow6_table);
+
     vr_flow_table_info_reset(router);
 
     return;
@@ -1207,29 +3338,53 @@ vr_flow_table_reset(struct vrouter *router)
 static int
 vr_flow_table_init(struct vrouter *router)
 {
+    int ret;
+
+    if (!vr_flow_queue_entries ||
+            (vr_flow_queue_entries > VR_MAX_FLOW_QUEUE_ENTRIES))
+        return vr_module_error(-EINVAL, __FUNCTION__,
+                __LINE__, vr_flow_queue_entries);
+
     if (!router->vr_flow_table) {
         if (vr_flow_entries % VR_FLOW_ENTRIES_PER_BUCKET)
             return vr_module_error(-EINVAL, __FUNCTION__,
                     __LINE__, vr_flow_entries);
 
-        router->vr_flow_table = vr_btable_alloc(vr_flow_entries,
-                sizeof(struct vr_flow_entry));
+        if (!vr_oflow_entries ||
+                (vr_oflow_entries % VR_FLOW_ENTRIES_PER_BUCKET))
+            return vr_module_error(-EINVAL, __FUNCTION__,
+                    __LINE__, vr_oflow_entries);
+
+        router->vr_flow_table = vr_flow_table_alloc(AF_INET,
+                vr_flow_entries, vr_oflow_entries);
         if (!router->vr_flow_table) {
             return vr_module_error(-ENOMEM, __FUNCTION__,
-                    __LINE__, VR_DEF_FLOW_ENTRIES);
+                    __LINE__, vr_flow_entries);
         }
     }
 
-    if (!router->vr_oflow_table) {
-        router->vr_oflow_table = vr_btable_alloc(vr_oflow_entries,
-                sizeof(struct vr_flow_entry));
-        if (!router->vr_oflow_table) {
+    if (!router->vr_flow6_table && vr_flow6_entries) {
+        if (vr_flow6_entries % VR_FLOW_ENTRIES_PER_BUCKET)
+            return vr_module_error(-EINVAL, __FUNCTION__,
+                    __LINE__, vr_flow6_entries);
+
+        if (!vr_oflow6_entries ||
+                (vr_oflow6_entries % VR_FLOW_ENTRIES_PER_BUCKET))
+            return vr_module_error(-EINVAL, __FUNCTION__,
+                    __LINE__, vr_oflow6_entries);
+
+        router->vr_flow6_table = vr_flow_table_alloc(AF_INET6,
+                vr_flow6_entries, vr_oflow6_entries);
+        if (!router->vr_flow6_table) {
             return vr_module_error(-ENOMEM, __FUNCTION__,
-                    __LINE__, VR_DEF_OFLOW_ENTRIES);
+                    __LINE__, vr_flow6_entries);
         }
     }
 
-    return vr_flow_table_info_init(router);
+    if ((ret = vr_flow_table_info_init(router)))
+        return ret;
+
+    return vr_flow_aging_init(router);
 }
 
 
@@ -299,7 +299,7 @@ vr_fragment_table_init(struct vrouter *router)
 
     if (!router->vr_fragment_table) {
         num_entries = FRAG_TABLE_ENTRIES * FRAG_TABLE_BUCKETS;
-        router->vr_fragment_table = vr_btable_alloc(num_entries,
+        router->vr_fragment_table = vr_btable_alloc_huge(num_entries,
                 sizeof(struct vr_fragment));
         if (!router->vr_fragment_table)
             return vr_module_error(-EINVAL, __FUNCTION__,
@@ -308,7 +308,7 @@ vr_fragment_table_init(struct vrouter *router)
 
     if (!router->vr_fragment_otable) {
         num_entries = FRAG_OTABLE_ENTRIES;
-        router->vr_fragment_otable = vr_btable_alloc(num_entries,
+        router->vr_fragment_otable = vr_btable_alloc_huge(num_entries,
                 sizeof(struct vr_fragment));
         if (!router->vr_fragment_otable)
             return vr_module_error(-EINVAL, __FUNCTION__,
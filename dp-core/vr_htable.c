@@ -4,6 +4,7 @@
 #include <vr_os.h>
 #include <vr_htable.h>
 #include <vr_btable.h>
+#include <vr_geometry.h>
 
 #define VR_HENTRIES_PER_BUCKET 4
 struct vr_htable {
@@ -14,8 +15,18 @@ struct vr_htable {
     struct vr_btable *htable;
     struct vr_btable *otable;
     is_hentry_valid is_valid_entry;
+    /* of the buckets of the hash table, and of the overflow table */
+    struct vr_geometry hgeo;
+    struct vr_geometry ogeo;
 };
 
+/* first entry of the bucket of 'hash' in the hash table */
+static inline unsigned int
+vr_htable_bucket(struct vr_htable *table, unsigned int hash)
+{
+    return vr_geometry_reduce(&table->hgeo, hash) * VR_HENTRIES_PER_BUCKET;
+}
+
 void 
 vr_htable_trav(vr_htable_t htable, unsigned int marker, htable_trav_cb cb, 
                                                                 void *data)
@@ -57,8 +68,7 @@ vr_find_free_hentry(vr_htable_t htable, void *key, unsigned int *index)
         return NULL;
 
     hash = vr_hash(key, table->key_size, 0);
-    tmp_hash = hash % table->hentries;
-    tmp_hash &= ~(VR_HENTRIES_PER_BUCKET - 1);
+    tmp_hash = vr_htable_bucket(table, hash);
     for(i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
         ind = tmp_hash + i;
         ent = vr_btable_get(table->htable, ind);
@@ -69,10 +79,11 @@ vr_find_free_hentry(vr_htable_t htable, void *key, unsigned int *index)
         }
     }
 
-    tmp_hash = hash % table->oentries;
+    tmp_hash = vr_geometry_reduce(&table->ogeo, hash);
     for(i = 0; i < table->oentries; i++) {
-        ent = vr_btable_get(table->otable, ((tmp_hash + i) % table->oentries));
-        ind = table->hentries + ((tmp_hash + i) % table->oentries);
+        ent = vr_btable_get(table->otable, tmp_hash);
+        ind = table->hentries + tmp_hash;
+        tmp_hash = vr_geometry_next(&table->ogeo, tmp_hash);
         if (table->is_valid_entry(htable, ent, ind) == false) {
             if (index)
                 *index = ind;
@@ -113,8 +124,7 @@ vr_find_duplicate_hentry_index(vr_htable_t htable, vr_hentry_t hentry)
     hash = vr_hash(hentry, table->key_size, 0);
 
     /* Look into the hash table from hash, VR_HENTRIES_PER_BUCKET */
-    tmp_hash = hash % table->hentries;
-    tmp_hash &= ~(VR_HENTRIES_PER_BUCKET - 1);
+    tmp_hash = vr_htable_bucket(table, hash);
     for(i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
         ind = tmp_hash + i;
         ent = vr_btable_get(table->htable, ind);
@@ -126,10 +136,11 @@ vr_find_duplicate_hentry_index(vr_htable_t htable, vr_hentry_t hentry)
     }
 
     /* Look into the complete over flow table starting from hash*/
-    tmp_hash = hash % table->oentries;
+    tmp_hash = vr_geometry_reduce(&table->ogeo, hash);
     for(i = 0; i < table->oentries; i++) {
-        ind = table->hentries + ((tmp_hash + i) % table->oentries);
-        ent = vr_btable_get(table->otable, ((tmp_hash + i) % table->oentries));
+        ind = table->hentries + tmp_hash;
+        ent = vr_btable_get(table->otable, tmp_hash);
+        tmp_hash = vr_geometry_next(&table->ogeo, tmp_hash);
         if (table->is_valid_entry(htable, ent, ind) == false)
             continue;
         if ((ent == hentry) || (memcmp(ent, hentry, table->key_size) != 0))
@@ -155,8 +166,7 @@ vr_find_hentry(vr_htable_t htable, void *key, unsigned int *index)
     hash = vr_hash(key, table->key_size, 0);
 
     /* Look into the hash table from hash, VR_HENTRIES_PER_BUCKET */
-    tmp_hash = hash % table->hentries;
-    tmp_hash &= ~(VR_HENTRIES_PER_BUCKET - 1);
+    tmp_hash = vr_htable_bucket(table, hash);
     for(i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
         ind = tmp_hash + i;
         ent = vr_btable_get(table->htable, ind);
@@ -170,10 +180,11 @@ vr_find_hentry(vr_htable_t htable, void *key, unsigned int *index)
     }
 
     /* Look into the complete over flow table starting from hash*/
-    tmp_hash = hash % table->oentries;
+    tmp_hash = vr_geometry_reduce(&table->ogeo, hash);
     for(i = 0; i < table->oentries; i++) {
-        ind = table->hentries + ((tmp_hash + i) % table->oentries);
-        ent = vr_btable_get(table->otable, ((tmp_hash + i) % table->oentries));
+        ind = table->hentries + tmp_hash;
+        ent = vr_btable_get(table->otable, tmp_hash);
+        tmp_hash = vr_geometry_next(&table->ogeo, tmp_hash);
         if (table->is_valid_entry(htable, ent, ind) == false)
             continue;
         if (memcmp(ent, key, table->key_size) == 0) {
@@ -227,13 +238,13 @@ vr_htable_create(unsigned int entries, unsigned int oentries,
         return NULL;
     }
     
-    table->htable = vr_btable_alloc(entries, entry_size);
+    table->htable = vr_btable_alloc_huge(entries, entry_size);
     if (!table->htable) {
         vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, entries);
         return NULL;
     }
 
-    table->otable = vr_btable_alloc(oentries, entry_size);
+    table->otable = vr_btable_alloc_huge(oentries, entry_size);
     if (!table->otable) {
         vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, oentries);
         return NULL;
@@ -241,6 +252,8 @@ vr_htable_create(unsigned int entries, unsigned int oentries,
 
     table->hentries = entries;
     table->oentries = oentries;
+    vr_geometry_init(&table->hgeo, entries / VR_HENTRIES_PER_BUCKET);
+    vr_geometry_init(&table->ogeo, oentries);
     table->entry_size = entry_size;
     /* Key is assumed to be at the start of the entry of size key_size */
     table->key_size = key_size;
@@ -61,6 +61,8 @@ vrouter_put_nexthop(struct vr_nexthop *nh)
             }
 
             vr_free(nh->nh_component_nh);
+            if (nh->nh_ecmp_table)
+                vr_free(nh->nh_ecmp_table);
         }
         if (nh->nh_dev) {
             vrouter_put_interface(nh->nh_dev);
@@ -148,16 +150,11 @@ nh_rcv(unsigned short vrf, struct vr_packet *pkt,
 }
 
 
-static int
-nh_push_mpls_header(struct vr_packet *pkt, unsigned int label)
+static inline unsigned int
+nh_mpls_label(struct vr_packet *pkt, unsigned int label)
 {
-    unsigned int *lbl;
     unsigned int ttl;
 
-    lbl = (unsigned int *)pkt_push(pkt, sizeof(unsigned int));
-    if (!lbl)
-        return -ENOSPC;
-
     /* Use the ttl from packet. If not ttl, 
      * initialise to some arbitrary value */
     ttl = pkt->vp_ttl;
@@ -165,11 +162,97 @@ nh_push_mpls_header(struct vr_packet *pkt, unsigned int label)
         ttl = 64;
     }
 
-    *lbl = htonl((label << VR_MPLS_LABEL_SHIFT) | VR_MPLS_STACK_BIT | ttl);
+    return htonl((label << VR_MPLS_LABEL_SHIFT) | VR_MPLS_STACK_BIT | ttl);
+}
+
+static int
+nh_push_mpls_header(struct vr_packet *pkt, unsigned int label)
+{
+    unsigned int *lbl;
+
+    lbl = (unsigned int *)pkt_push(pkt, sizeof(unsigned int));
+    if (!lbl)
+        return -ENOSPC;
+
+    *lbl = nh_mpls_label(pkt, label);
 
     return 0;
 }
 
+/*
+ * the outer headers of a tunnel nexthop, from the ip header down to the
+ * mpls label or the vxlan header, are built when the nexthop is added and
+ * kept in nh_data right after the l2 rewrite. the template has 0 for ip_len,
+ * ip_id and the label, and the ip checksum of the template, so that what
+ * is left for a packet is a copy, and the fields that are its own
+ */
+#define NH_GRE_TUN_HDR_LEN          (sizeof(struct vr_ip) + \
+                                        sizeof(struct vr_gre) + VR_MPLS_HDR_LEN)
+#define NH_MPLS_UDP_TUN_HDR_LEN     (sizeof(struct vr_ip) + \
+                                        sizeof(struct vr_udp) + VR_MPLS_HDR_LEN)
+#define NH_UDP_TUN_HDR_LEN          (sizeof(struct vr_ip) + sizeof(struct vr_udp))
+#define NH_VXLAN_TUN_HDR_LEN        VR_VXLAN_HDR_LEN
+#define NH_TUN_HDR_MAX              NH_VXLAN_TUN_HDR_LEN
+
+static void
+nh_tunnel_hdr_init(struct vr_nexthop *nh, unsigned short encap_len,
+        unsigned int sip, unsigned int dip, unsigned short sport,
+        unsigned short dport)
+{
+    struct vr_ip *ip = (struct vr_ip *)(nh->nh_data + encap_len);
+    struct vr_gre *gre;
+    struct vr_udp *udp;
+    struct vr_vxlan *vxlanh;
+
+    memset(ip, 0, NH_TUN_HDR_MAX);
+
+    ip->ip_version = 4;
+    ip->ip_hl = 5;
+    ip->ip_ttl = 64;
+    ip->ip_saddr = sip;
+    ip->ip_daddr = dip;
+
+    if (nh->nh_flags & NH_FLAG_TUNNEL_GRE) {
+        ip->ip_proto = VR_IP_PROTO_GRE;
+        gre = (struct vr_gre *)(ip + 1);
+        gre->gre_proto = VR_GRE_PROTO_MPLS_NO;
+    } else {
+        ip->ip_proto = VR_IP_PROTO_UDP;
+        udp = (struct vr_udp *)(ip + 1);
+        udp->udp_sport = sport;
+        udp->udp_dport = dport;
+        if (nh->nh_flags & NH_FLAG_TUNNEL_VXLAN) {
+            vxlanh = (struct vr_vxlan *)(udp + 1);
+            vxlanh->vxlan_flags = htonl(VR_VXLAN_IBIT);
+        }
+    }
+
+    ip->ip_csum = vr_ip_csum(ip);
+
+    return;
+}
+
+static struct vr_ip *
+nh_tunnel_push_hdr(struct vr_packet *pkt, struct vr_nexthop *nh,
+        unsigned short encap_len, unsigned short hdr_len, unsigned short id)
+{
+    struct vr_ip *ip, *tmpl = (struct vr_ip *)(nh->nh_data + encap_len);
+
+    ip = (struct vr_ip *)pkt_push(pkt, hdr_len);
+    if (!ip)
+        return NULL;
+
+    memcpy(ip, tmpl, hdr_len);
+    ip->ip_len = htons(pkt_len(pkt));
+    ip->ip_id = id;
+    /* ip_len and ip_id are 0 in the template */
+    ip->ip_csum = vr_csum_update(tmpl->ip_csum,
+            (unsigned int)ip->ip_len + id);
+
+    pkt_set_network_header(pkt, pkt->vp_data);
+    return ip;
+}
+
 /*
  * nh_udp_tunnel_helper - helper function to use for UDP tunneling. Used
  * by mirroring and MPLS over UDP. Returns true on success, false otherwise.
@@ -259,11 +342,69 @@ nh_vxlan_tunnel_helper(unsigned short vrf, struct vr_packet *pkt,
                              htons(VR_VXLAN_UDP_DST_PORT), sip, dip);
 }
 
+/*
+ * the bytes of a multicast replica, past the furthest of its network
+ * headers, that are copied to the buffer of its own: the inner ip and
+ * transport headers that the nexthops read or rewrite. the rest of the
+ * packet is shared by all the replicas
+ */
+#define NH_MCAST_HDR_LEN            128
+
+static struct vr_packet *
+nh_mcast_clone_head(struct vr_packet *pkt, struct vr_interface *vif,
+        unsigned short head_room)
+{
+    unsigned short hdr_off;
+    struct vr_packet *clone_pkt;
+
+    /* the replica keeps the head space of the packet, as a cow would */
+    if (head_room < pkt->vp_data)
+        head_room = pkt->vp_data;
+
+    hdr_off = pkt->vp_data;
+    if (pkt->vp_network_h > hdr_off)
+        hdr_off = pkt->vp_network_h;
+    if (pkt->vp_inner_network_h > hdr_off)
+        hdr_off = pkt->vp_inner_network_h;
+
+    clone_pkt = vr_pclone_head(pkt, vif,
+            hdr_off - pkt->vp_data + NH_MCAST_HDR_LEN, head_room);
+    if (!clone_pkt)
+        return NULL;
+
+    clone_pkt->vp_network_h = clone_pkt->vp_data + pkt->vp_network_h -
+        pkt->vp_data;
+    clone_pkt->vp_inner_network_h = clone_pkt->vp_data +
+        pkt->vp_inner_network_h - pkt->vp_data;
+    clone_pkt->vp_nh = pkt->vp_nh;
+    clone_pkt->vp_flags = pkt->vp_flags;
+    clone_pkt->vp_type = pkt->vp_type;
+    clone_pkt->vp_ttl = pkt->vp_ttl;
+
+    return clone_pkt;
+}
+
+/*
+ * vif is the interface that the replica goes out of, or NULL if it is
+ * replicated further rather than sent as is
+ */
 static struct vr_packet *
-nh_mcast_clone(struct vr_packet *pkt, unsigned short head_room)
+nh_mcast_clone(struct vr_packet *pkt, struct vr_interface *vif,
+        unsigned short head_room)
 {
     struct vr_packet *clone_pkt;
 
+    /*
+     * copy only the headers to each replica, when the host can share the
+     * rest, and fall back to a cow of a clone for the packets that it
+     * cannot replicate so
+     */
+    if (vr_pclone_head) {
+        clone_pkt = nh_mcast_clone_head(pkt, vif, head_room);
+        if (clone_pkt)
+            return clone_pkt;
+    }
+
     /* Clone the packet */
     clone_pkt = vr_pclone(pkt);
     if (!clone_pkt) {
@@ -329,6 +470,69 @@ nh_composite_ecmp_validate_src(unsigned short vrf, struct vr_packet *pkt,
     return NH_SOURCE_VALID;
 }
 
+/*
+ * the member for a packet that was not given one, from the bucket that the
+ * hash of the packet falls in. for packets of a flow, it is the hash of the
+ * flow key, and the pick is stored in the flow entry, unless agent set a
+ * member there first. the flow then stays with the member even as the
+ * buckets move, and its reverse flow checks the source against it. other
+ * packets go by the hash of their addresses and protocol
+ */
+static struct vr_nexthop *
+nh_ecmp_select(struct vr_nexthop *nh, struct vr_packet *pkt,
+        struct vr_forwarding_md *fmd)
+{
+    int8_t member;
+    unsigned short family;
+    unsigned int hash;
+    struct vr_ip *ip;
+    struct vr_ip6 *ip6;
+    struct vr_flow_entry *fe = NULL;
+    struct vr_ecmp_table *et = nh->nh_ecmp_table;
+
+    if (!et)
+        return NULL;
+
+    ip = (struct vr_ip *)pkt_network_header(pkt);
+    if (ip->ip_version == 4)
+        family = AF_INET;
+    else if (ip->ip_version == 6)
+        family = AF_INET6;
+    else
+        return NULL;
+
+    hash = fmd->fmd_flow_hash;
+    if (!hash) {
+        if (family == AF_INET) {
+            hash = vr_hash_3words(ip->ip_saddr, ip->ip_daddr,
+                    ip->ip_proto, 0);
+        } else {
+            ip6 = (struct vr_ip6 *)ip;
+            hash = vr_hash(ip6->ip6_src, 2 * VR_IP6_ADDRESS_LEN,
+                    ip6->ip6_nxt);
+        }
+    }
+
+    member = et->et_buckets[hash & (NH_ECMP_BUCKETS - 1)];
+    if (member < 0 || member >= nh->nh_component_cnt ||
+            !nh->nh_component_nh[member].cnh)
+        return NULL;
+
+    if (fmd->fmd_flow_index >= 0)
+        fe = vr_flow_get_entry(nh->nh_router, family, fmd->fmd_flow_index);
+
+    if (fe && !__sync_bool_compare_and_swap(&fe->fe_ecmp_nh_index, -1,
+                member)) {
+        member = fe->fe_ecmp_nh_index;
+        if (member < 0 || member >= nh->nh_component_cnt)
+            return NULL;
+    }
+
+    fmd->fmd_ecmp_nh_index = member;
+
+    return nh->nh_component_nh[member].cnh;
+}
+
 static int
 nh_composite_ecmp(unsigned short vrf, struct vr_packet *pkt,
         struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
@@ -342,13 +546,20 @@ nh_composite_ecmp(unsigned short vrf, struct vr_packet *pkt,
     if (stats)
         stats->vrf_ecmp_composites++;
 
-    if (!fmd || (uint8_t)fmd->fmd_ecmp_nh_index >= nh->nh_component_cnt)
+    if (!fmd || fmd->fmd_ecmp_nh_index < -1 ||
+            fmd->fmd_ecmp_nh_index >= (int)nh->nh_component_cnt)
         goto drop;
 
     if (fmd->fmd_ecmp_nh_index >= 0)
         member_nh = nh->nh_component_nh[fmd->fmd_ecmp_nh_index].cnh;
+    else
+        member_nh = nh_ecmp_select(nh, pkt, fmd);
 
     if (!member_nh) {
+        /* only a flow has an entry for the agent to resolve */
+        if (fmd->fmd_flow_index < 0)
+            goto drop;
+
         vr_trap(pkt, vrf, AGENT_TRAP_ECMP_RESOLVE, &fmd->fmd_flow_index);
         return 0;
     }
@@ -462,7 +673,7 @@ nh_composite_mcast_l2(unsigned short vrf, struct vr_packet *pkt,
 
             /* There would be enought head space to clone it with zero
              * size */
-            if (!(new_pkt = nh_mcast_clone(pkt, 0))) {
+            if (!(new_pkt = nh_mcast_clone(pkt, dir_nh->nh_dev, 0))) {
                 drop_reason = VP_DROP_MCAST_CLONE_FAIL;
                 break;
             }
@@ -491,7 +702,7 @@ nh_composite_mcast_l2(unsigned short vrf, struct vr_packet *pkt,
                 clone_size = VR_L2_MCAST_PKT_HEAD_SPACE;
 
             /* Create head space for L2 Mcast header */
-            if (!(new_pkt = nh_mcast_clone(pkt, clone_size))) {
+            if (!(new_pkt = nh_mcast_clone(pkt, NULL, clone_size))) {
                 drop_reason = VP_DROP_MCAST_CLONE_FAIL;
                 break;
             }
@@ -519,6 +730,7 @@ nh_composite_mcast_l3(unsigned short vrf, struct vr_packet *pkt,
     unsigned short drop_reason, pkt_vrf;
     struct vr_nexthop *dir_nh;
     struct vr_packet *new_pkt;
+    struct vr_interface *clone_vif;
     int i;
     uint32_t mcast_clone_size = 0;
 
@@ -548,19 +760,21 @@ nh_composite_mcast_l3(unsigned short vrf, struct vr_packet *pkt,
                 continue;
 
             mcast_clone_size = sizeof(struct vr_eth);
+            clone_vif = dir_nh->nh_dev;
             pkt_vrf = dir_nh->nh_dev->vif_vrf;
 
         } else if ((dir_nh->nh_type == NH_COMPOSITE) &&
                 (dir_nh->nh_flags & NH_FLAG_COMPOSITE_FABRIC)) {
 
             mcast_clone_size = VR_L3_MCAST_PKT_HEAD_SPACE;
+            clone_vif = NULL;
             pkt_vrf = vrf;
 
         } else {
             continue;
         }
 
-        if (!(new_pkt = nh_mcast_clone(pkt, mcast_clone_size))) {
+        if (!(new_pkt = nh_mcast_clone(pkt, clone_vif, mcast_clone_size))) {
             drop_reason = VP_DROP_MCAST_CLONE_FAIL;
             break;
         }
@@ -621,7 +835,7 @@ nh_composite_fabric(unsigned short vrf, struct vr_packet *pkt,
          * handling. Just cow the packet with zero size to get different
          * buffer space 
          */
-        new_pkt = nh_mcast_clone(pkt, 0);
+        new_pkt = nh_mcast_clone(pkt, dir_nh->nh_dev, 0);
         if (!new_pkt) {
             drop_reason = VP_DROP_MCAST_CLONE_FAIL;
             break;
@@ -808,11 +1022,10 @@ nh_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
             goto send_fail;
     }
 
-    if (nh_udp_tunnel_helper(pkt, nh->nh_udp_tun_sport,
-                             nh->nh_udp_tun_dport, nh->nh_udp_tun_sip,
-                             nh->nh_udp_tun_dip) == false) {
+    ip = nh_tunnel_push_hdr(pkt, nh, nh->nh_udp_tun_encap_len,
+            NH_UDP_TUN_HDR_LEN, htons(vr_generate_unique_ip_id()));
+    if (!ip)
         goto send_fail;
-    }
 
     if (pkt_len(pkt) > ((1 << sizeof(ip->ip_len) * 8)))
         goto send_fail;
@@ -825,8 +1038,8 @@ nh_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
     /*
      * Calculate the partial checksum for udp header
      */
-    ip = (struct vr_ip *)(pkt_data(pkt));
-    udp = (struct vr_udp *)((char *)ip + ip->ip_hl * 4);
+    udp = (struct vr_udp *)(ip + 1);
+    udp->udp_length = htons(pkt_len(pkt) - sizeof(struct vr_ip));
     udp->udp_csum = vr_ip_partial_csum(ip);
 
     stats = vr_inet_vrf_stats(vrf, pkt->vp_cpu);
@@ -854,7 +1067,11 @@ nh_vxlan_tunnel(unsigned short vrf, struct vr_packet *pkt,
     struct vr_interface *vif;
     struct vr_vrf_stats *stats;
     unsigned short reason = VP_DROP_PUSH;
+    unsigned short udp_src_port = VR_VXLAN_UDP_SRC_PORT, head_space;
     struct vr_packet *tmp_pkt;
+    struct vr_ip *ip;
+    struct vr_udp *udp;
+    struct vr_vxlan *vxlanh;
 
     stats = vr_inet_vrf_stats(vrf, pkt->vp_cpu);
     if (stats)
@@ -863,19 +1080,40 @@ nh_vxlan_tunnel(unsigned short vrf, struct vr_packet *pkt,
     if (!fmd || fmd->fmd_label < 0)
         return vr_forward(nh->nh_router, vrf, pkt, fmd);
 
-    if (nh_vxlan_tunnel_helper(vrf, pkt, fmd, nh->nh_udp_tun_sip,
-                                            nh->nh_udp_tun_dip) == false) {
-        goto send_fail;
-    }
-
-    if (pkt_head_space(pkt) < nh->nh_udp_tun_encap_len) {
-        tmp_pkt = vr_pexpand_head(pkt, nh->nh_udp_tun_encap_len - pkt_head_space(pkt));
+    head_space = NH_VXLAN_TUN_HDR_LEN + nh->nh_udp_tun_encap_len;
+    if (pkt_head_space(pkt) < head_space) {
+        tmp_pkt = vr_pexpand_head(pkt, head_space - pkt_head_space(pkt));
         if (!tmp_pkt) {
             goto send_fail;
         }
         pkt = tmp_pkt;
     }
 
+    /* Change the packet type to VXLAN as we add the vxlan header */
+    pkt->vp_type = VP_TYPE_VXLAN;
+
+    /*
+     * The UDP source port is a hash of the inner headers
+     */
+    if (vr_get_udp_src_port) {
+        udp_src_port = vr_get_udp_src_port(pkt, fmd, vrf);
+        if (udp_src_port == 0) {
+            goto send_fail;
+        }
+    }
+
+    ip = nh_tunnel_push_hdr(pkt, nh, nh->nh_udp_tun_encap_len,
+            NH_VXLAN_TUN_HDR_LEN, htons(vr_generate_unique_ip_id()));
+    if (!ip)
+        goto send_fail;
+
+    udp = (struct vr_udp *)(ip + 1);
+    udp->udp_sport = htons(udp_src_port);
+    udp->udp_length = htons(pkt_len(pkt) - sizeof(struct vr_ip));
+
+    vxlanh = (struct vr_vxlan *)(udp + 1);
+    vxlanh->vxlan_vnid = htonl(fmd->fmd_label << VR_VXLAN_VNID_SHIFT);
+
     /* slap l2 header */
     vif = nh->nh_dev;
     if (!vif->vif_set_rewrite(vif, pkt, nh->nh_data, 
@@ -918,6 +1156,8 @@ nh_mpls_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
     __u16 tun_encap_len, udp_src_port = VR_MPLS_OVER_UDP_SRC_PORT; 
     unsigned short reason = VP_DROP_PUSH;
     struct vr_packet *tmp_pkt;
+    struct vr_ip *ip;
+    struct vr_udp *udp;
 
     /*
      * If we are testing MPLS over UDP using the vr_mudp sysctl, use the
@@ -964,9 +1204,6 @@ nh_mpls_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
         pkt = tmp_pkt;
     }
 
-    if (nh_push_mpls_header(pkt, fmd->fmd_label) < 0)
-        goto send_fail;
-
     if (vr_perfs)
         pkt->vp_flags |= VP_FLAG_GSO;
 
@@ -978,10 +1215,26 @@ nh_mpls_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
     else 
         pkt->vp_type = VP_TYPE_IPOIP;
 
-    if (nh_udp_tunnel_helper(pkt, htons(udp_src_port), 
-                             htons(VR_MPLS_OVER_UDP_DST_PORT),
-                             tun_sip, tun_dip) == false) {
-        goto send_fail;
+    /* a gre nexthop, under vr_mudp, has no udp template */
+    if (vr_mudp) {
+        if (nh_push_mpls_header(pkt, fmd->fmd_label) < 0)
+            goto send_fail;
+
+        if (nh_udp_tunnel_helper(pkt, htons(udp_src_port), 
+                                 htons(VR_MPLS_OVER_UDP_DST_PORT),
+                                 tun_sip, tun_dip) == false) {
+            goto send_fail;
+        }
+    } else {
+        ip = nh_tunnel_push_hdr(pkt, nh, tun_encap_len,
+                NH_MPLS_UDP_TUN_HDR_LEN, htons(vr_generate_unique_ip_id()));
+        if (!ip)
+            goto send_fail;
+
+        udp = (struct vr_udp *)(ip + 1);
+        udp->udp_sport = htons(udp_src_port);
+        udp->udp_length = htons(pkt_len(pkt) - sizeof(struct vr_ip));
+        *(unsigned int *)(udp + 1) = nh_mpls_label(pkt, fmd->fmd_label);
     }
 
     /* slap l2 header */
@@ -1020,7 +1273,6 @@ nh_gre_tunnel(unsigned short vrf, struct vr_packet *pkt,
     unsigned int id;
     int gre_head_space;
     unsigned short drop_reason = VP_DROP_INVALID_NH;
-    struct vr_gre *gre_hdr;
     struct vr_ip *ip;
     unsigned char *tun_encap;
     struct vr_interface *vif;
@@ -1061,8 +1313,7 @@ nh_gre_tunnel(unsigned short vrf, struct vr_packet *pkt,
         id = htons(vr_generate_unique_ip_id());
     }
 
-    gre_head_space = VR_MPLS_HDR_LEN + sizeof(struct vr_ip) + sizeof(struct vr_gre);
-    gre_head_space += nh->nh_gre_tun_encap_len;
+    gre_head_space = NH_GRE_TUN_HDR_LEN + nh->nh_gre_tun_encap_len;
 
     if (pkt_head_space(pkt) < gre_head_space) {
         tmp_pkt = vr_pexpand_head(pkt, gre_head_space - pkt_head_space(pkt));
@@ -1073,41 +1324,21 @@ nh_gre_tunnel(unsigned short vrf, struct vr_packet *pkt,
         pkt = tmp_pkt;
     }
 
-    if (nh_push_mpls_header(pkt, fmd->fmd_label) < 0)
-        goto send_fail;
-
-    gre_hdr = (struct vr_gre *)pkt_push(pkt, sizeof(struct vr_gre));
-    if (!gre_hdr) {
+    ip = nh_tunnel_push_hdr(pkt, nh, nh->nh_gre_tun_encap_len,
+            NH_GRE_TUN_HDR_LEN, id);
+    if (!ip) {
         drop_reason = VP_DROP_PUSH;
         goto send_fail;
     }
 
-    gre_hdr->gre_flags = 0;
-    gre_hdr->gre_proto = VR_GRE_PROTO_MPLS_NO;
+    *(unsigned int *)((unsigned char *)ip + NH_GRE_TUN_HDR_LEN -
+            VR_MPLS_HDR_LEN) = nh_mpls_label(pkt, fmd->fmd_label);
 
-    ip = (struct vr_ip *)pkt_push(pkt, sizeof(struct vr_ip));
-    if (!ip) {
-        drop_reason = VP_DROP_PUSH;
-        goto send_fail;
-    }
-    pkt_set_network_header(pkt, pkt->vp_data);
     if (pkt->vp_type == VP_TYPE_L2)
         pkt->vp_type = VP_TYPE_L2OIP;
     else 
         pkt->vp_type = VP_TYPE_IPOIP;
 
-    ip->ip_version = 4;
-    ip->ip_hl = 5;
-    ip->ip_tos = 0;
-    ip->ip_id = id;
-    ip->ip_frag_off = 0;
-    ip->ip_ttl = 64;
-    ip->ip_proto = VR_IP_PROTO_GRE;
-    ip->ip_saddr = nh->nh_gre_tun_sip;
-    ip->ip_daddr = nh->nh_gre_tun_dip;
-    ip->ip_len = htons(pkt_len(pkt));
-    /* checksum will be calculated in linux_xmit_segment */
-
     /* slap l2 header */
     vif = nh->nh_dev;
     tun_encap = vif->vif_set_rewrite(vif, pkt, nh->nh_data,
@@ -1359,6 +1590,91 @@ nh_vxlan_vrf_add(struct vr_nexthop *nh, vr_nexthop_req *req)
     return 0;
 }
 
+/*
+ * fill the buckets of the ecmp table for the present members. a bucket
+ * stays with its member as long as the member is still there, at the same
+ * index, and beyond that only as many buckets move as it takes to give the
+ * members equal shares. hence, when a member comes or goes, it is only
+ * the flows that go to or come from that member that move
+ */
+static int
+nh_ecmp_table_fill(struct vr_nexthop *nh)
+{
+    unsigned int i, cnt, present = 0, share, next = 0;
+    unsigned short load[NH_ECMP_MAX_MEMBERS];
+    unsigned char member;
+    struct vr_nexthop *cnh;
+    struct vr_ecmp_table *et, *oet = nh->nh_ecmp_table;
+
+    cnt = nh->nh_component_cnt;
+    if (cnt > NH_ECMP_MAX_MEMBERS)
+        cnt = NH_ECMP_MAX_MEMBERS;
+
+    et = vr_zalloc(sizeof(*et) + cnt * sizeof(et->et_member_ids[0]));
+    if (!et)
+        return -ENOMEM;
+
+    et->et_member_cnt = cnt;
+    for (i = 0; i < cnt; i++) {
+        load[i] = 0;
+        cnh = nh->nh_component_nh[i].cnh;
+        if (cnh) {
+            et->et_member_ids[i] = cnh->nh_id;
+            present++;
+        } else {
+            et->et_member_ids[i] = (unsigned int)-1;
+        }
+    }
+
+    for (i = 0; i < NH_ECMP_BUCKETS; i++) {
+        et->et_buckets[i] = NH_ECMP_NO_MEMBER;
+        if (!oet)
+            continue;
+
+        member = oet->et_buckets[i];
+        if (member >= cnt || member >= oet->et_member_cnt ||
+                !nh->nh_component_nh[member].cnh ||
+                oet->et_member_ids[member] != et->et_member_ids[member])
+            continue;
+
+        et->et_buckets[i] = member;
+        load[member]++;
+    }
+
+    if (present) {
+        share = (NH_ECMP_BUCKETS + present - 1) / present;
+
+        /* members that have more than their share give the rest up */
+        for (i = 0; i < NH_ECMP_BUCKETS; i++) {
+            member = et->et_buckets[i];
+            if (member != NH_ECMP_NO_MEMBER && load[member] > share) {
+                et->et_buckets[i] = NH_ECMP_NO_MEMBER;
+                load[member]--;
+            }
+        }
+
+        /* and the free buckets go round the members below their share */
+        for (i = 0; i < NH_ECMP_BUCKETS; i++) {
+            if (et->et_buckets[i] != NH_ECMP_NO_MEMBER)
+                continue;
+
+            while (!nh->nh_component_nh[next].cnh || load[next] >= share)
+                next = (next + 1) % cnt;
+
+            et->et_buckets[i] = next;
+            load[next]++;
+            next = (next + 1) % cnt;
+        }
+    }
+
+    /* no reader is left on the old table, as nh_reach_nh is nh_discard */
+    nh->nh_ecmp_table = et;
+    if (oet)
+        vr_free(oet);
+
+    return 0;
+}
+
 static int 
 nh_composite_add(struct vr_nexthop *nh, vr_nexthop_req *req)
 {
@@ -1436,6 +1752,9 @@ nh_composite_add(struct vr_nexthop *nh, vr_nexthop_req *req)
         nh->nh_reach_nh = nh_composite_mcast_l2;
         nh->nh_validate_src = nh_composite_mcast_validate_src;
     } else if (req->nhr_flags & NH_FLAG_COMPOSITE_ECMP) {
+        if (nh_ecmp_table_fill(nh))
+            return -ENOMEM;
+
         nh->nh_reach_nh = nh_composite_ecmp;
         nh->nh_validate_src = nh_composite_ecmp_validate_src;
     } else if (req->nhr_flags & NH_FLAG_COMPOSITE_FABRIC) {
@@ -1485,6 +1804,12 @@ nh_tunnel_add(struct vr_nexthop *nh, vr_nexthop_req *req)
     }
 
     memcpy(nh->nh_data, req->nhr_encap, req->nhr_encap_size);
+    nh_tunnel_hdr_init(nh, req->nhr_encap_size, req->nhr_tun_sip,
+            req->nhr_tun_dip, req->nhr_tun_sport,
+            (nh->nh_flags & NH_FLAG_TUNNEL_VXLAN) ?
+            htons(VR_VXLAN_UDP_DST_PORT) :
+            (nh->nh_flags & NH_FLAG_TUNNEL_UDP_MPLS) ?
+            htons(VR_MPLS_OVER_UDP_DST_PORT) : req->nhr_tun_dport);
 
     return 0;
 }
@@ -1557,6 +1882,9 @@ vr_nexthop_size(vr_nexthop_req *req)
         if (!req->nhr_encap_size || req->nhr_encap == NULL) 
             return -EINVAL;
         size += req->nhr_encap_size;
+        /* and the template of the outer headers */
+        if (req->nhr_type == NH_TUNNEL)
+            size += NH_TUN_HDR_MAX;
     }
 
     return size;
@@ -1572,7 +1900,8 @@ vr_nexthop_valid_change(vr_nexthop_req *req, struct vr_nexthop *nh)
         return false;
 
     if (req->nhr_encap_size &&
-            req->nhr_encap_size != nh->nh_data_size)
+            vr_nexthop_size(req) - sizeof(struct vr_nexthop) !=
+            nh->nh_data_size)
         return false;
 
     return true;
@@ -307,17 +307,50 @@ corrupt_pkt:
     return 0;
 }
 
+static void
+vr_l4_update_csum(struct vr_packet *pkt, unsigned short *csump,
+        unsigned int ip_inc, unsigned int inc)
+{
+    unsigned int csum;
+
+    /*
+     * for partial checksums, the actual value is stored rather
+     * than the complement
+     */
+    if (pkt->vp_flags & VP_FLAG_CSUM_PARTIAL) {
+        csum = (*csump) & 0xffff;
+        inc = ip_inc; 
+    } else {
+        csum = ~(*csump) & 0xffff;
+    }
+
+    csum += inc;
+    if (csum < inc)
+        csum += 1;
+
+    csum = (csum & 0xffff) + (csum >> 16);
+    if (csum >> 16)
+        csum = (csum & 0xffff) + 1;
+
+    if (pkt->vp_flags & VP_FLAG_CSUM_PARTIAL) {
+        *csump = csum & 0xffff;
+    } else {
+        *csump = ~(csum) & 0xffff;
+    }
+
+    return;
+}
+
 void
 vr_ip_update_csum(struct vr_packet *pkt, unsigned int ip_inc, unsigned int inc)
 {
     struct vr_ip *ip;
     struct vr_tcp *tcp;
     struct vr_udp *udp;
-    unsigned int csum;
     unsigned short *csump;
 
     ip = (struct vr_ip *)pkt_data(pkt);
-    ip->ip_csum = vr_ip_csum(ip);
+    ip->ip_csum = vr_csum_update(ip->ip_csum, ip_inc);
 
     if (ip->ip_proto == VR_IP_PROTO_TCP) {
         tcp = (struct vr_tcp *)((unsigned char *)ip + ip->ip_hl * 4);
@@ -329,64 +362,66 @@ vr_ip_update_csum(struct vr_packet *pkt, unsigned int ip_inc, unsigned int inc)
         return;
     }
 
-    if (vr_ip_transport_header_valid(ip)) {
-        /*
-         * for partial checksums, the actual value is stored rather
-         * than the complement
-         */
-        if (pkt->vp_flags & VP_FLAG_CSUM_PARTIAL) {
-            csum = (*csump) & 0xffff;
-            inc = ip_inc; 
-        } else {
-            csum = ~(*csump) & 0xffff;
-        }
+    if (vr_ip_transport_header_valid(ip))
+        vr_l4_update_csum(pkt, csump, ip_inc, inc);
 
-        csum += inc;
-        if (csum < inc)
-            csum += 1;
+    return;
+}
 
-        csum = (csum & 0xffff) + (csum >> 16);
-        if (csum >> 16)
-            csum = (csum & 0xffff) + 1;
+/*
+ * ipv6 has no header checksum, and the pseudo header of icmp6 carries the
+ * addresses as well. the transport header is right after the fixed header,
+ * which is all that inet6 flow processing looks at
+ */
+void
+vr_ip6_update_csum(struct vr_packet *pkt, struct vr_ip6 *ip6,
+        unsigned int ip_inc, unsigned int inc)
+{
+    struct vr_tcp *tcp;
+    struct vr_udp *udp;
+    struct vr_icmp *icmph;
+    unsigned short *csump;
 
-        if (pkt->vp_flags & VP_FLAG_CSUM_PARTIAL) {
-            *csump = csum & 0xffff;
-        } else {
-            *csump = ~(csum) & 0xffff;
-        }
+    if (ip6->ip6_nxt == VR_IP_PROTO_TCP) {
+        tcp = (struct vr_tcp *)(ip6 + 1);
+        csump = &tcp->tcp_csum;
+    } else if (ip6->ip6_nxt == VR_IP_PROTO_UDP) {
+        udp = (struct vr_udp *)(ip6 + 1);
+        csump = &udp->udp_csum;
+    } else if (ip6->ip6_nxt == VR_IP_PROTO_ICMP6) {
+        icmph = (struct vr_icmp *)(ip6 + 1);
+        csump = &icmph->icmp_csum;
+    } else {
+        return;
     }
 
+    vr_l4_update_csum(pkt, csump, ip_inc, inc);
+
     return;
 }
 
 unsigned short
 vr_ip_csum(struct vr_ip *ip)
 {
-    int sum = 0;
-    unsigned short *ptr = (unsigned short *)ip;
-    unsigned short answer = 0;
-    unsigned short *w = ptr;
-    int len = ip->ip_hl * 4;
-    int nleft = len;
+#ifndef __KERNEL__
+    unsigned int i, w;
+    uint64_t sum = 0;
+    unsigned char *ptr = (unsigned char *)ip;
+#endif
 
     ip->ip_csum = 0;
 
-    while (nleft > 1) {
-        sum += *w++;
-        nleft -= 2;
-    }
-
-    /* mop up an odd byte, if necessary */
-    if (nleft == 1) {
-        *(unsigned char *)(&answer) = *(unsigned char *)w;
-        sum += answer;
+#ifdef __KERNEL__
+    return (unsigned short)ip_fast_csum((void *)ip, ip->ip_hl);
+#else
+    /* a word at a time, copied out since the header need not be aligned */
+    for (i = 0; i < ip->ip_hl; i++) {
+        memcpy(&w, ptr + (i * 4), sizeof(w));
+        sum += w;
     }
 
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
-    answer = ~sum;
-
-    return answer;
+    return ~vr_csum_fold(sum);
+#endif
 }
 
 unsigned short
@@ -10,6 +10,8 @@
 static struct rtable_fspec rtable_families[];
 extern int mtrie4_algo_init(struct vr_rtable *, struct rtable_fspec *);
 extern void mtrie4_algo_deinit(struct vr_rtable *, struct rtable_fspec *);
+extern int mtrie6_algo_init(struct vr_rtable *, struct rtable_fspec *);
+extern void mtrie6_algo_deinit(struct vr_rtable *, struct rtable_fspec *);
 extern int mcast_algo_init(struct vr_rtable *, struct rtable_fspec *);
 extern void mcast_algo_deinit(struct vr_rtable *, struct rtable_fspec *);
 extern int bridge_table_init(struct vr_rtable *, struct rtable_fspec *);
@@ -24,6 +26,8 @@ vr_get_family(unsigned int family)
         return &rtable_families[0];
     case AF_BRIDGE:
         return &rtable_families[1];
+    case AF_INET6:
+        return &rtable_families[2];
 
     default:
         return NULL;
@@ -64,7 +68,14 @@ vr_route_add(vr_route_req *req)
         ret = -ENOENT;
     } else {
         vr_req.rtr_req = *req;
-        ret = fs->route_add(fs, &vr_req);
+        if (req->rtr_bulk_flags || req->rtr_bulk_prefix_size) {
+            if (fs->route_bulk_add)
+                ret = fs->route_bulk_add(fs, &vr_req);
+            else
+                ret = -EOPNOTSUPP;
+        } else {
+            ret = fs->route_add(fs, &vr_req);
+        }
     }
 
     vr_send_response(ret);
@@ -86,6 +97,16 @@ vr_get_inet_table(struct vrouter *router, int id)
     return NULL;
 }
 
+/* there are no inet6 multicast routes */
+static struct vr_rtable *
+vr_get_inet6_table(struct vrouter *router, int id)
+{
+    if (!router || id != RT_UCAST)
+        return NULL;
+
+    return router->vr_inet6_rtable;
+}
+
 
 int
 vr_route_get(vr_route_req *req)
@@ -102,7 +123,10 @@ vr_route_get(vr_route_req *req)
         goto generate_response;
     } else {
 
-        rtable = vr_get_inet_table(router, req->rtr_rt_type);
+        if (req->rtr_family == AF_INET6)
+            rtable = vr_get_inet6_table(router, req->rtr_rt_type);
+        else
+            rtable = vr_get_inet_table(router, req->rtr_rt_type);
         if (!rtable) {
             ret = -ENOENT;
             goto generate_response;
@@ -135,6 +159,8 @@ vr_route_dump(vr_route_req *req)
             rtable = vr_get_inet_table(router, req->rtr_rt_type);
         } else if (req->rtr_family == AF_BRIDGE) {
             rtable = router->vr_bridge_rtable;
+        } else if (req->rtr_family == AF_INET6) {
+            rtable = vr_get_inet6_table(router, req->rtr_rt_type);
         }
 
         if (!rtable) {
@@ -183,12 +209,10 @@ vr_route_req_process(void *s_req)
 }
 
 static void
-vr_inet_vrf_stats_dump(struct vrouter *router, vr_vrf_stats_req *req)
+vr_inet_vrf_stats_dump(struct vr_rtable *rtable, vr_vrf_stats_req *req)
 {
     int ret = 0;
-    struct vr_rtable *rtable;
 
-    rtable = vr_get_inet_table(router, req->vsr_type);
     if (!rtable) {
         ret = -ENOENT;
         goto generate_error;
@@ -203,13 +227,11 @@ generate_error:
 }
 
 static void
-vr_inet_vrf_stats_get(struct vrouter *router, vr_vrf_stats_req *req)
+vr_inet_vrf_stats_get(struct vr_rtable *rtable, vr_vrf_stats_req *req)
 {
     int ret = 0;
-    struct vr_rtable *rtable;
     vr_vrf_stats_req response;
 
-    rtable = vr_get_inet_table(router, req->vsr_type);
     if (!rtable) {
         ret = -ENOENT;
         goto generate_error;
@@ -228,12 +250,12 @@ generate_error:
 }
 
 static void
-vr_inet_vrf_stats_op(struct vrouter *router, vr_vrf_stats_req *req)
+vr_inet_vrf_stats_op(struct vr_rtable *rtable, vr_vrf_stats_req *req)
 {
     if (req->h_op == SANDESH_OP_GET)
-        vr_inet_vrf_stats_get(router, req);
+        vr_inet_vrf_stats_get(rtable, req);
     else if (req->h_op == SANDESH_OP_DUMP)
-        vr_inet_vrf_stats_dump(router, req);
+        vr_inet_vrf_stats_dump(rtable, req);
 
     return;
 }
@@ -257,7 +279,11 @@ vr_vrf_stats_op(vr_vrf_stats_req *req)
 
     switch (req->vsr_family) {
     case AF_INET:
-        vr_inet_vrf_stats_op(router, req);
+        vr_inet_vrf_stats_op(vr_get_inet_table(router, req->vsr_type), req);
+        break;
+
+    case AF_INET6:
+        vr_inet_vrf_stats_op(vr_get_inet6_table(router, req->vsr_type), req);
         break;
 
     default:
@@ -319,6 +345,55 @@ inet_route_add(struct rtable_fspec *fs, struct vr_route_req *req)
     return rtable->algo_add(rtable, req);
 }
 
+/*
+ * the routes of a bulk add are in the rtr_bulk_ lists, an element per
+ * route. they are all checked and masked here, before the table sees any
+ * of them
+ */
+int
+inet_route_bulk_add(struct rtable_fspec *fs, struct vr_route_req *req)
+{
+    struct vr_rtable *rtable;
+    struct vrouter *router;
+    unsigned int i, count, plen, pmask;
+
+    router = vrouter_get(req->rtr_req.rtr_rid);
+    if (!router)
+        return -EINVAL;
+
+    rtable = vr_get_inet_table(router, req->rtr_req.rtr_rt_type);
+    if (!rtable ||
+            ((unsigned int)req->rtr_req.rtr_vrf_id >= fs->rtb_max_vrfs))
+        return -EINVAL;
+
+    if (!rtable->algo_bulk_add)
+        return -EOPNOTSUPP;
+
+    count = req->rtr_req.rtr_bulk_prefix_size;
+    if (count > VR_MAX_BULK_ROUTES)
+        return -EINVAL;
+
+    if (req->rtr_req.rtr_bulk_prefix_len_size != count ||
+            req->rtr_req.rtr_bulk_nh_id_size != count ||
+            req->rtr_req.rtr_bulk_label_size != count ||
+            req->rtr_req.rtr_bulk_label_flags_size != count)
+        return -EINVAL;
+
+    for (i = 0; i < count; i++) {
+        plen = (unsigned char)req->rtr_req.rtr_bulk_prefix_len[i];
+        if (plen > VR_INET_MAX_PLEN)
+            return -EINVAL;
+
+        if (plen) {
+            pmask = ~((1 << (32 - plen)) - 1);
+            req->rtr_req.rtr_bulk_prefix[i] &= pmask;
+        } else
+            req->rtr_req.rtr_bulk_prefix[i] = 0;
+    }
+
+    return rtable->algo_bulk_add(rtable, req);
+}
+
 int
 inet_route_del(struct rtable_fspec *fs, struct vr_route_req *req)
 {
@@ -340,6 +415,103 @@ inet_route_del(struct rtable_fspec *fs, struct vr_route_req *req)
     return rtable->algo_del(rtable, req);
 }
 
+#define VR_INET6_MAX_PLEN   128
+
+/* clears the bits of the address past the prefix length */
+static void
+inet6_prefix_mask(unsigned char *prefix, unsigned int plen)
+{
+    unsigned int i;
+
+    for (i = plen / 8; i < VR_IP6_ADDRESS_LEN; i++) {
+        if (i == plen / 8 && (plen % 8))
+            prefix[i] &= 0xff << (8 - (plen % 8));
+        else
+            prefix[i] = 0;
+    }
+
+    return;
+}
+
+static struct vr_rtable *
+inet6_route_table(struct rtable_fspec *fs, struct vr_route_req *req)
+{
+    struct vrouter *router;
+
+    if ((unsigned int)(req->rtr_req.rtr_prefix_len) > VR_INET6_MAX_PLEN ||
+            req->rtr_req.rtr_prefix6_size != VR_IP6_ADDRESS_LEN ||
+            (unsigned int)(req->rtr_req.rtr_vrf_id) >= fs->rtb_max_vrfs)
+        return NULL;
+
+    router = vrouter_get(req->rtr_req.rtr_rid);
+    return vr_get_inet6_table(router, req->rtr_req.rtr_rt_type);
+}
+
+int
+inet6_route_add(struct rtable_fspec *fs, struct vr_route_req *req)
+{
+    struct vr_rtable *rtable;
+
+    rtable = inet6_route_table(fs, req);
+    if (!rtable)
+        return -EINVAL;
+
+    inet6_prefix_mask((unsigned char *)req->rtr_req.rtr_prefix6,
+            req->rtr_req.rtr_prefix_len);
+
+    return rtable->algo_add(rtable, req);
+}
+
+int
+inet6_route_del(struct rtable_fspec *fs, struct vr_route_req *req)
+{
+    struct vr_rtable *rtable;
+
+    rtable = inet6_route_table(fs, req);
+    if (!rtable)
+        return -EINVAL;
+
+    inet6_prefix_mask((unsigned char *)req->rtr_req.rtr_prefix6,
+            req->rtr_req.rtr_prefix_len);
+
+    return rtable->algo_del(rtable, req);
+}
+
+static void
+inet6_rtb_family_deinit(struct rtable_fspec *fs, struct vrouter *router)
+{
+    if (router->vr_inet6_rtable) {
+        fs->algo_deinit[RT_UCAST](router->vr_inet6_rtable, fs);
+        vr_free(router->vr_inet6_rtable);
+    }
+
+    router->vr_inet6_rtable = NULL;
+    return;
+}
+
+static int
+inet6_rtb_family_init(struct rtable_fspec *fs, struct vrouter *router)
+{
+    int ret;
+    struct vr_rtable *table = NULL;
+
+    if (router->vr_inet6_rtable)
+        return vr_module_error(-EEXIST, __FUNCTION__, __LINE__, 0);
+
+    table = vr_zalloc(sizeof(struct vr_rtable));
+    if (!table)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, RT_UCAST);
+
+    ret = fs->algo_init[RT_UCAST](table, fs);
+    if (ret) {
+        vr_free(table);
+        return vr_module_error(ret, __FUNCTION__, __LINE__, RT_UCAST);
+    }
+
+    router->vr_inet6_rtable = table;
+    return 0;
+}
+
 static void
 inet_rtb_family_deinit(struct rtable_fspec *fs, struct vrouter *router)
 {
@@ -475,6 +647,7 @@ static struct rtable_fspec rtable_families[] = {
         .rtb_family_deinit              =   inet_rtb_family_deinit,
         .route_add                      =   inet_route_add,
         .route_del                      =   inet_route_del,
+        .route_bulk_add                 =   inet_route_bulk_add,
         .algo_init[RT_UCAST]            =   mtrie4_algo_init,
         .algo_deinit[RT_UCAST]          =   mtrie4_algo_deinit,
         .algo_init[RT_MCAST]            =   mcast_algo_init,
@@ -489,6 +662,16 @@ static struct rtable_fspec rtable_families[] = {
         .route_del                      =   bridge_entry_del,
         .algo_init[RT_UCAST]            =   bridge_table_init,
         .algo_deinit[RT_UCAST]          =   bridge_table_deinit,
+    },
+    {
+        .rtb_family                     =   AF_INET6,
+        .rtb_max_vrfs                   =   VR_MAX_VRFS,
+        .rtb_family_init                =   inet6_rtb_family_init,
+        .rtb_family_deinit              =   inet6_rtb_family_deinit,
+        .route_add                      =   inet6_route_add,
+        .route_del                      =   inet6_route_del,
+        .algo_init[RT_UCAST]            =   mtrie6_algo_init,
+        .algo_deinit[RT_UCAST]          =   mtrie6_algo_deinit,
     }
 };
 
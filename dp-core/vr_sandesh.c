@@ -35,6 +35,7 @@ struct sandesh_object_md sandesh_md[] = {
     [VR_FLOW_OBJECT_ID]         =   {
         .obj_len                =       4 * sizeof(vr_flow_req),
         .obj_type_string        =       "vr_flow_req",
+        .obj_get_size           =       vr_flow_req_get_size,
     },
     [VR_VRF_ASSIGN_OBJECT_ID]     =   {
         .obj_len                =       4 * sizeof(vr_vrf_assign_req),
@@ -61,10 +62,16 @@ struct sandesh_object_md sandesh_md[] = {
 static unsigned int
 sandesh_proto_buf_len(unsigned int object_type, void *object)
 {
+    unsigned int len;
+
     if (!object && object_type != VR_RESPONSE_OBJECT_ID)
         return 0;
 
-    return sandesh_md[object_type].obj_len;
+    len = sandesh_md[object_type].obj_len;
+    if (object && sandesh_md[object_type].obj_get_size)
+        len += sandesh_md[object_type].obj_get_size(object);
+
+    return len;
 }
 
 static int
@@ -88,8 +88,8 @@ hif_udp_tx(struct vr_hinterface *hif, struct vr_hpacket *hpkt)
     bzero(&msg, sizeof(msg));
     msg.msg_iov = msg_iov;
     while (hpkt_tmp && i < 64) {
-        msg_iov[i].iov_base = hpkt_data(hpkt);
-        msg_iov[i].iov_len = hpkt->hp_packet.vp_len;
+        msg_iov[i].iov_base = hpkt_data(hpkt_tmp);
+        msg_iov[i].iov_len = hpkt_tmp->hp_packet.vp_len;
         i++;
         hpkt_tmp = hpkt_tmp->hp_next;
     }
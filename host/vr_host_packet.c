@@ -46,6 +46,7 @@ vr_hpacket_copy(unsigned char *dst, struct vr_hpacket *hpkt_src,
 void
 vr_hpacket_free(struct vr_hpacket *hpkt)
 {
+    unsigned int flags;
     struct vr_hpacket_tail *hpkt_tail;
     struct vr_hpacket *hpkt_next;
 
@@ -54,10 +55,16 @@ vr_hpacket_free(struct vr_hpacket *hpkt)
         hpkt_tail = (struct vr_hpacket_tail *)hpkt_end(hpkt);
         hpkt_tail->hp_users--;
         if (hpkt->hp_flags & VR_HPACKET_FLAGS_CLONED) {
+            flags = hpkt->hp_flags;
             if (!hpkt_tail->hp_users)
                 free(hpkt->hp_head);
             free(hpkt);
-            return;
+            /* a plain clone shares the buffers that follow the original */
+            if (!(flags & VR_HPACKET_FLAGS_SEGMENT))
+                return;
+
+            hpkt = hpkt_next;
+            continue;
         }
 
         if (hpkt->hp_pool) {
@@ -131,6 +138,24 @@ vr_hpacket_clone(struct vr_hpacket *hpkt)
     return hpkt_c;
 }
 
+/*
+ * a clone of just the one buffer, to be chained with clones of the others,
+ * such that each buffer of the chain is held by a reference of its own
+ */
+struct vr_hpacket *
+vr_hpacket_clone_segment(struct vr_hpacket *hpkt)
+{
+    struct vr_hpacket *hpkt_c;
+
+    hpkt_c = vr_hpacket_clone(hpkt);
+    if (!hpkt_c)
+        return NULL;
+
+    hpkt_c->hp_next = NULL;
+    hpkt_c->hp_flags |= VR_HPACKET_FLAGS_SEGMENT;
+    return hpkt_c;
+}
+
 struct vr_hpacket *
 vr_hpacket_pool_alloc(struct vr_hpacket_pool *pool)
 {
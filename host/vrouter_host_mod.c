@@ -7,12 +7,25 @@
 #include "vr_proto.h"
 #include "vrouter.h"
 #include <sys/time.h>
+#include <sys/mman.h>
 #include "vr_message.h"
 #include "vr_sandesh.h"
 #include "host/vr_host_packet.h"
 #include "ulinux.h"
 
 #define PAGE_SIZE	4096
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+#define GIANT_PAGE_SIZE	(1024 * 1024 * 1024)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB	(21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB	(30 << MAP_HUGE_SHIFT)
+#endif
 unsigned int vr_num_cpus = 1;
 
 static bool vr_host_inited = false;
@@ -52,7 +65,7 @@ vr_lib_delete_timer(struct vr_timer *vtimer)
 static void *
 vr_lib_page_alloc(unsigned int size)
 {
-	return malloc(PAGE_SIZE);
+	return calloc(size, 1);
 }
 
 static void
@@ -62,6 +75,50 @@ vr_lib_page_free(void *address, unsigned int size)
 		free(address);
 }
 
+static unsigned int
+vr_lib_huge_page_size(unsigned int size)
+{
+	if (size >= GIANT_PAGE_SIZE)
+		return GIANT_PAGE_SIZE;
+
+	return HUGE_PAGE_SIZE;
+}
+
+/*
+ * from the hugetlb pool if it has pages of the size, and otherwise from
+ * memory that the kernel is asked to back with transparent huge pages
+ */
+static void *
+vr_lib_huge_page_alloc(unsigned int size)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	unsigned int page_size = vr_lib_huge_page_size(size);
+	void *address;
+
+	size = (size + page_size - 1) & ~(page_size - 1);
+	address = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB |
+			((page_size == GIANT_PAGE_SIZE) ? MAP_HUGE_1GB : MAP_HUGE_2MB),
+			-1, 0);
+	if (address != MAP_FAILED)
+		return address;
+
+	address = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (address == MAP_FAILED)
+		return NULL;
+
+	madvise(address, size, MADV_HUGEPAGE);
+	return address;
+}
+
+static void
+vr_lib_huge_page_free(void *address, unsigned int size)
+{
+	unsigned int page_size = vr_lib_huge_page_size(size);
+
+	if (address)
+		munmap(address, (size + page_size - 1) & ~(page_size - 1));
+}
+
 static void *
 vr_lib_malloc(unsigned int size)
 {
@@ -139,6 +196,68 @@ vr_lib_pclone(struct vr_packet *pkt)
     return &hpkt_c->hp_packet;
 }
 
+/*
+ * a replica with its own head buffer that has a copy of the first hdr_len
+ * bytes, followed by clones of each buffer of the rest, that share the
+ * buffers of the original by reference. the chain is sent as it is,
+ * whatever the egress interface
+ */
+static struct vr_packet *
+vr_lib_pclone_head(struct vr_packet *pkt, struct vr_interface *vif,
+        unsigned short hdr_len, unsigned short head_room)
+{
+    unsigned short data, tail, len;
+    struct vr_hpacket *hpkt, *hpkt_head, *hpkt_c, *hpkt_prev;
+
+    if (hdr_len > pkt_head_len(pkt))
+        hdr_len = pkt_head_len(pkt);
+
+    hpkt_head = vr_hpacket_alloc(head_room + hdr_len + VR_HPACKET_HEAD_SPACE);
+    if (!hpkt_head)
+        return NULL;
+
+    hpkt_head->hp_data = head_room;
+    hpkt_head->hp_tail = head_room + hdr_len;
+    memcpy(hpkt_data(hpkt_head), pkt_data(pkt), hdr_len);
+
+    hpkt = VR_PACKET_TO_HPACKET(pkt);
+    data = pkt->vp_data + hdr_len;
+    tail = pkt->vp_tail;
+    hpkt_prev = hpkt_head;
+    while (hpkt) {
+        if (tail > data) {
+            hpkt_c = vr_hpacket_clone_segment(hpkt);
+            if (!hpkt_c) {
+                vr_hpacket_free(hpkt_head);
+                return NULL;
+            }
+
+            hpkt_c->hp_data = data;
+            hpkt_c->hp_tail = tail;
+            vr_lib_get_packet(hpkt_c, pkt->vp_if);
+            hpkt_prev->hp_next = hpkt_c;
+            hpkt_prev = hpkt_c;
+        }
+
+        hpkt = hpkt->hp_next;
+        if (hpkt) {
+            data = hpkt->hp_data;
+            tail = hpkt->hp_tail;
+        }
+    }
+
+    /* each buffer has the length of itself and of those that follow it */
+    len = 0;
+    for (hpkt_c = hpkt_head; hpkt_c; hpkt_c = hpkt_c->hp_next)
+        len += hpkt_head_len(hpkt_c);
+    for (hpkt_c = hpkt_head; hpkt_c; hpkt_c = hpkt_c->hp_next) {
+        hpkt_c->hp_len = len;
+        len -= hpkt_head_len(hpkt_c);
+    }
+
+    return vr_lib_get_packet(hpkt_head, pkt->vp_if);
+}
+
 static void
 vr_lib_preset(struct vr_packet *pkt)
 {
@@ -218,6 +337,32 @@ vr_lib_delay_op(void)
     return;
 }
 
+static void *
+vr_lib_get_defer_data(unsigned int len)
+{
+    if (!len)
+        return NULL;
+
+    return malloc(len);
+}
+
+static void
+vr_lib_put_defer_data(void *data)
+{
+    if (data)
+        free(data);
+    return;
+}
+
+static void
+vr_lib_defer(struct vrouter *router, vr_defer_cb user_cb, void *data)
+{
+    /* there are no concurrent readers to wait for */
+    user_cb(router, data);
+    vr_lib_put_defer_data(data);
+    return;
+}
+
 struct host_os vr_lib_host = {
     .hos_malloc             =       vr_lib_malloc,
     .hos_zalloc             =       vr_lib_zalloc,
@@ -228,15 +373,21 @@ struct host_os vr_lib_host = {
     .hos_pfree              =       vr_lib_pfree,
     .hos_preset             =       vr_lib_preset,
     .hos_pclone             =       vr_lib_pclone,
+    .hos_pclone_head        =       vr_lib_pclone_head,
     .hos_pcopy              =       vr_lib_pcopy,
     .hos_pfrag_len          =       vr_lib_pfrag_len,
 
     .hos_get_cpu            =       vr_lib_get_cpu,
     .hos_schedule_work      =       vr_lib_schedule_work,
     .hos_delay_op           =       vr_lib_delay_op,
+    .hos_defer              =       vr_lib_defer,
+    .hos_get_defer_data     =       vr_lib_get_defer_data,
+    .hos_put_defer_data     =       vr_lib_put_defer_data,
     .hos_get_time           =       vr_lib_get_time,
 	.hos_page_alloc			=		vr_lib_page_alloc,
 	.hos_page_free			=		vr_lib_page_free,
+	.hos_huge_page_alloc	=		vr_lib_huge_page_alloc,
+	.hos_huge_page_free		=		vr_lib_huge_page_free,
 	.hos_create_timer		=		vr_lib_create_timer,
 	.hos_delete_timer		=		vr_lib_delete_timer,
 };
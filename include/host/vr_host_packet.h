@@ -17,6 +17,8 @@ struct vr_hpacket_pool {
 };
 
 #define VR_HPACKET_FLAGS_CLONED     0x1
+/* a clone of one buffer, that owns the buffers that follow it */
+#define VR_HPACKET_FLAGS_SEGMENT    0x2
 
 /* host packet representation */
 struct vr_hpacket {
@@ -87,6 +89,7 @@ int vr_hpacket_copy(unsigned char *, struct vr_hpacket *,
 void vr_hpacket_free(struct vr_hpacket *);
 struct vr_hpacket *vr_hpacket_alloc(unsigned int);
 struct vr_hpacket *vr_hpacket_clone(struct vr_hpacket *);
+struct vr_hpacket *vr_hpacket_clone_segment(struct vr_hpacket *);
 struct vr_hpacket *vr_hpacket_pool_alloc(struct vr_hpacket_pool *);
 void vr_hpacket_pool_free(struct vr_hpacket *);
 struct vr_hpacket_pool *vr_hpacket_pool_create(unsigned int, unsigned int);
@@ -10,17 +10,21 @@
 extern "C" {
 #endif
 struct ip4_bucket;
+struct ip4_cbucket;
 
 /*
  * Override the least significant bit of a pointer to indicate whether it
- * points to a bucket or nexthop.
+ * points to a bucket or nexthop. The next bit tells a compressed bucket
+ * from a full one.
  */
 #define ENTRY_IS_BUCKET(EPtr)        (((EPtr)->entry_long_i) & 0x1ul)
 #define ENTRY_IS_NEXTHOP(EPtr)       !ENTRY_IS_BUCKET(EPtr)
 
 #define PTR_IS_BUCKET(ptr)           ((ptr) & 0x1ul)
 #define PTR_IS_NEXTHOP(ptr)          !PTR_IS_BUCKET(ptr)
-#define PTR_TO_BUCKET(ptr)           ((struct ip4_bucket *)((ptr) ^ 0x1ul))
+#define PTR_IS_CBUCKET(ptr)          ((ptr) & 0x2ul)
+#define PTR_TO_BUCKET(ptr)           ((struct ip4_bucket *)((ptr) & ~0x3ul))
+#define PTR_TO_CBUCKET(ptr)          ((struct ip4_cbucket *)((ptr) & ~0x3ul))
 #define PTR_TO_NEXTHOP(ptr)          ((struct vr_nexthop *)(ptr))
 
 struct ip4_bucket_entry {
@@ -44,47 +48,74 @@ struct ip4_bucket {
 };
 
 /*
- * Ip4Mtrie
- *
- * Ip4Mtrie ensures that an IP lookup can be performed in 3 data fetches. It
- * organizes the lookup buckets in a (16 + 8 + 8) structure.
+ * A compressed bucket keeps one entry per run of identical entries. A bit
+ * is set in cbkt_bitmap at every index where a run begins, and cbkt_base
+ * has the number of runs that begin in the preceding bitmap words. The
+ * entry for an index is then found with a popcount, reading the header
+ * and one entry, which for the few runs that a bucket of host routes has
+ * are in the same or the adjacent cache line.
  */
-struct ip4_mtrie {
-    struct ip4_bucket_entry root;
+#define IP4_CBUCKET_MAX_SIZE        256
+#define IP4_CBUCKET_WORDS           (IP4_CBUCKET_MAX_SIZE / 64)
+#define IP4_CBUCKET_DEF_RUNS        16
+
+struct ip4_cbucket {
+    uint64_t cbkt_bitmap[IP4_CBUCKET_WORDS];
+    unsigned char cbkt_base[IP4_CBUCKET_WORDS];
+    unsigned short cbkt_runs;
+    struct ip4_bucket_entry cbkt_data[0];
 };
 
+static inline unsigned int
+ip4_popcount(uint64_t word)
+{
+    word -= (word >> 1) & 0x5555555555555555ULL;
+    word = (word & 0x3333333333333333ULL) +
+        ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+    return (word * 0x0101010101010101ULL) >> 56;
+}
+
+static inline struct ip4_bucket_entry *
+ip4_cbucket_entry(struct ip4_cbucket *cbkt, unsigned int index)
+{
+    unsigned int word = index / 64;
+    uint64_t bits;
+
+    bits = cbkt->cbkt_bitmap[word] & (~0ULL >> (63 - (index % 64)));
+    return &cbkt->cbkt_data[cbkt->cbkt_base[word] + ip4_popcount(bits) - 1];
+}
+
 #define IP4_PREFIX_LEN              32
+#define IP4_MTRIE_MAX_LEVELS        4
 
-#define IP4BUCKET_LEVEL0            0
-#define IP4BUCKET_LEVEL0_BITS       8
-#define IP4BUCKET_LEVEL0_PFX_LEN    IP4BUCKET_LEVEL0_BITS
-#define IP4BUCKET_LEVEL0_SHIFT      (IP4_PREFIX_LEN - IP4BUCKET_LEVEL0_BITS)
-#define IP4BUCKET_LEVEL0_SIZE       (1 << IP4BUCKET_LEVEL0_BITS)
-#define IP4BUCKET_LEVEL0_MASK       (IP4BUCKET_LEVEL0_SIZE - 1)
-
-#define IP4BUCKET_LEVEL1            1
-#define IP4BUCKET_LEVEL1_BITS       8
-#define IP4BUCKET_LEVEL1_PFX_LEN    (IP4BUCKET_LEVEL0_PFX_LEN + \
-                                        IP4BUCKET_LEVEL1_BITS)
-#define IP4BUCKET_LEVEL1_SHIFT      (IP4BUCKET_LEVEL0_SHIFT - IP4BUCKET_LEVEL1_BITS)
-#define IP4BUCKET_LEVEL1_SIZE       (1 << IP4BUCKET_LEVEL1_BITS)
-#define IP4BUCKET_LEVEL1_MASK       (IP4BUCKET_LEVEL1_SIZE - 1)
-
-#define IP4BUCKET_LEVEL2            2
-#define IP4BUCKET_LEVEL2_BITS       8
-#define IP4BUCKET_LEVEL2_PFX_LEN    (IP4BUCKET_LEVEL1_PFX_LEN + \
-                                        IP4BUCKET_LEVEL2_BITS)
-#define IP4BUCKET_LEVEL2_SHIFT      (IP4BUCKET_LEVEL1_SHIFT - IP4BUCKET_LEVEL2_BITS)
-#define IP4BUCKET_LEVEL2_SIZE       (1 << IP4BUCKET_LEVEL2_BITS)
-#define IP4BUCKET_LEVEL2_MASK       (IP4BUCKET_LEVEL2_SIZE - 1)
-
-#define IP4BUCKET_LEVEL3            3
-#define IP4BUCKET_LEVEL3_BITS       8
-#define IP4BUCKET_LEVEL3_PFX_LEN    (IP4BUCKET_LEVEL2_PFX_LEN + \
-                                        IP4BUCKET_LEVEL3_BITS)
-#define IP4BUCKET_LEVEL3_SHIFT      (IP4BUCKET_LEVEL2_SHIFT - IP4BUCKET_LEVEL3_BITS)
-#define IP4BUCKET_LEVEL3_SIZE       (1 << IP4BUCKET_LEVEL3_BITS)
-#define IP4BUCKET_LEVEL3_MASK       (IP4BUCKET_LEVEL3_SIZE - 1)
+/*
+ * an entry of the route cache of a cpu, the result of the /32 lookup of
+ * rce_prefix in rce_vrf, as of generation rce_gen of the vrf
+ */
+#define IP4_RCACHE_DEF_ENTRIES      256
+#define IP4_RCACHE_MAX_ENTRIES      65536
+
+struct ip4_rcache_entry {
+    unsigned int rce_vrf;
+    unsigned int rce_prefix;
+    unsigned int rce_gen;
+    unsigned int rce_prefix_len:8;
+    unsigned int rce_label_flags:4;
+    unsigned int rce_label:20;
+    struct vr_nexthop *rce_nh;
+};
+
+/*
+ * the ip6 tables are mtries as well, with a 16 bit first stride and 8 bit
+ * strides below it. the buckets below the first level, which hold few
+ * routes each, are compressed alike
+ */
+#define IP6_PREFIX_LEN              128
+#define IP6_MTRIE_MAX_LEVELS        15
+
+#define MTRIE_MAX_LEVELS            IP6_MTRIE_MAX_LEVELS
 
 struct mtrie_bkt_info {
     unsigned char           bi_bits;
@@ -94,6 +125,32 @@ struct mtrie_bkt_info {
     unsigned int            bi_size;
 };
 
+/*
+ * Ip4Mtrie
+ *
+ * The strides of the levels of an Ip4Mtrie are picked per vrf from one of
+ * the VR_RT_LAYOUT_ layouts, and hence a lookup takes as many data fetches
+ * as the layout has levels: 4 for 8/8/8/8, 3 for 16/8/8 and 2 for 24/8. The
+ * wide first level of the latter two costs 1MB and 256MB respectively, and
+ * is meant for the vrfs that carry most of the routes.
+ */
+struct ip4_mtrie {
+    struct ip4_bucket_entry root;
+    struct mtrie_bkt_info *mtrie_bkt_info;
+    unsigned char mtrie_levels;
+    unsigned char mtrie_layout;
+    /* AF_INET or AF_INET6 */
+    unsigned char mtrie_family;
+    /* built by a bulk add, and not yet seen by any reader */
+    unsigned char mtrie_shadow;
+    /* buckets of at most these many runs are compressed; 0 for never */
+    unsigned int mtrie_cbkt_runs;
+    /* what the buckets of the vrf cost, for vrf stats */
+    unsigned long mtrie_memory;
+    unsigned int mtrie_buckets;
+    unsigned int mtrie_cbuckets;
+};
+
 
 #ifdef __cplusplus
 }
@@ -6,9 +6,20 @@
 #ifndef __VR_BTABLE_H__
 #define __VR_BTABLE_H__
 
-#define VR_MAX_BTABLE_ENTRIES   8
-#define VR_SINGLE_ALLOC_LIMIT   (4  * 1024 * 1024)
-#define VR_KNOWN_BIG_MEM_LIMIT  (32 * 1024 * 1024)
+#define VR_MAX_BTABLE_ENTRIES   32
+#define VR_SINGLE_ALLOC_SHIFT   22
+#define VR_SINGLE_ALLOC_LIMIT   (1U << VR_SINGLE_ALLOC_SHIFT)
+#define VR_KNOWN_BIG_MEM_LIMIT  (128 * 1024 * 1024)
+
+/*
+ * tables that are backed by huge pages are partitioned in chunks of a
+ * power of two, no smaller than a 2M page and no bigger than a 1G page
+ */
+#define VR_HUGE_PAGE_SHIFT      21
+#define VR_HUGE_PAGE_SIZE       (1U << VR_HUGE_PAGE_SHIFT)
+#define VR_HUGE_ALLOC_SHIFT     30
+
+#define VR_BTABLE_FLAG_HUGE     0x1
 
 struct vr_btable_partition {
     unsigned int vb_offset;
@@ -19,6 +30,9 @@ struct vr_btable {
     unsigned int    vb_entries;
     unsigned short    vb_esize;
     unsigned short    vb_partitions;
+    /* every partition, but for the last, is 1 << vb_shift bytes */
+    unsigned short    vb_shift;
+    unsigned short    vb_flags;
     void *vb_mem[VR_MAX_BTABLE_ENTRIES];
     struct vr_btable_partition vb_table_info[VR_MAX_BTABLE_ENTRIES];
 };
@@ -29,6 +43,7 @@ void *vr_btable_get_address(struct vr_btable *, unsigned int);
 
 void vr_btable_free(struct vr_btable *);
 struct vr_btable *vr_btable_alloc(unsigned int, unsigned int);
+struct vr_btable *vr_btable_alloc_huge(unsigned int, unsigned int);
 
 static inline unsigned int
 vr_btable_entries(struct vr_btable *table)
@@ -45,13 +60,14 @@ vr_btable_size(struct vr_btable *table)
 static inline void *
 vr_btable_get(struct vr_btable *table, unsigned int entry)
 {
-    unsigned int t_index, t_offset;
+    unsigned int offset, t_index, t_offset;
 
     if (entry >= table->vb_entries)
         return NULL;
 
-    t_index = (entry * table->vb_esize) / VR_SINGLE_ALLOC_LIMIT;
-    t_offset = (entry * table->vb_esize) % VR_SINGLE_ALLOC_LIMIT;
+    offset = entry * table->vb_esize;
+    t_index = offset >> table->vb_shift;
+    t_offset = offset & ((1U << table->vb_shift) - 1);
     if (t_index >= table->vb_partitions)
         return NULL;
 
@@ -12,8 +12,11 @@
 
 #define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#define VR_CACHELINE_SIZE       64
+
 #define VR_ETHER_HLEN           14
 #define VR_ETHER_ALEN           6
+#define VR_IP6_ADDRESS_LEN      16
 
 #define VR_GRE_PROTO_MPLS       0x8847
 #define VR_GRE_PROTO_MPLS_NO    htons(0x8847)
@@ -40,6 +43,25 @@ enum rt_type{
 #define VR_RT_LABEL_VALID_FLAG      0x1
 #define VR_RT_HOSTED_FLAG           0x2
 
+/*
+ * strides of the levels of an inet route table, chosen when the first route
+ * add creates the vrf. DEFAULT leaves the choice to the datapath
+ */
+#define VR_RT_LAYOUT_DEFAULT        0
+#define VR_RT_LAYOUT_8_8_8_8        1
+#define VR_RT_LAYOUT_16_8_8         2
+#define VR_RT_LAYOUT_24_8           3
+#define VR_RT_LAYOUT_MAX            4
+
+/*
+ * a bulk route add builds a shadow table for the vrf from the routes that
+ * the rtr_bulk_ lists of one or more messages carry, and then replaces the
+ * table of the vrf with it as a whole
+ */
+#define VR_RT_BULK_BEGIN_FLAG       0x1
+#define VR_RT_BULK_COMMIT_FLAG      0x2
+#define VR_RT_BULK_ABORT_FLAG       0x4
+
 struct agent_hdr {
     unsigned short hdr_ifindex;
     unsigned short hdr_vrf;
@@ -7,6 +7,7 @@
 #define __VR_FLOW_H__
 
 #include "vr_defs.h"
+#include "vr_geometry.h"
 
 #define VR_FLOW_ACTION_DROP         0x0
 #define VR_FLOW_ACTION_HOLD         0x1
@@ -21,6 +22,8 @@
 #define VR_RFLOW_VALID              0x1000
 #define VR_FLOW_FLAG_MIRROR         0x2000
 #define VR_FLOW_FLAG_VRFT           0x4000
+/* transient, set while the entry is being moved in the overflow table */
+#define VR_FLOW_FLAG_RELOCATE       0x8000
 
 /* rest of the flags are action specific */
 
@@ -35,6 +38,15 @@
 /* for TRAP */
 #define VR_FLOW_FLAG_TRAP_ECMP      0x20
 #define VR_FLOW_FLAG_TRAP_MASK      (VR_FLOW_FLAG_TRAP_ECMP)
+
+/*
+ * fe_fwd_gen of an entry that has no route kept, and of one whose route is
+ * being changed. both are odd, which no generation of a fib is
+ */
+#define VR_FLOW_FWD_GEN_NONE        0x1
+#define VR_FLOW_FWD_GEN_BUSY        0xffffffff
+/* in fe_fwd_label, for a route that has a label */
+#define VR_FLOW_FWD_LABEL_VALID     0x80000000
 struct vr_forwarding_md;
 
 struct vr_flow_key {
@@ -48,6 +60,17 @@ struct vr_flow_key {
     unsigned char key_zero;
 } __attribute__((packed));
 
+/*
+ * the key of an inet6 flow is an inet key, with the ips zero, followed by
+ * the two addresses. the code that is common to both the tables hence
+ * passes either around as a struct vr_flow_key
+ */
+struct vr_flow6_key {
+    struct vr_flow_key key6_key;
+    unsigned char key6_src_ip[VR_IP6_ADDRESS_LEN];
+    unsigned char key6_dest_ip[VR_IP6_ADDRESS_LEN];
+} __attribute__((packed));
+
 /* 
  * Limit the number of outstanding flows in hold state. The flow rate can
  * be much more than what agent can handle. In such cases, to make sure that
@@ -66,24 +89,53 @@ struct vr_flow_key {
  * avoid the contention, we will make it a per-cpu variable. Once we make
  * a per-cpu variable, there no longer can be a single variable whose
  * value can be decremented. So, to work around that problem, we
- * will have two monotonically incrementing objects, monitoring the hold
- * count and the count of entries that went from hold to active/delete.
- * The single variable that tracks the latter can't be 32 bit, but the
- * former has to be 32 bit since the sum of all of them has to be compared
- * against the latter, and hence can't be each 64bit.
- *
- * How do we solve overflows?
+ * will have two monotonically incrementing per-cpu counters, one counting
+ * the entries that were put in hold on that cpu, and the other counting
+ * the entries that went from hold to active/delete on that cpu. The number
+ * of entries in hold is the difference of the sums of the two.
  *
- * We don't care for overflow of the first variable (since it is 64bit).
- * Whenever any of the per-cpu variable (32bit) overflows, our strategy
- * is to decrement the 64 bit variable from the 32 bit, if the former is
- * lesser or to decrement the 64 bit variable by 32bit_max, if the former
- * is greater. Only in those cases, lock is taken. It is guaranteed that
- * no two values will differ by more than hold count.
+ * Both the counters are 64 bit, and hence do not overflow in practice. A
+ * cpu writes only to its own counters, which are in a cache line of their
+ * own, and hence there is neither an atomic operation nor a cache line
+ * bouncing between cpus when entries are put in hold.
  */
+struct vr_flow_cpu_info {
+    uint64_t vfci_hold_count;
+    uint64_t vfci_action_count;
+    unsigned char vfci_pad[VR_CACHELINE_SIZE - 2 * sizeof(uint64_t)];
+};
+
+struct vr_btable;
+struct vr_flow_migration;
+
+/*
+ * the flow table proper, the overflow table, and the tags of all their
+ * entries. entries and oentries are the sizes the table was created with,
+ * and the geometries are of the buckets of the two tables. the entries of
+ * an AF_INET6 table are struct vr_flow6_entry.
+ */
+struct vr_flow_table {
+    struct vr_btable *vft_table;
+    struct vr_btable *vft_otable;
+    struct vr_btable *vft_tags;
+    unsigned int vft_entries;
+    unsigned int vft_oentries;
+    unsigned short vft_family;
+    unsigned short vft_entry_size;
+    struct vr_geometry vft_buckets;
+    struct vr_geometry vft_obuckets;
+};
+
 struct vr_flow_table_info {
-    uint64_t vfti_action_count;
-    uint32_t vfti_hold_count[0];
+    uint64_t vfti_oflow_relocations;
+    uint64_t vfti_aged_flows;
+    /* times an idle flow was left in the table for want of room in the log */
+    uint64_t vfti_aged_log_full;
+    /* seconds, as of the last run of the aging scanner */
+    uint16_t vfti_aging_time;
+    unsigned char vfti_pad[VR_CACHELINE_SIZE - 3 * sizeof(uint64_t) -
+        sizeof(uint16_t)];
+    struct vr_flow_cpu_info vfti_cpu_info[0];
 };
 
 /* 
@@ -113,6 +165,10 @@ struct vr_dummy_flow_entry {
     uint8_t fe_mirror_id;
     uint8_t fe_sec_mirror_id;
     int8_t fe_ecmp_nh_index;
+    uint16_t fe_last_seen;
+    uint16_t fe_fwd_nh_index;
+    uint32_t fe_fwd_label;
+    uint32_t fe_fwd_gen;
 } __attribute__((packed));
 
 #define VR_FLOW_ENTRY_PACK (64 - sizeof(struct vr_dummy_flow_entry))
@@ -132,15 +188,42 @@ struct vr_flow_entry {
     uint8_t fe_mirror_id;
     uint8_t fe_sec_mirror_id;
     int8_t fe_ecmp_nh_index;
+    /* time at which the flow last saw a packet, for aging */
+    uint16_t fe_last_seen;
+    /*
+     * the route of the destination of a forwarded inet flow, as of
+     * generation fe_fwd_gen of the fib of the vrf it is forwarded in.
+     * kept by the datapath
+     */
+    uint16_t fe_fwd_nh_index;
+    uint32_t fe_fwd_label;
+    uint32_t fe_fwd_gen;
     unsigned char fe_pack[VR_FLOW_ENTRY_PACK];
 } __attribute__((packed));
 
+#define VR_FLOW6_ENTRY_PACK (128 - sizeof(struct vr_flow_entry) - \
+        2 * VR_IP6_ADDRESS_LEN)
+
+/*
+ * an entry of the inet6 flow table. fe_key of the inet entry has the
+ * ports, vrf and protocol of the flow, and the addresses follow it in the
+ * next cache line, so that the inet flow table is not any bigger for it
+ */
+struct vr_flow6_entry {
+    struct vr_flow_entry fe6_entry;
+    unsigned char fe6_src_ip[VR_IP6_ADDRESS_LEN];
+    unsigned char fe6_dest_ip[VR_IP6_ADDRESS_LEN];
+    unsigned char fe6_pack[VR_FLOW6_ENTRY_PACK];
+} __attribute__((packed));
+
 #define VR_FLOW_PROTO_SHIFT             16
 
 #define VR_UDP_DHCP_SPORT   (17 << 16 | htons(67))
 #define VR_UDP_DHCP_CPORT   (17 << 16 | htons(68))
 #define VR_UDP_DNS_SPORT    (17 << 16 | htons(53))
 #define VR_TCP_DNS_SPORT    (6 << 16 | htons(53))
+#define VR_UDP_DHCP6_SPORT  (17 << 16 | htons(547))
+#define VR_UDP_DHCP6_CPORT  (17 << 16 | htons(546))
 
 #define VR_DNS_SERVER_PORT  htons(53)
 
@@ -149,6 +232,14 @@ struct vr_flow_md {
     unsigned int flmd_index;
     unsigned short flmd_action;
     unsigned short flmd_flags;
+    unsigned short flmd_family;
+    /* only key6_key, for an inet flow */
+    struct vr_flow6_key flmd_key;
+};
+
+struct vr_flow_batch_md {
+    unsigned int fbmd_count;
+    struct vr_flow_md fbmd_md[0];
 };
 
 struct vr_packet;
@@ -158,10 +249,16 @@ extern int vr_flow_init(struct vrouter *);
 extern void vr_flow_exit(struct vrouter *, bool);
 extern unsigned int vr_flow_inet_input(struct vrouter *, unsigned short, 
         struct vr_packet *, unsigned short, struct vr_forwarding_md *);
+extern unsigned int vr_flow_inet6_input(struct vrouter *, unsigned short,
+        struct vr_packet *, unsigned short, struct vr_forwarding_md *);
 extern inline unsigned int
 vr_flow_bypass(struct vrouter *, struct vr_flow_key *, struct vr_packet *, unsigned int *);
+extern struct vr_flow_entry *vr_flow_get_entry(struct vrouter *,
+        unsigned short, int);
 void *vr_flow_get_va(struct vrouter *, uint64_t);
 unsigned int vr_flow_table_size(struct vrouter *);
 unsigned int vr_oflow_table_size(struct vrouter *);
+unsigned int vr_flow6_table_size(struct vrouter *);
+unsigned int vr_flow_req_get_size(void *);
 
 #endif /* __VR_FLOW_H__ */
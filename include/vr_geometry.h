@@ -0,0 +1,69 @@
+/*
+ * vr_geometry.h -- reduction of a hash to a bucket of a table whose size
+ * is known only at runtime
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#ifndef __VR_GEOMETRY_H__
+#define __VR_GEOMETRY_H__
+
+/*
+ * a '%' with a divisor that is not a constant is an integer divide, which
+ * is tens of cycles. a table hence keeps the geometry of its buckets, and
+ * reduces hashes with a mask if the number of buckets is a power of two,
+ * and otherwise with a multiply by a precomputed inverse (D. Lemire et al,
+ * "Faster Remainder by Direct Computation"). either way, the result is the
+ * same as that of hash % size.
+ */
+struct vr_geometry {
+    unsigned int vg_size;
+    unsigned int vg_mask;
+    uint64_t vg_magic;
+};
+
+static inline void
+vr_geometry_init(struct vr_geometry *geo, unsigned int size)
+{
+    geo->vg_size = size;
+    geo->vg_mask = 0;
+    geo->vg_magic = 0;
+
+    if (!size)
+        return;
+
+    if (!(size & (size - 1)))
+        geo->vg_mask = size - 1;
+    else
+        geo->vg_magic = ((uint64_t)-1) / size + 1;
+
+    return;
+}
+
+static inline unsigned int
+vr_geometry_size(struct vr_geometry *geo)
+{
+    return geo->vg_size;
+}
+
+static inline unsigned int
+vr_geometry_reduce(struct vr_geometry *geo, unsigned int hash)
+{
+    if (!geo->vg_magic)
+        return hash & geo->vg_mask;
+
+#ifdef __SIZEOF_INT128__
+    return (unsigned int)(((unsigned __int128)(geo->vg_magic * hash) *
+                geo->vg_size) >> 64);
+#else
+    return hash % geo->vg_size;
+#endif
+}
+
+/* the slot after 'index', in a table that is probed linearly */
+static inline unsigned int
+vr_geometry_next(struct vr_geometry *geo, unsigned int index)
+{
+    return (++index == geo->vg_size) ? 0 : index;
+}
+
+#endif /* __VR_GEOMETRY_H__ */
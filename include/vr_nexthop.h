@@ -50,12 +50,29 @@ enum nexthop_type {
 struct vr_packet;
 
 struct vr_forwarding_md;
+struct vr_ip;
 
 struct vr_component_nh {
     int cnh_label;
     struct vr_nexthop *cnh;
 };
 
+/*
+ * a flow that has no member of an ecmp composite yet is given the member
+ * of the bucket that the hash of its key falls in. et_member_ids are the
+ * ids of the members as of when the buckets were filled, which tell the
+ * buckets that can stay as they are when the members change
+ */
+#define NH_ECMP_BUCKETS             256
+#define NH_ECMP_MAX_MEMBERS         128
+#define NH_ECMP_NO_MEMBER           0xFF
+
+struct vr_ecmp_table {
+    unsigned char et_buckets[NH_ECMP_BUCKETS];
+    unsigned int et_member_cnt;
+    unsigned int et_member_ids[0];
+};
+
 struct vr_nexthop {
     __u8            nh_type;
     /*
@@ -92,6 +109,7 @@ struct vr_nexthop {
          struct {
             unsigned short cnt;
             struct vr_component_nh *component;
+            struct vr_ecmp_table *ecmp_table;
          } nh_composite;
 
     } nh_u;
@@ -123,6 +141,7 @@ struct vr_nexthop {
 #define nh_udp_tun_encap_len    nh_u.nh_udp_tun.tun_encap_len
 #define nh_component_cnt        nh_u.nh_composite.cnt
 #define nh_component_nh         nh_u.nh_composite.component
+#define nh_ecmp_table           nh_u.nh_composite.ecmp_table
 
 extern int vr_nexthop_init(struct vrouter *);
 extern void vr_nexthop_exit(struct vrouter *, bool);
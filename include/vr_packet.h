@@ -24,6 +24,7 @@
 #define VR_IP_PROTO_TCP         6
 #define VR_IP_PROTO_UDP         17
 #define	VR_IP_PROTO_GRE         47
+#define VR_IP_PROTO_ICMP6       58
 #define VR_GRE_FLAG_CSUM        (ntohs(0x8000))
 #define VR_GRE_FLAG_KEY         (ntohs(0x2000)) 
 
@@ -229,6 +230,7 @@ struct vr_vlan_hdr {
 #define VR_ETH_PROTO_ARP        0x806
 #define VR_ETH_PROTO_IP         0x800
 #define VR_ETH_PROTO_VLAN       0x8100
+#define VR_ETH_PROTO_IP6        0x86DD
 
 #define VR_DIAG_IP_CSUM         0xffff
 
@@ -277,6 +279,19 @@ struct vr_ip {
     unsigned int ip_daddr;
 } __attribute__((packed));
 
+/*
+ * the fixed header of an ipv6 packet. the addresses are in the order in
+ * which a flow key keeps them, and hence are copied to a key in one go
+ */
+struct vr_ip6 {
+    unsigned int ip6_flow;
+    unsigned short ip6_plen;
+    unsigned char ip6_nxt;
+    unsigned char ip6_hlim;
+    unsigned char ip6_src[VR_IP6_ADDRESS_LEN];
+    unsigned char ip6_dst[VR_IP6_ADDRESS_LEN];
+} __attribute__((packed));
+
 static inline bool
 vr_ip_fragment_tail(struct vr_ip *iph)
 {
@@ -345,6 +360,34 @@ vr_incremental_diff(unsigned int oldval, unsigned int newval,
     return;
 }
 
+/*
+ * one's complement sums are carried in 64 bits, and folded to the 16 bits
+ * of a checksum only once they are complete
+ */
+static inline unsigned short
+vr_csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return sum;
+}
+
+/*
+ * the checksum, with the difference that vr_incremental_diff gathers for
+ * the fields that changed added to it (RFC 1624, eqn. 3)
+ */
+static inline unsigned short
+vr_csum_update(unsigned short csum, unsigned int diff)
+{
+    uint64_t sum = (unsigned short)~csum;
+
+    sum += diff;
+    return ~vr_csum_fold(sum);
+}
+
 struct vr_tcp {
     unsigned short tcp_sport;
     unsigned short tcp_dport;
@@ -368,6 +411,12 @@ struct vr_udp {
 #define VR_ICMP_TYPE_ECHO_REPLY     0
 #define VR_ICMP_TYPE_ECHO           8
 
+#define VR_ICMP6_TYPE_ECHO          128
+#define VR_ICMP6_TYPE_ECHO_REPLY    129
+/* router solicitation to redirect, the neighbour discovery messages */
+#define VR_ICMP6_TYPE_ROUTER_SOL    133
+#define VR_ICMP6_TYPE_REDIRECT      137
+
 struct vr_icmp {
     uint8_t icmp_type;
     uint8_t icmp_code;
@@ -458,6 +507,8 @@ struct vr_forwarding_md {
     int8_t fmd_ecmp_src_nh_index;
     int16_t fmd_dvrf;
     uint32_t fmd_outer_src_ip;
+    /* hash of the flow key, as of the flow lookup. 0 if there was none */
+    uint32_t fmd_flow_hash;
 };
 
 static inline void
@@ -469,6 +520,7 @@ vr_init_forwarding_md(struct vr_forwarding_md *fmd)
     fmd->fmd_label = -1;
     fmd->fmd_dvrf = -1;
     fmd->fmd_outer_src_ip = 0;
+    fmd->fmd_flow_hash = 0;
     return;
 }
 
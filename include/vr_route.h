@@ -12,6 +12,7 @@ extern "C" {
 
 #define VR_NUM_ROUTES_PER_DUMP  20
 #define VR_MAX_VRFS             4096
+#define VR_MAX_BULK_ROUTES      1024
 
 #define METADATA_IP_SUBNET      0xA9FE0000 /* link local subnet (169.254.0.0/16) */
 #define METADATA_IP_MASK        (0xFFFF << 16)
@@ -58,6 +59,7 @@ struct vr_route {
 struct vr_rtable {
     int (*algo_add)(struct vr_rtable *, struct vr_route_req *);
     int (*algo_del)(struct vr_rtable *, struct vr_route_req *);
+    int (*algo_bulk_add)(struct vr_rtable *, struct vr_route_req *);
     struct vr_nexthop *(*algo_lookup)(unsigned int, struct vr_route_req *,
             struct vr_packet *);
     int (*algo_get)(unsigned int, struct vr_route_req *);
@@ -81,6 +83,7 @@ struct rtable_fspec {
 
     int (*route_add)(struct rtable_fspec *, struct vr_route_req *);
     int (*route_del)(struct rtable_fspec *, struct vr_route_req *);
+    int (*route_bulk_add)(struct rtable_fspec *, struct vr_route_req *);
     int (*route_dump)(struct rtable_fspec *, struct vr_route_req *);
 
     algo_init_decl algo_init[RT_MAX];
@@ -9,6 +9,8 @@
 struct sandesh_object_md {
     unsigned int obj_len;
     char *obj_type_string;
+    /* room needed, over obj_len, for the lists in the object */
+    unsigned int (*obj_get_size)(void *);
 };
 
 void *sandesh_alloc(unsigned int);
@@ -60,6 +60,11 @@ struct host_os {
     uint64_t (*hos_vtop)(void *);
     void *(*hos_page_alloc)(unsigned int);
     void (*hos_page_free)(void *, unsigned int);
+    /* optional, for hosts that can back memory with huge pages */
+    void *(*hos_huge_page_alloc)(unsigned int);
+    void (*hos_huge_page_free)(void *, unsigned int);
+    /* optional, for hosts that let the flow table be mapped by agent */
+    void (*hos_flow_table_unmap)(struct vrouter *);
 
     struct vr_packet *(*hos_palloc)(unsigned int);
     struct vr_packet *(*hos_palloc_head)(struct vr_packet *, unsigned int);
@@ -94,6 +99,9 @@ struct host_os {
                                    int (*is_label_l2)(unsigned int,
                                        unsigned int, unsigned short *));
     int  (*hos_pcow)(struct vr_packet *, unsigned short); 
+    struct vr_packet *(*hos_pclone_head)(struct vr_packet *,
+                                         struct vr_interface *,
+                                         unsigned short, unsigned short);
     __u16 (*hos_get_udp_src_port)(struct vr_packet *, 
                                   struct vr_forwarding_md *, unsigned short);
     int (*hos_pkt_from_vm_tcp_mss_adj)(struct vr_packet *);
@@ -110,6 +118,9 @@ struct host_os {
 #define vr_vtop                         vrouter_host->hos_vtop
 #define vr_page_alloc                   vrouter_host->hos_page_alloc
 #define vr_page_free                    vrouter_host->hos_page_free
+#define vr_huge_page_alloc              vrouter_host->hos_huge_page_alloc
+#define vr_huge_page_free               vrouter_host->hos_huge_page_free
+#define vr_flow_table_unmap             vrouter_host->hos_flow_table_unmap
 #define vr_palloc                       vrouter_host->hos_palloc
 #define vr_palloc_head                  vrouter_host->hos_palloc_head
 #define vr_pexpand_head                 vrouter_host->hos_pexpand_head
@@ -136,6 +147,7 @@ struct host_os {
 #define vr_pheader_pointer              vrouter_host->hos_pheader_pointer
 #define vr_pull_inner_headers           vrouter_host->hos_pull_inner_headers
 #define vr_pcow                         vrouter_host->hos_pcow
+#define vr_pclone_head                  vrouter_host->hos_pclone_head
 #define vr_pull_inner_headers_fast      vrouter_host->hos_pull_inner_headers_fast
 #define vr_get_udp_src_port             vrouter_host->hos_get_udp_src_port
 #define vr_pkt_from_vm_tcp_mss_adj      vrouter_host->hos_pkt_from_vm_tcp_mss_adj
@@ -155,10 +167,13 @@ struct vrouter {
     struct vr_rtable *vr_inet_mcast_rtable;
     struct vr_rtable *vr_bridge_rtable;
 
-    struct vr_btable *vr_flow_table;
-    struct vr_btable *vr_oflow_table;
+    struct vr_flow_table *vr_flow_table;
+    struct vr_flow_table *vr_flow6_table;
+    struct vr_flow_migration *vr_flow_migration;
+    unsigned int vr_flow_table_gen;
     struct vr_flow_table_info *vr_flow_table_info;
     unsigned int vr_flow_table_info_size;
+    struct vr_timer *vr_flow_aging_scanner;
 
     unsigned int vr_max_labels;
     struct vr_nexthop **vr_ilm;
@@ -10,6 +10,7 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
 #include <asm/page.h>
 #include <linux/netdevice.h>
 
@@ -22,18 +23,74 @@ short vr_flow_major = -1;
 static dev_t mem_dev;
 struct cdev *mem_cdev;
 
+/*
+ * all the opens of the device share the mapping of the inode that was
+ * opened first, so that the pages of a flow table can be taken away from
+ * every process that has them mapped. mem_lock orders the faults against
+ * that, as well as guarding the inode
+ */
+static DEFINE_MUTEX(mem_lock);
+static struct inode *mem_inode;
+static unsigned int mem_users;
+
+/*
+ * a mapping is of the flow table of one generation. once the table is
+ * resized, the pages that were not faulted in can not be of the same
+ * table any more, and hence the mapping has to be redone. the page is
+ * inserted under mem_lock, so that it is either in place before
+ * vr_mem_unmap takes the pages of the old table away, or is not inserted
+ * at all
+ */
 static int
 mem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-    struct vrouter *router = (struct vrouter *)vma->vm_private_data;
-    struct page *page;
+    struct vrouter *router = (struct vrouter *)vma->vm_file->private_data;
+    unsigned long gen = (unsigned long)vma->vm_private_data;
+    int ret;
     pgoff_t offset;
+    void *va;
+
+    if (!router)
+        return VM_FAULT_SIGBUS;
+
+    mutex_lock(&mem_lock);
+    if (gen != router->vr_flow_table_gen) {
+        mutex_unlock(&mem_lock);
+        return VM_FAULT_SIGBUS;
+    }
 
     offset = vmf->pgoff;
-    page = virt_to_page(vr_flow_get_va(router, offset << PAGE_SHIFT));
-    get_page(page);
-    vmf->page = page;
-    return 0;
+    va = vr_flow_get_va(router, offset << PAGE_SHIFT);
+    if (!va) {
+        mutex_unlock(&mem_lock);
+        return VM_FAULT_SIGBUS;
+    }
+
+    ret = vm_insert_page(vma, (unsigned long)vmf->virtual_address,
+            virt_to_page(va));
+    mutex_unlock(&mem_lock);
+
+    /* -EBUSY is of a fault that raced with another for the same page */
+    if (ret && (ret != -EBUSY))
+        return (ret == -ENOMEM) ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+
+    return VM_FAULT_NOPAGE;
+}
+
+/*
+ * takes away the pages of the flow table from all the processes that have
+ * it mapped. called once the table has been replaced, before the old one
+ * is freed. the faults that follow see the new generation and fail
+ */
+void
+vr_mem_unmap(struct vrouter *router)
+{
+    mutex_lock(&mem_lock);
+    if (mem_inode)
+        unmap_mapping_range(mem_inode->i_mapping, 0, 0, 1);
+    mutex_unlock(&mem_lock);
+
+    return;
 }
 
 static struct vm_operations_struct mem_vm_ops = {
@@ -51,7 +108,7 @@ mem_dev_mmap(struct file *fp, struct vm_area_struct *vma)
 
     size = vma->vm_end - vma->vm_start;
     flow_table_size = vr_flow_table_size(router) +
-        vr_oflow_table_size(router);
+        vr_oflow_table_size(router) + vr_flow6_table_size(router);
     if (size > flow_table_size)
         return -EINVAL;
 
@@ -60,7 +117,9 @@ mem_dev_mmap(struct file *fp, struct vm_area_struct *vma)
         return -EINVAL;
 
     vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-    vma->vm_private_data = (void *)router;
+    /* for vm_insert_page, which has to be told so before the faults */
+    vma->vm_flags |= VM_MIXEDMAP;
+    vma->vm_private_data = (void *)(unsigned long)router->vr_flow_table_gen;
     vma->vm_ops = &mem_vm_ops;
 
     return 0;
@@ -74,6 +133,13 @@ mem_dev_release(struct inode *inode, struct file *filp)
     if (router)
         filp->private_data = NULL;
 
+    mutex_lock(&mem_lock);
+    if (!--mem_users) {
+        iput(mem_inode);
+        mem_inode = NULL;
+    }
+    mutex_unlock(&mem_lock);
+
     return 0;
 }
 
@@ -87,6 +153,20 @@ mem_dev_open(struct inode *inode, struct file *filp)
     if (!filp->private_data)
         return -EINVAL;
 
+    mutex_lock(&mem_lock);
+    if (!mem_inode) {
+        mem_inode = igrab(inode);
+        if (!mem_inode) {
+            mutex_unlock(&mem_lock);
+            filp->private_data = NULL;
+            return -EINVAL;
+        }
+    }
+
+    filp->f_mapping = mem_inode->i_mapping;
+    mem_users++;
+    mutex_unlock(&mem_lock);
+
     return 0;
 }
 
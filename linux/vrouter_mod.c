@@ -41,6 +41,13 @@ int hashrnd_inited = 0;
 
 extern int vr_flow_entries;
 extern int vr_oflow_entries;
+extern int vr_flow6_entries;
+extern int vr_oflow6_entries;
+extern int vr_flow_queue_entries;
+extern int vr_flow_idle_timeout;
+extern int vr_mtrie_cbucket_runs;
+extern int vr_mtrie_layout;
+extern int vr_mtrie_rcache_entries;
 int vrouter_dbg;
 
 extern struct vr_packet *linux_get_packet(struct sk_buff *,
@@ -65,6 +72,7 @@ extern int vr_genetlink_init(void);
 extern void vr_genetlink_exit(void);
 extern int vr_mem_init(void);
 extern void vr_mem_exit(void);
+extern void vr_mem_unmap(struct vrouter *);
 
 extern void vhost_exit(void);
 
@@ -91,6 +99,12 @@ lh_free(void *mem)
     return;
 }
 
+/*
+ * there is no hos_huge_page_alloc for the module. the buddy allocator can
+ * not hand out more than MAX_ORDER pages in one piece, and what it does
+ * hand out is in the direct map already, so the tables that ask for huge
+ * pages are allocated as any other here
+ */
 static void *
 lh_page_alloc(unsigned int size)
 {
@@ -499,12 +513,131 @@ lh_pcow(struct vr_packet *pkt, unsigned short head_room)
     return 0;
 }
 
+/*
+ * lh_pclone_head - a replica of the packet whose first buffer is its own,
+ * with head_room bytes of head space and a copy of the first hdr_len bytes
+ * of the packet. the rest of the packet hangs off the replica as page
+ * frags that are shared by reference with the original and all other
+ * replicas. vif is the interface that the replica goes out of, if it is
+ * sent as is. the vr_packet fields beyond the buffer offsets are for the
+ * caller to fill
+ */
+static struct vr_packet *
+lh_pclone_head(struct vr_packet *pkt, struct vr_interface *vif,
+        unsigned short hdr_len, unsigned short head_room)
+{
+    int i, nr_frags = 0;
+    unsigned int csum_end, head_len;
+    struct net_device *dev;
+    struct page *page;
+    struct sk_buff *skb, *skb_head;
+    skb_frag_t *frag;
+
+    skb = vp_os_packet(pkt);
+    if (!skb)
+        return NULL;
+
+    /* the segmentation code would have to split the shared frags */
+    if (skb_is_gso(skb))
+        return NULL;
+
+    if (hdr_len > pkt_head_len(pkt))
+        hdr_len = pkt_head_len(pkt);
+    /* bytes of the first buffer that are shared rather than copied */
+    head_len = pkt_head_len(pkt) - hdr_len;
+
+    /*
+     * a device that cannot gather page frags has the stack linearize the
+     * replica, which is a copy of all of it rather than of the headers
+     */
+    if (pkt_len(pkt) > hdr_len) {
+        dev = vif ? (struct net_device *)vif->vif_os : NULL;
+        if (!dev || !(dev->features & NETIF_F_SG))
+            return NULL;
+
+        /* the payload has to be the page frags of the buffer, all of them */
+        if (skb_shinfo(skb)->frag_list ||
+                (pkt_len(pkt) - pkt_head_len(pkt) != skb->data_len))
+            return NULL;
+        /* pages of user space are not for us to hold on to */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0))
+        if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY)
+            return NULL;
+#endif
+
+        nr_frags = skb_shinfo(skb)->nr_frags;
+        if (head_len) {
+            /* a first buffer from kmalloc can not be referenced by page */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0))
+            if (!skb->head_frag)
+                return NULL;
+            nr_frags++;
+#else
+            return NULL;
+#endif
+        }
+
+        if (nr_frags > MAX_SKB_FRAGS)
+            return NULL;
+    }
+
+    /* the checksum has to be written where the copied headers are */
+    if (skb->ip_summed == CHECKSUM_PARTIAL) {
+        csum_end = skb->csum_start + skb->csum_offset + sizeof(__sum16);
+        if ((skb->csum_start < pkt->vp_data) ||
+                (csum_end > pkt->vp_data + hdr_len))
+            return NULL;
+    }
+
+    skb_head = alloc_skb(head_room + hdr_len, GFP_ATOMIC);
+    if (!skb_head)
+        return NULL;
+
+    skb_reserve(skb_head, head_room);
+    memcpy(skb_put(skb_head, hdr_len), pkt_data(pkt), hdr_len);
+
+    nr_frags = 0;
+    if (head_len) {
+        page = virt_to_head_page(skb->head);
+        get_page(page);
+        skb_fill_page_desc(skb_head, nr_frags++, page,
+                pkt_data(pkt) + hdr_len - (unsigned char *)page_address(page),
+                head_len);
+    }
+
+    for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+        frag = &skb_shinfo(skb)->frags[i];
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0))
+        __skb_frag_ref(frag);
+#else
+        get_page(frag->page);
+#endif
+        skb_shinfo(skb_head)->frags[nr_frags++] = *frag;
+    }
+    skb_shinfo(skb_head)->nr_frags = nr_frags;
+
+    skb_head->len += pkt_len(pkt) - hdr_len;
+    skb_head->data_len += pkt_len(pkt) - hdr_len;
+    skb_head->truesize += pkt_len(pkt) - hdr_len;
+
+    skb_head->dev = skb->dev;
+    skb_head->protocol = skb->protocol;
+    skb_head->ip_summed = skb->ip_summed;
+    skb_head->csum = skb->csum;
+    if (skb->ip_summed == CHECKSUM_PARTIAL) {
+        skb_head->csum_start = skb->csum_start - pkt->vp_data + head_room;
+        skb_head->csum_offset = skb->csum_offset;
+    }
+
+    return linux_get_packet(skb_head, pkt->vp_if);
+}
+
 /*
  * lh_get_udp_src_port - return a source port for the outer UDP header.
- * The source port is based on a hash of the inner IP source/dest addresses,
- * vrf (and inner TCP/UDP ports in the future). The label from fmd
- * will be used in the future to detect whether it is a L2/L3 packet.
- * Returns 0 on error, valid source port otherwise.
+ * The source port is based on the hash of the flow key that the flow
+ * lookup left in fmd, or else on a hash of the inner IP source/dest
+ * addresses, TCP/UDP ports and vrf. Returns 0 on error, valid source port
+ * otherwise.
  */
 static __u16
 lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
@@ -512,11 +645,10 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
 {
     struct sk_buff *skb = vp_os_packet(pkt);
     unsigned int pull_len;
-    __u32 ip_src, ip_dst, hashval, port_range;
+    __u32 ip_src, ip_dst, ports, hashval, port_range;
     struct iphdr *iph;
     __u32 *data;
     __u16 port;
-    int32_t flow_index = 0;
 
 
     if (hashrnd_inited == 0) {
@@ -524,7 +656,10 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
         hashrnd_inited = 1;
     }
 
-    if (pkt->vp_type == VP_TYPE_VXLAN) {
+    if (fmd->fmd_flow_hash) {
+        /* the 5-tuple and the vrf, hashed once, at the flow lookup */
+        hashval = fmd->fmd_flow_hash;
+    } else if (pkt->vp_type == VP_TYPE_VXLAN) {
 
         if (pkt_head_len(pkt) < ETH_HLEN)
             goto error;
@@ -581,19 +716,19 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
         ip_dst = iph->daddr;
 
         /*
-         * FIXME - The hash should include the ports in the inner packet if it is
-         * TCP/UDP. However, if the inner packet is a fragment, it may not have
-         * the L4 header if it is not the first fragment. To handle this case, 
-         * we will use the flow table index as an input to the hash if it is
-         * valid. In the future, we will implement an overflow hash table to 
-         * deal with IP fragments. When that happens, we will set the flow table
-         * index appropriately when an IP fragment is detected and it will
-         * be used as an input to jhash_3words() below.
+         * the ports, if they are there. fragments other than the first do
+         * not have them, and all the fragments hence go without
          */
-        if (fmd->fmd_flow_index != -1) {
-            flow_index = fmd->fmd_flow_index;
-        }
-        hashval = jhash_3words(ip_src, ip_dst, vrf, vr_hashrnd);
+        ports = 0;
+        if ((iph->protocol == VR_IP_PROTO_TCP ||
+                    iph->protocol == VR_IP_PROTO_UDP) &&
+                !(iph->frag_off & htons(IP_MF | IP_OFFSET)) &&
+                pkt_head_len(pkt) >= (iph->ihl * 4) + sizeof(ports))
+            memcpy(&ports, (unsigned char *)iph + (iph->ihl * 4),
+                    sizeof(ports));
+
+        hashval = jhash_3words(ip_src, ip_dst, ports, vr_hashrnd);
+        hashval = vr_hash_2words(hashval, vrf, vr_hashrnd);
     }
 
     lh_reset_skb_fields(pkt);
@@ -1776,6 +1911,7 @@ struct host_os linux_host = {
     .hos_vtop                       =       lh_vtop,
     .hos_page_alloc                 =       lh_page_alloc,
     .hos_page_free                  =       lh_page_free,
+    .hos_flow_table_unmap           =       vr_mem_unmap,
 
     .hos_palloc                     =       lh_palloc,
     .hos_palloc_head                =       lh_palloc_head,
@@ -1805,6 +1941,7 @@ struct host_os linux_host = {
     .hos_pheader_pointer            =       lh_pheader_pointer,
     .hos_pull_inner_headers         =       lh_pull_inner_headers,
     .hos_pcow                       =       lh_pcow,
+    .hos_pclone_head                =       lh_pclone_head,
     .hos_pull_inner_headers_fast    =       lh_pull_inner_headers_fast,
     .hos_get_udp_src_port           =       lh_get_udp_src_port,
     .hos_pkt_from_vm_tcp_mss_adj    =       lh_pkt_from_vm_tcp_mss_adj,
@@ -2025,6 +2162,20 @@ init_fail:
 
 module_param(vr_flow_entries, int, 0);
 module_param(vr_oflow_entries, int, 0);
+module_param(vr_flow6_entries, int, 0);
+MODULE_PARM_DESC(vr_flow6_entries, "Number of inet6 flow entries, default value is 65536 (0 leaves inet6 out of flow processing)");
+module_param(vr_oflow6_entries, int, 0);
+MODULE_PARM_DESC(vr_oflow6_entries, "Number of inet6 overflow flow entries, default value is 4096");
+module_param(vr_flow_queue_entries, int, 0);
+MODULE_PARM_DESC(vr_flow_queue_entries, "Number of packets held per flow while agent resolves it, default value is 3");
+module_param(vr_flow_idle_timeout, int, 0);
+MODULE_PARM_DESC(vr_flow_idle_timeout, "Seconds after which idle flows are removed by the datapath, default value is 0 (aging is left to agent). The removed flows are to be collected by agent with FLOW_AGED_GET, and aging stalls while they are not");
+module_param(vr_mtrie_cbucket_runs, int, 0);
+MODULE_PARM_DESC(vr_mtrie_cbucket_runs, "Route table buckets whose entries form at most these many runs are kept compressed, default value is 16 (0 disables compression)");
+module_param(vr_mtrie_layout, int, 0);
+MODULE_PARM_DESC(vr_mtrie_layout, "Route table layout of vrfs that do not ask for one: 1 for 8/8/8/8 (default), 2 for 16/8/8 (24/8 needs huge pages, which the module does not use)");
+module_param(vr_mtrie_rcache_entries, int, 0);
+MODULE_PARM_DESC(vr_mtrie_rcache_entries, "Entries of the route lookup cache of each cpu, a power of 2, default value is 256 (0 disables the cache)");
 module_param(vrouter_dbg, int, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(vrouter_dbg, "Set 1 for pkt dumping and 0 to disable, default value is 0");
 
@@ -43,10 +43,11 @@
 #define TABLE_FLAG_VALID        0x1
 #define MEM_DEV                 "/dev/flow"
 
-static int dvrf_set, mir_set;
+static int dvrf_set, mir_set, resize_set;
 static unsigned short dvrf;
 static int flow_index, list, flow_cmd, mirror = -1;
 static int rate;
+static unsigned int resize;
 
 struct flow_table {
     struct vr_flow_entry *ft_entries;
@@ -54,6 +55,11 @@ struct flow_table {
     u_int64_t ft_span;
     unsigned int ft_num_entries;
     unsigned int ft_flags;
+    u_int64_t ft_oflow_relocations;
+    u_int64_t ft_aged_flows;
+    u_int64_t ft_aged_log_full;
+    unsigned int ft_gen;
+    unsigned int ft_oentries;
 } main_table;
 
 int mem_fd;
@@ -75,7 +81,11 @@ dump_table(struct flow_table *ft)
     char action, flag_string[sizeof(fe->fe_flags) * 8 + 32];
     struct in_addr in_src, in_dest;
 
-    printf("Flow table\n\n");
+    printf("Flow table (generation %u, overflow relocations %llu, "
+            "aged flows %llu, aged log full %llu)\n\n", ft->ft_gen,
+            (unsigned long long)ft->ft_oflow_relocations,
+            (unsigned long long)ft->ft_aged_flows,
+            (unsigned long long)ft->ft_aged_log_full);
     printf(" Index              Source:Port           Destination:Port    \tProto(V)\n");
     printf("-----------------------------------------------------------------");
     printf("--------\n");
@@ -270,6 +280,11 @@ flow_table_map(vr_flow_req *req)
     }
 
     ft->ft_span = req->fr_ftable_size;
+    ft->ft_oflow_relocations = req->fr_oflow_relocations;
+    ft->ft_aged_flows = req->fr_aged_flows;
+    ft->ft_aged_log_full = req->fr_aged_log_full;
+    ft->ft_gen = req->fr_ftable_gen;
+    ft->ft_oentries = req->fr_oftable_entries;
     ft->ft_num_entries = ft->ft_span / sizeof(struct vr_flow_entry);
     return ft->ft_num_entries;
 }
@@ -288,6 +303,12 @@ vr_flow_req_process(void *sreq)
 
         break;
 
+    case FLOW_OP_FLOW_TABLE_RESIZE:
+        printf("Flow table resized to %u entries, %u overflow entries "
+                "(generation %u)\n", req->fr_ftable_entries,
+                req->fr_oftable_entries, req->fr_ftable_gen);
+        break;
+
     default:
         break;
     }
@@ -349,6 +370,17 @@ flow_table_get(void)
     return make_flow_req(&flow_req);
 }
 
+static int
+flow_table_resize(void)
+{
+    memset(&flow_req, 0, sizeof(flow_req));
+    flow_req.fr_op = FLOW_OP_FLOW_TABLE_RESIZE;
+    flow_req.fr_ftable_entries = resize;
+    flow_req.fr_oftable_entries = main_table.ft_oentries;
+
+    return make_flow_req(&flow_req);
+}
+
 static int
 flow_table_setup(void)
 {
@@ -379,6 +411,7 @@ flow_validate(int flow_index, char action)
     fe = flow_get(flow_index);
 
     flow_req.fr_op = FLOW_OP_FLOW_SET;
+    flow_req.fr_ftable_gen = main_table.ft_gen;
     flow_req.fr_index = flow_index;
     flow_req.fr_flags = VR_FLOW_FLAG_ACTIVE;
     flow_req.fr_flow_sip = fe->fe_key.key_src_ip;
@@ -422,6 +455,7 @@ Usage(void)
 {
     printf("flow [-f flow_index][-d flow_index][-i flow_index][-t flow_index]\n");
     printf("     [--mirror=mirror table index]\n");
+    printf("     [--resize=flow table entries]\n");
     printf("     [-l]\n");
     printf("\n");
 
@@ -432,6 +466,7 @@ Usage(void)
     printf("--mirror\tmirror index to mirror to\n");
     printf("-l\t\t List all flows\n");
     printf("-r\t\t Start dumping flow setup rate\n");
+    printf("--resize\t Grow the flow table to the given number of entries\n");
 
     exit(-EINVAL);
 }
@@ -439,19 +474,21 @@ Usage(void)
 enum opt_flow_index {
     DVRF_OPT_INDEX,
     MIRROR_OPT_INDEX,
+    RESIZE_OPT_INDEX,
     MAX_OPT_INDEX
 };
 
 static struct option long_options[] = {
     [DVRF_OPT_INDEX]    = {"dvrf", required_argument, &dvrf_set, 1},
     [MIRROR_OPT_INDEX]  = {"mirror", required_argument, &mir_set, 1},
+    [RESIZE_OPT_INDEX]  = {"resize", required_argument, &resize_set, 1},
     [MAX_OPT_INDEX]     = { NULL,  0,                 0        , 0}
 };
 
 static void
 validate_options(void)
 {
-    if (!flow_index && !list && !rate)
+    if (!flow_index && !list && !rate && !resize_set)
         Usage();
 
     return;
@@ -474,6 +511,12 @@ parse_long_opts(int opt_flow_index, char *opt_arg)
             Usage();
         break;
 
+    case RESIZE_OPT_INDEX:
+        resize = strtoul(opt_arg, NULL, 0);
+        if (errno || !resize)
+            Usage();
+        break;
+
     default:
         Usage();
     }
@@ -524,7 +567,9 @@ main(int argc, char *argv[])
     if (ret < 0)
         return ret;
 
-    if (list)
+    if (resize_set)
+        ret = flow_table_resize();
+    else if (list)
         flow_list();
     else if (rate)
         flow_rate();
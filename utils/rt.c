@@ -23,6 +23,7 @@
 #include <linux/if_ether.h>
 
 #include <net/if.h>
+#include <arpa/inet.h>
 #include <netinet/ether.h>
 
 #include "vr_types.h"
@@ -38,12 +39,16 @@ static struct nl_client *cl;
 static int resp_code;
 static vr_route_req rt_req;
 static bool proxy_set = false;
+static int vrf_layout = VR_RT_LAYOUT_DEFAULT;
+static uint8_t prefix6[VR_IP6_ADDRESS_LEN];
+static uint8_t marker6[VR_IP6_ADDRESS_LEN];
 
 void
 vr_route_req_process(void *s_req)
 {
     int ret, i;
     struct in_addr addr;
+    char addr6[INET6_ADDRSTRLEN];
     vr_route_req *rt = (vr_route_req *)s_req;
 
     rt_req.rtr_marker = rt->rtr_prefix;
@@ -61,7 +66,27 @@ vr_route_req_process(void *s_req)
     }
     rt_req.rtr_vrf_id = rt->rtr_vrf_id;
 
-    if (rt->rtr_family == AF_INET) {
+    if (rt->rtr_family == AF_INET6) {
+        if (rt->rtr_prefix6_size != VR_IP6_ADDRESS_LEN)
+            return;
+
+        memcpy(marker6, rt->rtr_prefix6, VR_IP6_ADDRESS_LEN);
+        rt_req.rtr_marker6 = (int8_t *)marker6;
+        rt_req.rtr_marker6_size = VR_IP6_ADDRESS_LEN;
+
+        inet_ntop(AF_INET6, rt->rtr_prefix6, addr6, sizeof(addr6));
+        ret = printf("%s/%-3d	%-3d", addr6, rt->rtr_prefix_len,
+                rt->rtr_replace_plen);
+        for (i = ret; i < 48; i++)
+            printf(" ");
+        printf("%5d        ", rt->rtr_label_flags);
+        if (rt->rtr_label_flags & VR_RT_LABEL_VALID_FLAG)
+            printf("%5d        ", rt->rtr_label);
+        else
+            printf("%5c        ", '-');
+        printf("%7d", rt->rtr_nh_id);
+        printf("\n");
+    } else if (rt->rtr_family == AF_INET) {
         if (rt->rtr_rt_type == RT_UCAST) {
             addr.s_addr = htonl(rt->rtr_prefix);
             ret = printf("%s/%-2d	%-2d", inet_ntoa(addr), rt->rtr_prefix_len, rt->rtr_replace_plen);
@@ -141,11 +166,20 @@ vr_build_route_request(unsigned int op, int family, unsigned int prefix, unsigne
         rt_req.rtr_label_flags = 0;
         rt_req.rtr_rt_type = rt_type;
         rt_req.rtr_replace_plen = replace_plen;
+        rt_req.rtr_vrf_layout = vrf_layout;
 
         if (proxy_set)
             rt_req.rtr_label_flags |= VR_RT_HOSTED_FLAG;
 
-        if (family == AF_INET) {
+        if (family == AF_INET6) {
+            rt_req.rtr_prefix = 0;
+            rt_req.rtr_prefix6 = (int8_t *)prefix6;
+            rt_req.rtr_prefix6_size = VR_IP6_ADDRESS_LEN;
+            if (label != -1) {
+                rt_req.rtr_label = label;
+                rt_req.rtr_label_flags |= VR_RT_LABEL_VALID_FLAG;
+            }
+        } else if (family == AF_INET) {
             if (rt_type == RT_UCAST) {
                 rt_req.rtr_src = 0;
             } else {
@@ -257,7 +291,10 @@ vr_route_op(int opt, int family, uint32_t prefix, uint32_t len,
         return -errno;
 
     if (opt == SANDESH_OP_DUMP) {
-        if (family == AF_INET) {
+        if (family == AF_INET6) {
+            printf("Kernel IPv6 routing table %d/%d/unicast\n", req->rtr_rid, vrf_id);
+            printf("Destination	PrefixLen                         Flags        Label          Nexthop\n");
+        } else if (family == AF_INET) {
             if (rt_type == RT_UCAST) {
                 printf("Kernel IP routing table %d/%d/unicast\n", req->rtr_rid, vrf_id);
                 printf("Destination	PrefixLen         Flags        Label          Nexthop\n");
@@ -287,13 +324,14 @@ usage()
            "       d - delete\n"
            "       b - dummp\n"
            "       n <nhop_id> \n"
-           "       p <prefix in dotted decimal form> \n"
+           "       p <prefix in dotted decimal or ipv6 form> \n"
            "       P <do proxy arp for this route> \n"
            "       l <prefix_length>\n"
            "       t <label/vnid>\n"
-           "       f <family 0 - AF_INET 1 - AF_BRIDGE>\n"
+           "       f <family 0 - AF_INET 1 - AF_BRIDGE 2 - AF_INET6>\n"
            "       e <mac address in : format>\n"
            "       r <replacement route preifx length for delete>\n"
+           "       L <table layout of a new vrf 1 - 8/8/8/8 2 - 16/8/8 3 - 24/8>\n"
            "       v <vrfid>\n");
 }
 
@@ -310,6 +348,7 @@ int main(int argc, char *argv[])
     char dst_mac[6] = {0,0,0,0,0,0};
     int family;
     uint32_t replace_plen = 100;
+    char *prefix_str = NULL;
 
     cl = nl_register_client();
     if (!cl) {
@@ -330,7 +369,7 @@ int main(int argc, char *argv[])
     label = -1;
     family = AF_INET;
 
-    while ((opt = getopt(argc, argv, "cdbmPn:p:l:v:t:s:e:f:r:")) != -1) {
+    while ((opt = getopt(argc, argv, "cdbmPn:p:l:v:t:s:e:f:r:L:")) != -1) {
             switch (opt) {
             case 'c':
                 op = SANDESH_OP_ADD;
@@ -354,7 +393,7 @@ int main(int argc, char *argv[])
                 break;
 
             case 'p':
-                prefix = inet_addr(optarg);
+                prefix_str = optarg;
                 break;
 
             case 'l':
@@ -380,6 +419,8 @@ int main(int argc, char *argv[])
                 family = atoi(optarg);
                 if (family == 0)
                     family = AF_INET;
+                else if (family == 2)
+                    family = AF_INET6;
                 else {
                     family = AF_BRIDGE;
                     rt_type = RT_UCAST;
@@ -397,6 +438,15 @@ int main(int argc, char *argv[])
                 proxy_set = true;
                 break;
 
+            case 'L':
+                vrf_layout = atoi(optarg);
+                if (vrf_layout <= VR_RT_LAYOUT_DEFAULT ||
+                        vrf_layout >= VR_RT_LAYOUT_MAX) {
+                    usage();
+                    exit(1);
+                }
+                break;
+
             case '?':
             default:
                 usage();
@@ -404,7 +454,19 @@ int main(int argc, char *argv[])
         }
     }
 
-    if ((op == SANDESH_OP_DELETE) && (replace_plen < 0 || replace_plen > 32)) {
+    if (prefix_str) {
+        if (family == AF_INET6) {
+            if (inet_pton(AF_INET6, prefix_str, prefix6) != 1) {
+                usage();
+                exit(1);
+            }
+        } else {
+            prefix = inet_addr(prefix_str);
+        }
+    }
+
+    if ((op == SANDESH_OP_DELETE) && (replace_plen < 0 ||
+                replace_plen > (family == AF_INET6 ? 128 : 32))) {
         usage();
         exit(1);
     }
@@ -43,6 +43,12 @@ static int get_set, dump_set;
 static int verbose_set, help_set;
 static bool dump_pending = false;
 
+static const char *rt_layouts[VR_RT_LAYOUT_MAX] = {
+    [VR_RT_LAYOUT_8_8_8_8]  =   "8/8/8/8",
+    [VR_RT_LAYOUT_16_8_8]   =   "16/8/8",
+    [VR_RT_LAYOUT_24_8]     =   "24/8",
+};
+
 void
 vr_vrf_stats_req_process(void *s_req)
 {
@@ -63,6 +69,12 @@ vr_vrf_stats_req_process(void *s_req)
             stats->vsr_udp_mpls_tunnels, stats->vsr_gre_mpls_tunnels);
     printf("L2 Encaps %" PRIu64 ", Encaps %" PRIu64 "\n",
             stats->vsr_l2_encaps, stats->vsr_encaps);
+    if (stats->vsr_rt_memory && stats->vsr_rt_layout > VR_RT_LAYOUT_DEFAULT &&
+            stats->vsr_rt_layout < VR_RT_LAYOUT_MAX)
+        printf("Route Table Layout %s, Memory %" PRIu64 " bytes, Buckets %d"
+                ", Compressed Buckets %d\n", rt_layouts[stats->vsr_rt_layout],
+                stats->vsr_rt_memory, stats->vsr_rt_buckets,
+                stats->vsr_rt_cbuckets);
 
     printf("\n");
     return;